@@ -0,0 +1,241 @@
+/*
+ * Golden vectors for btgatt-bench.c.
+ *
+ * The UUID, advertising, scan response and notification vectors were
+ * captured from str2uuid(), set_adv_data(), set_adv_response() and
+ * send_notification() of btgatt-server.c as first shipped, with the HCI and
+ * ATT calls recorded instead of sent.  They are the bytes the Android and
+ * iOS apps were written against: when a check fails, fix the code, not the
+ * vector.  The result and Write Command stream vectors follow the
+ * provisioning wire formats described above enum wifi_proto.
+ */
+
+#define GOLDEN_SERVICE_UUID_STR "6e400000-0000-4e98-8024-bc5b71e0893e"
+
+// uuid_parse(): bytes in the order written
+static const uint8_t golden_service_uuid[16] = {
+    0x6e, 0x40, 0x00, 0x00, 0x00, 0x00, 0x4e, 0x98,
+    0x80, 0x24, 0xbc, 0x5b, 0x71, 0xe0, 0x89, 0x3e,
+};
+
+// LE Set Advertising Data parameters: flags, 128-bit service UUID, TX power
+static const uint8_t golden_adv_data[32] = {
+    0x18, 0x02, 0x01, 0x04, 0x11, 0x07, 0x3e, 0x89,
+    0xe0, 0x71, 0x5b, 0xbc, 0x24, 0x80, 0x98, 0x4e,
+    0x00, 0x00, 0x00, 0x00, 0x40, 0x6e, 0x02, 0x0a,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
+// LE Set Scan Response Data parameters for a device name
+static const struct {
+    const char *name;
+    size_t name_used;           // name bytes that fit
+    uint8_t param[32];
+} golden_scan_rsp[] = {
+    {
+        "3RHUB-DD:EE:FF", 14,
+        {
+            0x10, 0x0f, 0x09, 0x33, 0x52, 0x48, 0x55, 0x42,
+            0x2d, 0x44, 0x44, 0x3a, 0x45, 0x45, 0x3a, 0x46,
+            0x46, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        },
+    },
+    {
+        "", 0,
+        {
+            0x02, 0x01, 0x09, 0x00, 0x00, 0x00, 0x00, 0x00,
+            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        },
+    },
+    {
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789", 29,
+        {
+            0x1f, 0x1e, 0x09, 0x41, 0x42, 0x43, 0x44, 0x45,
+            0x46, 0x47, 0x48, 0x49, 0x4a, 0x4b, 0x4c, 0x4d,
+            0x4e, 0x4f, 0x50, 0x51, 0x52, 0x53, 0x54, 0x55,
+            0x56, 0x57, 0x58, 0x59, 0x5a, 0x30, 0x31, 0x32,
+        },
+    },
+};
+
+/*
+ * Notifications as send_notification() queues them: each message goes out
+ * as frag_len[m] fragments at MTU golden_notify_mtu[m] which, back to back,
+ * give wire.
+ */
+#define GOLDEN_NOTIFY_MTUS 3
+
+static const uint16_t golden_notify_mtu[GOLDEN_NOTIFY_MTUS] = { 23, 185, 517 };
+
+#define GOLDEN_NETS_303 \
+    "{\"nets\":[{\"ssid\":\"HomeNet-00\",\"rssi\":-40,\"sec\":3,\"ch\":1}," \
+    "{\"ssid\":\"HomeNet-01\",\"rssi\":-41,\"sec\":2,\"ch\":6}," \
+    "{\"ssid\":\"HomeNet-02\",\"rssi\":-42,\"sec\":2,\"ch\":11}," \
+    "{\"ssid\":\"HomeNet-03\",\"rssi\":-43,\"sec\":3,\"ch\":36}," \
+    "{\"ssid\":\"HomeNet-04\",\"rssi\":-44,\"sec\":2,\"ch\":44}," \
+    "{\"ssid\":\"HomeNet-05\",\"rssi\":-45,\"sec\":2,\"ch\":149}]}"
+
+#define GOLDEN_NETS_1034 \
+    "{\"nets\":[{\"ssid\":\"HomeNet-00\",\"rssi\":-40,\"sec\":3,\"ch\":1}," \
+    "{\"ssid\":\"HomeNet-01\",\"rssi\":-41,\"sec\":2,\"ch\":6}," \
+    "{\"ssid\":\"HomeNet-02\",\"rssi\":-42,\"sec\":2,\"ch\":11}," \
+    "{\"ssid\":\"HomeNet-03\",\"rssi\":-43,\"sec\":3,\"ch\":36}," \
+    "{\"ssid\":\"HomeNet-04\",\"rssi\":-44,\"sec\":2,\"ch\":44}," \
+    "{\"ssid\":\"HomeNet-05\",\"rssi\":-45,\"sec\":2,\"ch\":149}," \
+    "{\"ssid\":\"HomeNet-06\",\"rssi\":-46,\"sec\":3,\"ch\":1}," \
+    "{\"ssid\":\"HomeNet-07\",\"rssi\":-47,\"sec\":2,\"ch\":6}," \
+    "{\"ssid\":\"HomeNet-08\",\"rssi\":-48,\"sec\":2,\"ch\":11}," \
+    "{\"ssid\":\"HomeNet-09\",\"rssi\":-49,\"sec\":3,\"ch\":36}," \
+    "{\"ssid\":\"HomeNet-10\",\"rssi\":-50,\"sec\":2,\"ch\":44}," \
+    "{\"ssid\":\"HomeNet-11\",\"rssi\":-51,\"sec\":2,\"ch\":149}," \
+    "{\"ssid\":\"HomeNet-12\",\"rssi\":-52,\"sec\":3,\"ch\":1}," \
+    "{\"ssid\":\"HomeNet-13\",\"rssi\":-53,\"sec\":2,\"ch\":6}," \
+    "{\"ssid\":\"HomeNet-14\",\"rssi\":-54,\"sec\":2,\"ch\":11}," \
+    "{\"ssid\":\"HomeNet-15\",\"rssi\":-55,\"sec\":3,\"ch\":36}," \
+    "{\"ssid\":\"HomeNet-16\",\"rssi\":-56,\"sec\":2,\"ch\":44}," \
+    "{\"ssid\":\"HomeNet-17\",\"rssi\":-57,\"sec\":2,\"ch\":149}," \
+    "{\"ssid\":\"HomeNet-18\",\"rssi\":-58,\"sec\":3,\"ch\":1}," \
+    "{\"ssid\":\"HomeNet-19\",\"rssi\":-59,\"sec\":2,\"ch\":6}," \
+    "{\"ssid\":\"HomeNet-20\",\"rssi\":-60,\"sec\":2,\"ch\":11}]}"
+
+static const struct {
+    const char *message;
+    const char *wire;
+    size_t wire_len;
+    uint8_t frags[GOLDEN_NOTIFY_MTUS];
+    uint16_t frag_len[GOLDEN_NOTIFY_MTUS][64];
+} golden_notify[] = {
+    {
+        "{\"err\":\"conn fail\"}",
+        "{\"err\":\"conn fail\"}", 19,
+        { 1, 1, 1 },
+        {
+            { 19 },
+            { 19 },
+            { 19 },
+        },
+    },
+    {
+        "{\"ip\":\"10.0.100.12\"}",
+        "{\"ip\":\"10.0.100.12\"}", 20,
+        { 1, 1, 1 },
+        {
+            { 20 },
+            { 20 },
+            { 20 },
+        },
+    },
+    {
+        "{\"ip\":\"192.168.1.23\"}",
+        "{\"ip\":\"192.168.1.23\"}\n", 22,
+        { 2, 1, 1 },
+        {
+            { 20, 2 },
+            { 22 },
+            { 22 },
+        },
+    },
+    {
+        "{\"ip\":\"192.168.100.200\",\"net\":3}",
+        "{\"ip\":\"192.168.100.200\",\"net\":3}\n", 33,
+        { 2, 1, 1 },
+        {
+            { 20, 13 },
+            { 33 },
+            { 33 },
+        },
+    },
+    {
+        GOLDEN_NETS_303,
+        GOLDEN_NETS_303 "\n", 304,
+        { 16, 2, 1 },
+        {
+            { 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20,
+              4 },
+            { 182, 122 },
+            { 304 },
+        },
+    },
+    {
+        GOLDEN_NETS_1034,
+        GOLDEN_NETS_1034 "\n", 1035,
+        { 52, 6, 3 },
+        {
+            { 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20,
+              20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20,
+              20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20,
+              20, 20, 20, 20, 20, 20, 15 },
+            { 182, 182, 182, 182, 182, 125 },
+            { 514, 514, 7 },
+        },
+    },
+};
+
+// wifi_json_encode_result(): the strings the first release sent, and "net"
+// for a batch
+static const struct {
+    enum wifi_status status;
+    const char *ip;
+    int net;
+    const char *json;
+} golden_json_result[] = {
+    { WIFI_STATUS_OK, "192.168.1.23", -1, "{\"ip\":\"192.168.1.23\"}" },
+    { WIFI_STATUS_OK, "192.168.1.23", 1, "{\"ip\":\"192.168.1.23\",\"net\":1}" },
+    { WIFI_STATUS_NO_IP, NULL, -1, "{\"ip\":\"\"}" },
+    { WIFI_STATUS_BAD_FORMAT, NULL, -1, "{\"err\":\"bad fmt\"}" },
+    { WIFI_STATUS_BAD_SSID, NULL, -1, "{\"err\":\"bad ssid\"}" },
+    { WIFI_STATUS_CMD_FAIL, NULL, -1, "{\"err\":\"cmd fail\"}" },
+    { WIFI_STATUS_CONN_FAIL, NULL, -1, "{\"err\":\"conn fail\"}" },
+    { WIFI_STATUS_BLE_LOST, NULL, -1, "{\"err\":\"BLE lost\"}" },
+    { WIFI_STATUS_BUSY, NULL, -1, "{\"err\":\"busy\"}" },
+};
+
+// wifi_tlv_encode_result(): seq 7, connected to 192.168.1.23 as candidate 1
+static const uint8_t golden_tlv_result_ok[] = {
+    0x01, 0x81, 0x07, 0x0c, 0x00, 0x10, 0x01, 0x00,
+    0x11, 0x04, 0xc0, 0xa8, 0x01, 0x17, 0x12, 0x01,
+    0x01, 0x1c, 0x35,
+};
+
+// wifi_tlv_encode_result(): seq 8, WIFI_STATUS_CONN_FAIL
+static const uint8_t golden_tlv_result_fail[] = {
+    0x01, 0x81, 0x08, 0x03, 0x00, 0x10, 0x01, 0x05,
+    0x12, 0xa6,
+};
+
+/*
+ * A Write Command stream: a JSON request, an empty line, a TLV Connect
+ * frame (SSID "HomeNet", PSK "secret123"), a second JSON request and the
+ * start of a third.  However it is cut into writes, it must yield the
+ * messages below in order and keep the last 12 bytes for the next write.
+ */
+static const uint8_t golden_stream[] = {
+    // {"ssid":"HomeNet","pw":"secret123"} and the empty line
+    0x7b, 0x22, 0x73, 0x73, 0x69, 0x64, 0x22, 0x3a, 0x22, 0x48, 0x6f, 0x6d,
+    0x65, 0x4e, 0x65, 0x74, 0x22, 0x2c, 0x22, 0x70, 0x77, 0x22, 0x3a, 0x22,
+    0x73, 0x65, 0x63, 0x72, 0x65, 0x74, 0x31, 0x32, 0x33, 0x22, 0x7d, 0x0a,
+    0x0a,
+    // TLV Connect: version, type, seq 0x2a, LE16 length, SSID, PSK, CRC
+    0x01, 0x01, 0x2a, 0x14, 0x00, 0x01, 0x07, 0x48, 0x6f, 0x6d, 0x65, 0x4e,
+    0x65, 0x74, 0x02, 0x09, 0x73, 0x65, 0x63, 0x72, 0x65, 0x74, 0x31, 0x32,
+    0x33, 0xd4, 0xaa,
+    // {"ssid":"Cafe","pw":""}
+    0x7b, 0x22, 0x73, 0x73, 0x69, 0x64, 0x22, 0x3a, 0x22, 0x43, 0x61, 0x66,
+    0x65, 0x22, 0x2c, 0x22, 0x70, 0x77, 0x22, 0x3a, 0x22, 0x22, 0x7d, 0x0a,
+    // {"ssid":"Lib, continued by a later write
+    0x7b, 0x22, 0x73, 0x73, 0x69, 0x64, 0x22, 0x3a, 0x22, 0x4c, 0x69, 0x62,
+};
+
+static const struct {
+    size_t offset;
+    size_t len;
+} golden_stream_msgs[] = {
+    {  0, 35 },        // {"ssid":"HomeNet","pw":"secret123"}
+    { 37, 27 },        // TLV Connect, CRC 0xaad4
+    { 64, 23 },        // {"ssid":"Cafe","pw":""}
+};
+
+#define GOLDEN_STREAM_LEFTOVER 12
@@ -0,0 +1,634 @@
+/*
+ *  Wire-format checks and micro-benchmarks for btgatt-server.c
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+/*
+ * btgatt-server.c is included with main() compiled out, so what is checked
+ * and timed here is the server's own code:
+ *
+ *   notify_frames_push/peek/pop        notification fragments per ATT MTU
+ *   write_arena_store/consume and      Prepare Write and Write Command
+ *   write_stream_frame_len             reassembly
+ *   uuid_parse, uuid2str               the service UUID
+ *   adv_encode_data/scan_rsp           advertising payloads
+ *   wifi_json/tlv_encode_result        result messages
+ *
+ * Every output is first compared byte for byte with btgatt-bench-golden.h;
+ * the benchmark only runs when all of it matches.  Each path is then timed
+ * at ATT MTU 23, 185 and 517 with payloads of 16 B to 4 KB, reporting ns
+ * and heap allocations per operation.  Build it from the top of a built
+ * BlueZ tree, next to the server in tools/ and against the same libraries,
+ * with the mock WiFi backend so D-Bus is not needed:
+ *
+ *   gcc -O2 -I. -DBTGATT_NO_MAIN -DWIFI_BACKEND_MOCK=1 \
+ *       -o tools/btgatt-bench tools/btgatt-bench.c \
+ *       src/.libs/libshared-mainloop.a lib/.libs/libbluetooth-internal.a \
+ *       -lcjson -lpthread
+ *
+ *   ./btgatt-bench             check, then benchmark
+ *   ./btgatt-bench -c          check only
+ *   ./btgatt-bench -n 1000000  iterations per benchmark case
+ *
+ * The exit status is 1 when a check fails.
+ */
+
+#include <stdlib.h>
+
+// malloc() and calloc() calls made by the server code, for allocs/op
+static unsigned long bench_allocs;
+
+static void *bench_malloc(size_t size)
+{
+    bench_allocs++;
+    return malloc(size);
+}
+
+static void *bench_calloc(size_t nmemb, size_t size)
+{
+    bench_allocs++;
+    return calloc(nmemb, size);
+}
+
+#define malloc(size) bench_malloc(size)
+#define calloc(nmemb, size) bench_calloc(nmemb, size)
+
+#include "btgatt-server.c"
+
+#undef malloc
+#undef calloc
+
+#include "btgatt-bench-golden.h"
+
+#define N_ELEMENTS(a) (sizeof(a) / sizeof((a)[0]))
+
+#define ATT_NOTIFY_HDR_LEN 3     // opcode, handle
+#define ATT_PREP_WRITE_HDR_LEN 5 // opcode, handle, offset
+#define ATT_WRITE_HDR_LEN 3      // opcode, handle
+
+static unsigned int checks_passed;
+static unsigned int checks_failed;
+
+static bool check(bool ok, const char *fmt, ...)
+{
+    va_list ap;
+
+    if (ok) {
+        checks_passed++;
+        return true;
+    }
+
+    checks_failed++;
+    printf("[FAIL] ");
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    printf("\n");
+    return false;
+}
+
+static bool check_bytes(const char *what, const uint8_t *got, size_t got_len,
+                const uint8_t *want, size_t want_len)
+{
+    char hex[3 * 64 + 1];
+
+    if (check(got_len == want_len && !memcmp(got, want, want_len),
+              "%s: %zu bytes differ from the %zu golden ones", what,
+              got_len, want_len)) {
+        return true;
+    }
+
+    printf("       got  %s\n", trace_hex(hex, sizeof(hex), got, got_len));
+    printf("       want %s\n", trace_hex(hex, sizeof(hex), want, want_len));
+    return false;
+}
+
+static void check_uuid(void)
+{
+    uint8_t value[16];
+    char str[37];
+
+    check(!strcmp(LINUXBOX_SERVICE_UUID_STR, GOLDEN_SERVICE_UUID_STR),
+          "service UUID is %s", LINUXBOX_SERVICE_UUID_STR);
+
+    check(uuid_parse(GOLDEN_SERVICE_UUID_STR, value) == 0,
+          "uuid_parse: %s rejected", GOLDEN_SERVICE_UUID_STR);
+    check_bytes("uuid_parse", value, sizeof(value), golden_service_uuid,
+                sizeof(golden_service_uuid));
+
+    uuid2str(golden_service_uuid, str, sizeof(str));
+    check(!strcmp(str, GOLDEN_SERVICE_UUID_STR), "uuid2str: %s", str);
+
+    check(uuid_parse("6e400000-0000-4e98-8024-bc5b71e0893", value) < 0,
+          "uuid_parse: short UUID accepted");
+}
+
+static void check_adv(void)
+{
+    struct bt_hci_cmd_le_set_adv_data adv;
+    struct bt_hci_cmd_le_set_scan_rsp_data rsp;
+    uint8_t uuid[16];
+    size_t i, used;
+
+    // As adv_build_data() does it
+    uuid_parse(LINUXBOX_SERVICE_UUID_STR, uuid);
+    adv_encode_data(uuid, &adv);
+    check_bytes("adv_encode_data", (const uint8_t *) &adv, sizeof(adv),
+                golden_adv_data, sizeof(golden_adv_data));
+
+    for (i = 0; i < N_ELEMENTS(golden_scan_rsp); i++) {
+        used = adv_encode_scan_rsp(golden_scan_rsp[i].name, &rsp);
+        check(used == golden_scan_rsp[i].name_used,
+              "adv_encode_scan_rsp(\"%s\"): %zu name bytes used, not %zu",
+              golden_scan_rsp[i].name, used, golden_scan_rsp[i].name_used);
+        check_bytes("adv_encode_scan_rsp", (const uint8_t *) &rsp, sizeof(rsp),
+                    golden_scan_rsp[i].param, sizeof(golden_scan_rsp[i].param));
+    }
+}
+
+// Queue @message as send_notification() does and drain it into @wire
+static bool notify_roundtrip(struct notify_frames *q, const char *message,
+                size_t frag_size, uint8_t *wire, size_t *wire_len,
+                uint16_t *frag_len, unsigned int *frags)
+{
+    size_t len = strlen(message);
+    const uint8_t *frag;
+    uint16_t n;
+
+    if (!notify_frames_push(q, message, len, len > NOTIFY_UNTERMINATED_MAX,
+                            frag_size))
+        return false;
+
+    *wire_len = 0;
+    *frags = 0;
+    while ((frag = notify_frames_peek(q, &n))) {
+        memcpy(wire + *wire_len, frag, n);
+        *wire_len += n;
+        if (*frags < NOTIFY_QUEUE_MAX_FRAGS)
+            frag_len[*frags] = n;
+        (*frags)++;
+        notify_frames_pop(q);
+    }
+
+    return true;
+}
+
+static void check_notify(void)
+{
+    static struct notify_frames q;
+    static uint8_t wire[NOTIFY_QUEUE_SIZE], big[4096];
+    uint16_t frag_len[NOTIFY_QUEUE_MAX_FRAGS];
+    const char *a;
+    size_t wire_len = 0, len, sent, i;
+    unsigned int m, n, frags = 0;
+    const uint8_t *frag;
+
+    for (i = 0; i < N_ELEMENTS(golden_notify); i++) {
+        for (m = 0; m < GOLDEN_NOTIFY_MTUS; m++) {
+            notify_frames_clear(&q);
+            if (!check(notify_roundtrip(&q, golden_notify[i].message,
+                            golden_notify_mtu[m] - ATT_NOTIFY_HDR_LEN, wire,
+                            &wire_len, frag_len, &frags),
+                       "notify: %zu byte message refused at MTU %u",
+                       strlen(golden_notify[i].message), golden_notify_mtu[m]))
+                continue;
+
+            check_bytes("notify", wire, wire_len,
+                        (const uint8_t *) golden_notify[i].wire,
+                        golden_notify[i].wire_len);
+            if (!check(frags == golden_notify[i].frags[m],
+                       "notify: %u fragments at MTU %u, not %u", frags,
+                       golden_notify_mtu[m], golden_notify[i].frags[m]))
+                continue;
+            for (n = 0; n < frags; n++)
+                check(frag_len[n] == golden_notify[i].frag_len[m][n],
+                      "notify: fragment %u is %u bytes at MTU %u, not %u",
+                      n, frag_len[n], golden_notify_mtu[m],
+                      golden_notify[i].frag_len[m][n]);
+        }
+    }
+
+    /*
+     * A second message queued behind a half-sent one that would run past
+     * the end of the buffer moves the unsent bytes to the front first; the
+     * client still gets all of both, in order.
+     */
+    a = golden_notify[N_ELEMENTS(golden_notify) - 1].wire;
+    len = strlen(a);
+    sent = 2 * (517 - ATT_NOTIFY_HDR_LEN);
+    notify_frames_clear(&q);
+    notify_frames_push(&q, a, len, false, 517 - ATT_NOTIFY_HDR_LEN);
+    notify_frames_pop(&q);
+    notify_frames_pop(&q);
+    check(notify_frames_push(&q, a, len, false, 517 - ATT_NOTIFY_HDR_LEN) &&
+          q.head == 0,
+          "notify: queue not compacted for a second message");
+    wire_len = 0;
+    while ((frag = notify_frames_peek(&q, &frag_len[0]))) {
+        memcpy(wire + wire_len, frag, frag_len[0]);
+        wire_len += frag_len[0];
+        notify_frames_pop(&q);
+    }
+    check(wire_len == 2 * len - sent && !memcmp(wire, a + sent, len - sent) &&
+          !memcmp(wire + len - sent, a, len),
+          "notify: compacted queue sent the wrong bytes");
+
+    // Too many fragments for the ring: refused whole, nothing queued
+    memset(big, 'x', sizeof(big));
+    notify_frames_clear(&q);
+    check(!notify_frames_push(&q, big, sizeof(big), true,
+                              23 - ATT_NOTIFY_HDR_LEN) &&
+          !notify_frames_peek(&q, &frag_len[0]),
+          "notify: oversized message queued");
+}
+
+static void check_result(void)
+{
+    char json[64];
+    uint8_t tlv[64];
+    size_t i, len;
+
+    for (i = 0; i < N_ELEMENTS(golden_json_result); i++) {
+        len = wifi_json_encode_result(golden_json_result[i].status,
+                                      golden_json_result[i].ip,
+                                      golden_json_result[i].net,
+                                      json, sizeof(json));
+        check(len == strlen(golden_json_result[i].json) &&
+              !strcmp(json, golden_json_result[i].json),
+              "wifi_json_encode_result(%d): %s, not %s",
+              golden_json_result[i].status, json, golden_json_result[i].json);
+    }
+
+    len = wifi_tlv_encode_result(7, WIFI_STATUS_OK, "192.168.1.23", 1, tlv);
+    check_bytes("wifi_tlv_encode_result", tlv, len, golden_tlv_result_ok,
+                sizeof(golden_tlv_result_ok));
+    len = wifi_tlv_encode_result(8, WIFI_STATUS_CONN_FAIL, NULL, -1, tlv);
+    check_bytes("wifi_tlv_encode_result", tlv, len, golden_tlv_result_fail,
+                sizeof(golden_tlv_result_fail));
+}
+
+/*
+ * Prepare Write fragments at their offsets, then the replay on Execute
+ * Write stores the same fragments again, as wifi_config_write_cb() sees
+ * them.
+ */
+static uint8_t prepare_write(struct write_arena *arena, const uint8_t *value,
+                size_t len, size_t frag_size)
+{
+    size_t off, n;
+    int pass;
+    uint8_t err;
+
+    write_arena_reset(arena);
+    for (pass = 0; pass < 2; pass++) {
+        for (off = 0; off < len; off += n) {
+            n = len - off > frag_size ? frag_size : len - off;
+            err = write_arena_store(arena, off, value + off, n);
+            if (err)
+                return err;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Feed @len bytes of Write Command stream in writes of @frag_size, taking
+ * messages off as wifi_config_write_cb() does; @cb sees each one.
+ */
+static bool write_stream(struct write_arena *arena, const uint8_t *data,
+                size_t len, size_t frag_size,
+                void (*cb)(const uint8_t *msg, size_t msg_len, void *user_data),
+                void *user_data)
+{
+    ssize_t frame_len;
+    size_t off, n, msg_len;
+
+    for (off = 0; off < len; off += n) {
+        n = len - off > frag_size ? frag_size : len - off;
+        if (write_arena_store(arena, arena->len, data + off, n))
+            return false;
+
+        while (arena->len) {
+            frame_len = write_stream_frame_len(arena->data, arena->len,
+                                               &arena->scanned);
+            if (frame_len < 0)
+                return false;
+            if (frame_len == 0)
+                break;
+
+            msg_len = arena->data[0] == WIFI_TLV_VERSION ? frame_len :
+                      frame_len - 1;
+            if (msg_len)
+                cb(arena->data, msg_len, user_data);
+            write_arena_consume(arena, frame_len);
+        }
+    }
+
+    return true;
+}
+
+struct stream_check {
+    size_t frag_size;
+    unsigned int msgs;
+};
+
+static void stream_check_cb(const uint8_t *msg, size_t msg_len, void *user_data)
+{
+    struct stream_check *sc = user_data;
+    unsigned int i = sc->msgs++;
+
+    if (!check(i < N_ELEMENTS(golden_stream_msgs),
+               "write stream: extra %zu byte message in %zu byte writes",
+               msg_len, sc->frag_size))
+        return;
+
+    check(msg_len == golden_stream_msgs[i].len &&
+          !memcmp(msg, golden_stream + golden_stream_msgs[i].offset, msg_len),
+          "write stream: message %u wrong in %zu byte writes", i,
+          sc->frag_size);
+}
+
+static void check_write(void)
+{
+    static const uint8_t oversized[] = { WIFI_TLV_VERSION, 0x01, 0x00, 0xff, 0xff };
+    static uint8_t big[WRITE_ARENA_MAX + 1];
+    size_t frag_sizes[GOLDEN_NOTIFY_MTUS + 2];
+    struct write_arena arena = { 0 };
+    struct stream_check sc;
+    size_t scanned = 0, i;
+    const char *value = GOLDEN_NETS_1034;
+    unsigned int m;
+
+    // Prepare/Execute Write: the value comes out as written
+    for (m = 0; m < GOLDEN_NOTIFY_MTUS; m++) {
+        check(prepare_write(&arena, (const uint8_t *) value, strlen(value),
+                            golden_notify_mtu[m] - ATT_PREP_WRITE_HDR_LEN) == 0,
+              "prepare write: rejected at MTU %u", golden_notify_mtu[m]);
+        check_bytes("prepare write", arena.data, arena.len,
+                    (const uint8_t *) value, strlen(value));
+    }
+    check(write_arena_store(&arena, arena.len + 1, big, 1) ==
+          BT_ATT_ERROR_INVALID_OFFSET, "prepare write: hole accepted");
+    check(write_arena_store(&arena, 0, big, sizeof(big)) ==
+          BT_ATT_ERROR_PREPARE_QUEUE_FULL, "prepare write: oversized value accepted");
+    write_arena_reset(&arena);
+
+    // Write Command stream, cut every way a client may cut it
+    for (m = 0; m < GOLDEN_NOTIFY_MTUS; m++)
+        frag_sizes[m] = golden_notify_mtu[m] - ATT_WRITE_HDR_LEN;
+    frag_sizes[m++] = 1;
+    frag_sizes[m++] = sizeof(golden_stream);
+
+    for (i = 0; i < N_ELEMENTS(frag_sizes); i++) {
+        sc.frag_size = frag_sizes[i];
+        sc.msgs = 0;
+        write_arena_reset(&arena);
+        check(write_stream(&arena, golden_stream, sizeof(golden_stream),
+                           frag_sizes[i], stream_check_cb, &sc),
+              "write stream: rejected in %zu byte writes", frag_sizes[i]);
+        check(sc.msgs == N_ELEMENTS(golden_stream_msgs),
+              "write stream: %u messages in %zu byte writes", sc.msgs,
+              frag_sizes[i]);
+        check(arena.len == GOLDEN_STREAM_LEFTOVER &&
+              !memcmp(arena.data, golden_stream + sizeof(golden_stream) -
+                      GOLDEN_STREAM_LEFTOVER, GOLDEN_STREAM_LEFTOVER),
+              "write stream: %zu bytes left over in %zu byte writes",
+              arena.len, frag_sizes[i]);
+    }
+
+    check(write_stream_frame_len(oversized, sizeof(oversized), &scanned) < 0,
+          "write stream: oversized TLV frame accepted");
+
+    write_arena_release(&arena);
+}
+
+static uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+struct bench_case {
+    uint16_t mtu;
+    const uint8_t *payload;
+    size_t len;
+    struct write_arena arena;
+    struct notify_frames notify;
+    volatile unsigned long sink;        // keeps results live
+};
+
+typedef bool (*bench_fn)(struct bench_case *bc);
+
+// One message, queued and drained as the pacing timer would
+static bool bench_notify(struct bench_case *bc)
+{
+    const uint8_t *frag;
+    uint16_t n;
+
+    if (!notify_frames_push(&bc->notify, bc->payload, bc->len,
+                            bc->len > NOTIFY_UNTERMINATED_MAX,
+                            bc->mtu - ATT_NOTIFY_HDR_LEN))
+        return false;
+
+    while ((frag = notify_frames_peek(&bc->notify, &n))) {
+        bc->sink += frag[n - 1];
+        notify_frames_pop(&bc->notify);
+    }
+
+    return true;
+}
+
+// One Prepare/Execute Write transaction
+static bool bench_prepare(struct bench_case *bc)
+{
+    if (prepare_write(&bc->arena, bc->payload, bc->len,
+                      bc->mtu - ATT_PREP_WRITE_HDR_LEN))
+        return false;
+
+    bc->sink += bc->arena.data[bc->len - 1];
+    write_arena_reset(&bc->arena);
+    return true;
+}
+
+static void bench_stream_cb(const uint8_t *msg, size_t msg_len, void *user_data)
+{
+    struct bench_case *bc = user_data;
+
+    bc->sink += msg_len;
+}
+
+// One '\n' terminated request in Write Commands
+static bool bench_command(struct bench_case *bc)
+{
+    return write_stream(&bc->arena, bc->payload, bc->len,
+                        bc->mtu - ATT_WRITE_HDR_LEN, bench_stream_cb, bc);
+}
+
+static bool bench_uuid(struct bench_case *bc)
+{
+    uint8_t value[16];
+    char str[37];
+
+    uuid_parse(LINUXBOX_SERVICE_UUID_STR, value);
+    uuid2str(value, str, sizeof(str));
+    bc->sink += str[35];
+    return true;
+}
+
+static bool bench_adv(struct bench_case *bc)
+{
+    struct bt_hci_cmd_le_set_adv_data adv;
+    struct bt_hci_cmd_le_set_scan_rsp_data rsp;
+
+    adv_encode_data(golden_service_uuid, &adv);
+    adv_encode_scan_rsp(golden_scan_rsp[0].name, &rsp);
+    bc->sink += adv.len + rsp.len;
+    return true;
+}
+
+static bool bench_result(struct bench_case *bc)
+{
+    char json[64];
+    uint8_t tlv[64];
+
+    bc->sink += wifi_json_encode_result(WIFI_STATUS_OK, "192.168.1.23", 1,
+                                        json, sizeof(json));
+    bc->sink += wifi_tlv_encode_result(7, WIFI_STATUS_OK, "192.168.1.23", 1,
+                                       tlv);
+    return true;
+}
+
+static void bench_run(const char *name, bench_fn fn, struct bench_case *bc,
+                unsigned int iterations)
+{
+    unsigned long allocs;
+    uint64_t start, elapsed;
+    unsigned int i;
+
+    if (bc->mtu)
+        printf("%-10s %5u %6zu ", name, bc->mtu, bc->len);
+    else
+        printf("%-10s %5s %6s ", name, "-", "-");
+
+    // Also warms the arena pool, as a long-running server would have it
+    if (!fn(bc)) {
+        printf("%10s %10s  (does not fit)\n", "-", "-");
+        return;
+    }
+
+    allocs = bench_allocs;
+    start = bench_now_ns();
+    for (i = 0; i < iterations; i++)
+        fn(bc);
+    elapsed = bench_now_ns() - start;
+
+    printf("%10.1f %10.2f\n", (double) elapsed / iterations,
+           (double) (bench_allocs - allocs) / iterations);
+}
+
+static void bench_all(unsigned int iterations)
+{
+    static const uint16_t mtus[] = { 23, 185, 517 };
+    static const size_t sizes[] = { 16, 64, 256, 1024, 4096 };
+    static const struct {
+        const char *name;
+        bench_fn fn;
+    } paths[] = {
+        { "notify", bench_notify },
+        { "prepare", bench_prepare },
+        { "command", bench_command },
+    };
+    static uint8_t payload[4096];
+    static struct bench_case bc;
+    size_t i, p, s, m;
+
+    // A JSON-looking body; Write Command requests end in '\n'
+    payload[0] = '{';
+    for (i = 1; i < sizeof(payload); i++)
+        payload[i] = 'a' + i % 26;
+
+    printf("%-10s %5s %6s %10s %10s\n", "path", "mtu", "bytes", "ns/op",
+           "allocs/op");
+
+    for (p = 0; p < N_ELEMENTS(paths); p++) {
+        for (m = 0; m < N_ELEMENTS(mtus); m++) {
+            for (s = 0; s < N_ELEMENTS(sizes); s++) {
+                payload[sizes[s] - 1] = '\n';
+                memset(&bc.arena, 0, sizeof(bc.arena));
+                notify_frames_clear(&bc.notify);
+                bc.mtu = mtus[m];
+                bc.payload = payload;
+                bc.len = sizes[s];
+                bench_run(paths[p].name, paths[p].fn, &bc, iterations);
+                write_arena_release(&bc.arena);
+                payload[sizes[s] - 1] = 'a' + (sizes[s] - 1) % 26;
+            }
+        }
+    }
+
+    bc.mtu = 0;
+    bc.len = 0;
+    bench_run("uuid", bench_uuid, &bc, iterations);
+    bench_run("adv", bench_adv, &bc, iterations);
+    bench_run("result", bench_result, &bc, iterations);
+}
+
+static void usage(void)
+{
+    printf("btgatt-bench\n");
+    printf("Usage:\n\tbtgatt-bench [options]\n");
+    printf("Options:\n"
+           "\t-c\t\tCheck the golden vectors only\n"
+           "\t-n <count>\tIterations per benchmark case (default 100000)\n"
+           "\t-h\t\tShow help\n");
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int iterations = 100000;
+    bool check_only = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "cn:h")) != -1) {
+        switch (opt) {
+        case 'c':
+            check_only = true;
+            break;
+        case 'n':
+            iterations = strtoul(optarg, NULL, 0);
+            if (!iterations) {
+                fprintf(stderr, "Invalid iteration count: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'h':
+            usage();
+            return EXIT_SUCCESS;
+        default:
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    check_uuid();
+    check_adv();
+    check_notify();
+    check_result();
+    check_write();
+
+    printf("[CHECK] %u passed, %u failed\n", checks_passed, checks_failed);
+    if (checks_failed)
+        return EXIT_FAILURE;
+
+    if (!check_only)
+        bench_all(iterations);
+
+    return EXIT_SUCCESS;
+}
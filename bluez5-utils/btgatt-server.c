@@ -35,6 +35,7 @@
 #include <sys/ioctl.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <sys/wait.h>
 #include <sys/select.h>
 #include <sys/signal.h>
@@ -59,6 +60,7 @@
 
 #include <cjson/cJSON.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <stdio.h>
@@ -68,15 +70,46 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <dirent.h>
 #include <linux/types.h>
 #include <linux/netlink.h>
 #include <linux/rtnetlink.h>
 #include <linux/if_addr.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <ifaddrs.h>
 #include <syslog.h>
 
+// NetworkManager D-Bus backend; build with -DWIFI_BACKEND_NM_DBUS=0 to use nmcli
+#ifndef WIFI_BACKEND_NM_DBUS
+#define WIFI_BACKEND_NM_DBUS 1
+#endif
+
+// Benchmark builds: no NetworkManager, delays taken from the environment
+#ifndef WIFI_BACKEND_MOCK
+#define WIFI_BACKEND_MOCK 0
+#endif
+
+#if WIFI_BACKEND_MOCK
+#undef WIFI_BACKEND_NM_DBUS
+#define WIFI_BACKEND_NM_DBUS 0
+#endif
+
+#if WIFI_BACKEND_NM_DBUS
+#include <dbus/dbus.h>
+#endif
+
+// Set-up, tear-down and options only main() uses; unreferenced with
+// -DBTGATT_NO_MAIN
+#ifdef BTGATT_NO_MAIN
+#define MAIN_ONLY __attribute__((unused))
+#else
+#define MAIN_ONLY
+#endif
+
 // Avoid multiple definitions of network interface flags
 #ifdef __linux__
 #include <net/if.h>
@@ -94,22 +127,39 @@ static struct server *server_create(int fd);
 
 static void start_advertising(void);
 static void stop_advertising(void);
+static void hci_adv_disable_sync(void);
+static void schedule_restart_listen(struct server *server);
+struct write_arena;
+static void write_arena_release(struct write_arena *arena);
+static bool send_cmd(uint16_t opcode, const void *params, uint8_t params_len);
 static void reset_no_client_timeout(void);
 static void no_client_timeout_cb(int timeout_id, void *user_data);
+static void provisioning_finish(void);
 static const char* get_device_name(void);
-static int get_wifi_mac(char* mac_buf);
+static int get_wifi_mac(char* mac_buf, int wait_ms);
 static void send_socket_command(const char *command);
 
 // Keep the original 128-bit definitions for fallback
 #define LINUXBOX_SERVICE_UUID_STR "6e400000-0000-4e98-8024-bc5b71e0893e"
 #define WIFI_CONFIG_CHAR_UUID_STR "6e400001-0000-4e98-8024-bc5b71e0893e"
+#define WIFI_SCAN_CHAR_UUID_STR "6e400002-0000-4e98-8024-bc5b71e0893e"
+#define PROTO_VERSION_CHAR_UUID_STR "6e400003-0000-4e98-8024-bc5b71e0893e"
 
 
 #define HUB_V3_SUPPORT
 
 static struct hci_dev_info hdi;
+static int hci_index = -1;      // -i: controller to use, default first up
 static int ctl;
-static struct server *server;
+
+// Simultaneous ATT connections served; advertising pauses at the limit
+#define MAX_CONNECTIONS 3
+
+static struct queue *servers;		// connected clients, in accept order
+static struct gatt_db *gatt_db;		// shared by every connection
+static struct gatt_db_attribute *wifi_chara_att;
+static uint16_t wifi_chara_handle;
+static uint16_t scan_chara_handle;
 
 #define ATT_CID 4
 
@@ -127,30 +177,150 @@ static struct server *server;
 
 
 static bool verbose = false;
+static bool le_2m_phy = true;  // -p 1m keeps every link on the LE 1M PHY
 static int user_timeout_seconds = NO_CLIENT_TIMEOUT_SECONDS; // User-specified timeout
 
+// How long a provisioning job waits for DHCP after associating
+#define IP_WAIT_TIMEOUT_SECONDS 15
+static int ip_wait_seconds = IP_WAIT_TIMEOUT_SECONDS;
+
+/*
+ * Per-session provisioning latency trace: the monotonic time each phase of
+ * a connection was first reached (0 = never).  SESSION_LAST_WRITE is
+ * overwritten by every write.  One JSON record per connection is appended
+ * to SESSION_TRACE_PATH from att_disconnect_cb().
+ */
+enum session_phase {
+    SESSION_ACCEPT,
+    SESSION_FIRST_PDU,
+    SESSION_MTU_EXCHANGE,
+    SESSION_PHY_UPDATE,         // LE PHY Update Complete
+    SESSION_CCCD_ENABLE,
+    SESSION_FIRST_WRITE,
+    SESSION_LAST_WRITE,
+    SESSION_REQUEST_PARSED,
+    SESSION_CONNECT_START,      // worker: nmcli / D-Bus activation
+    SESSION_CONNECT_END,
+    SESSION_IP_ACQUIRED,
+    SESSION_CLEANUP_DONE,       // worker: old connections deleted
+    SESSION_SYNC_START,         // worker: profile fsync, see wifi_persist_profiles()
+    SESSION_SYNC_DONE,
+    SESSION_NOTIFY_SENT,        // result queued for the client
+    SESSION_NOTIFY_ACKED,       // last fragment sent or confirmed
+    SESSION_PHASE_COUNT,
+};
+
+struct session_trace {
+    unsigned int id;
+    uint64_t phase_ms[SESSION_PHASE_COUNT];
+    unsigned int requests;
+    int status;                 // last wifi_status answered, -1 if none
+    const char *proto;
+    uint8_t tx_phy;             // LE_PHY_* in use, 1M until an update
+    uint8_t rx_phy;
+};
+
+/*
+ * Per-connection reassembly buffer for long writes.  It starts empty and
+ * grows through size classes of WRITE_ARENA_MIN << 2 * n bytes, up to
+ * WRITE_ARENA_MAX, which is enough for EAP credentials with a CA
+ * certificate.  See write_arena_reserve().
+ */
+#define WRITE_ARENA_MIN 1024
+#define WRITE_ARENA_CLASSES 3
+#define WRITE_ARENA_MAX (WRITE_ARENA_MIN << 2 * (WRITE_ARENA_CLASSES - 1))
+
+struct write_arena {
+    uint8_t *data;
+    size_t size;                // 0 or one of the size classes
+    size_t len;                 // contiguous bytes received
+    size_t scanned;             // Write Command stream: bytes searched for '\n'
+};
+
+/*
+ * Notification bytes waiting to go out on one connection: whole messages,
+ * already cut into fragments of at most one ATT payload.  Only byte
+ * bookkeeping, see notify_frames_push(); pacing and retries belong to the
+ * server.
+ */
+#define NOTIFY_QUEUE_SIZE 2048
+#define NOTIFY_QUEUE_MAX_FRAGS 64
+
+struct notify_frames {
+    uint8_t buf[NOTIFY_QUEUE_SIZE];
+    size_t head;                // first unsent byte
+    size_t tail;
+    uint16_t frag[NOTIFY_QUEUE_MAX_FRAGS];      // ring of fragment lengths
+    unsigned int frag_head;
+    unsigned int frag_count;
+};
+
 struct server {
 	int fd;
 	struct bt_att *att;
-	struct gatt_db *db;
 	struct bt_gatt_server *gatt;
-	struct gatt_db_attribute *chara_att;
-	uint16_t chara_handle;
+	bool connected;
 	bool notifying;
 	bool notification_ready;
 	pthread_mutex_t notification_lock;
+	uint16_t mtu;			// negotiated ATT MTU
+	uint16_t conn_handle;		// HCI handle of the LE link
+	bool indicating;		// client asked for confirmed delivery
+    // Outgoing notification queue, sliced into fragments when queued
+    struct notify_frames notify;
+    unsigned int notify_retries;
+    int notify_timer_id;
+    bool notify_timer_armed;
+    bool notify_wait_conf;
     // BLE GATT long write buffer for WiFi config
-#define MAX_WRITE_BUFFER 1024
-    char write_buffer[MAX_WRITE_BUFFER];
-    size_t write_buffer_len;
-    bool write_in_progress;
+    struct write_arena arena;
+    bool write_in_progress;     // a Prepare/Execute Write transaction is open
+    int exec_timer_id;
+    bool exec_timer_armed;
+    // Scan-results read cursor; a page is snapshotted at offset 0 so Read
+    // Blob continuations see the same bytes
+    bool scan_notifying;
+    uint8_t scan_page;
+    uint8_t scan_page_buf[BT_ATT_MAX_VALUE_LEN];
+    uint16_t scan_page_len;
+    // Connection parameters: fast until CONN_FAST_IDLE_MS without traffic
+    bool conn_fast;
+    uint64_t conn_activity_ms;
+    int conn_timer_id;
+    bool conn_timer_armed;
+    struct session_trace session;
 };
 
 // Forward declaration
 void ble_init(void);
 
+// Largest ATT MTU accepted from the client in Exchange MTU
+#define GATT_SERVER_MAX_MTU BT_ATT_MAX_LE_MTU
+// LE Data Length Extension limits (Core spec Vol 6, Part B, 4.5.10)
+#define LE_MAX_TX_OCTETS 251
+#define LE_MAX_TX_TIME 2120
+// L2CAP basic header carried in each LL PDU along with the ATT PDU
+#define L2CAP_HDR_SIZE 4
+// LE PHYs (Core spec Vol 4, Part E, 7.8.48-49): values in PHY Update
+// Complete, bits in the LE Set (Default) PHY preferences
+#define LE_PHY_1M 0x01
+#define LE_PHY_2M 0x02
+#define LE_PHY_CODED 0x03
+#define LE_PHYS_1M 0x01
+#define LE_PHYS_2M 0x02
+// Connection intervals in 1.25 ms units, supervision timeout in 10 ms units.
+// Fast while a client is provisioning, relaxed once it sits idle.
+#define CONN_FAST_MIN_INTERVAL 6        // 7.5 ms
+#define CONN_FAST_MAX_INTERVAL 12       // 15 ms
+#define CONN_FAST_LATENCY 0
+#define CONN_RELAXED_MIN_INTERVAL 24    // 30 ms
+#define CONN_RELAXED_MAX_INTERVAL 40    // 50 ms
+#define CONN_RELAXED_LATENCY 4
+#define CONN_SUPERVISION_TIMEOUT 500    // 5 s
+#define CONN_FAST_IDLE_MS 3000
+
 // LED control macros
-#define SUPERVISOR_PATH "/usr/local/bin/supervisor"
+#define SUPERVISOR_SOCKET_PATH "/run/led_socket"
 #define LED_SYS_WIFI_CONFIG_PENDING "led sys_wifi_config_pending"
 #define LED_SYS_WIFI_CONFIGURING "led sys_wifi_configuring"
 #define LED_SYS_WIFI_SUCCESS "led sys_wifi_config_success" 
@@ -159,11 +329,13 @@ void ble_init(void);
 #define SETTING_WIFI_NOTIFY "setting wifi_notify"
 
 // Global state management variables
-static bool client_connected = false;
 static bool advertising = false;
 static int wifi_success_count = 0;
-static volatile bool should_exit = false;
+static bool should_exit = false;
 static unsigned int no_client_timeout_id = 0;
+// -d: stay loaded between sessions, armed and disarmed by the supervisor
+static bool resident = false;
+static bool armed = true;
 
 
 
@@ -171,387 +343,3826 @@ static unsigned int no_client_timeout_id = 0;
 #define TEST_ATT_LOG 0  // Set to 1 to enable att log, 0 to disable
 #define TEST_MAX_WIFI_SUCCESS_COUNT 1
 
-static void send_socket_command(const char *command)
+/*
+ * Native client for the supervisor's /run/led_socket.  One AF_UNIX
+ * connection is kept open and each command goes out as a length-prefixed
+ * {"cmd-<type>": "<value>"} frame, the same JSON SupervisorClient sends.
+ * Commands are fire-and-forget: the socket is non-blocking, replies are
+ * discarded, and a command that cannot be written right away is dropped
+ * rather than delaying the caller.  Callers include the provisioning
+ * worker, hence the lock.
+ */
+static int supervisor_fd = -1;
+static pthread_mutex_t supervisor_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void supervisor_disconnect(void)
 {
-    char full_cmd[256];
-    
-    // Check if supervisor file exists
-    if (access(SUPERVISOR_PATH, F_OK) != 0) {
-        printf("[PROXY] Warning: %s not found, skipping LED command\n", SUPERVISOR_PATH);
-        return;
-    }
-    
-    snprintf(full_cmd, sizeof(full_cmd), "%s %s", SUPERVISOR_PATH, command);
-    printf("[PROXY] Executing: %s\n", full_cmd);
-    
-    int result = system(full_cmd);
-    if (result != 0) {
-        printf("[PROXY] Warning: socket command failed: %d.\n", result);
+    if (supervisor_fd >= 0) {
+        close(supervisor_fd);
+        supervisor_fd = -1;
     }
 }
 
-// WiFi management helper functions
-static char* get_current_wifi_ssid(void)
+static int supervisor_connect(void)
 {
-    FILE *fp = popen("nmcli -t -f active,ssid dev wifi | grep '^yes:' | cut -d':' -f2", "r");
-    if (!fp) {
-        return NULL;
-    }
-    
-    char *ssid = malloc(256);
-    if (fgets(ssid, 256, fp)) {
-        // Remove newline character
-        ssid[strcspn(ssid, "\n")] = 0;
-        pclose(fp);
-        return ssid;
+    struct sockaddr_un addr;
+    int fd;
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -errno;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, SUPERVISOR_SOCKET_PATH, sizeof(addr.sun_path) - 1);
+
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        int err = -errno;
+
+        close(fd);
+        return err;
     }
-    
-    pclose(fp);
-    free(ssid);
-    return NULL;
+
+    supervisor_fd = fd;
+    return 0;
 }
 
-static char* get_wlan_ip_address(void)
+// Throw away pending replies; notices when the supervisor hung up
+static void supervisor_drain(void)
 {
-    FILE *fp = popen("ip -4 addr show wlan0 | grep -oP '(?<=inet\\s)\\d+(\\.\\d+){3}' | head -n1", "r");
-    if (!fp) {
-        return NULL;
-    }
-    
-    char *ip = malloc(64);
-    if (fgets(ip, 64, fp)) {
-        // 移除换行符
-        ip[strcspn(ip, "\n")] = 0;
-        pclose(fp);
-        return ip;
-    }
-    
-    pclose(fp);
-    free(ip);
-    return NULL;
+    char buf[256];
+    ssize_t n;
+
+    do {
+        n = recv(supervisor_fd, buf, sizeof(buf), 0);
+    } while (n > 0);
+
+    if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+        supervisor_disconnect();
 }
 
-static bool is_valid_ip(const char *ip)
+static int supervisor_send(const char *frame, size_t len)
 {
-    if (!ip || strlen(ip) == 0) {
-        return false;
-    }
-    
-    // 检查是否为有效的IPv4地址（简单检查）
-    int parts = 0;
-    char *ip_copy = strdup(ip);
-    char *token = strtok(ip_copy, ".");
-    
-    while (token != NULL && parts < 4) {
-        int num = atoi(token);
-        if (num < 0 || num > 255) {
-            free(ip_copy);
-            return false;
+    int attempt, err = 0;
+    ssize_t n;
+
+    // One retry on a fresh connection when the supervisor went away
+    for (attempt = 0; attempt < 2; attempt++) {
+        if (supervisor_fd < 0) {
+            err = supervisor_connect();
+            if (err < 0)
+                return err;
         }
-        parts++;
-        token = strtok(NULL, ".");
+
+        supervisor_drain();
+        if (supervisor_fd < 0)
+            continue;
+
+        n = send(supervisor_fd, frame, len, MSG_NOSIGNAL);
+        if (n == (ssize_t) len)
+            return 0;
+
+        // A partial frame would desync the stream, so start over
+        err = n < 0 ? -errno : -EIO;
+        supervisor_disconnect();
+
+        if (err != -EPIPE && err != -ECONNRESET && err != -ENOTCONN)
+            return err;
     }
-    
-    free(ip_copy);
-    return parts == 4;
+
+    return err ? err : -ENOTCONN;
 }
 
-static void cleanup_old_connections(const char *current_ssid)
+// @command is "<type> <value>", as passed to the supervisor CLI
+static void send_socket_command(const char *command)
 {
-    char cmd[512];
-    FILE *fp;
-    char line[256];
-    
-    printf("[WIFI] Cleaning up old WiFi connections (keeping: %s)\n", current_ssid);
-    
-    // 获取所有WiFi连接
-    fp = popen("nmcli -t -f name,type connection show | grep ':802-11-wireless' | cut -d':' -f1", "r");
-    if (!fp) {
-        printf("[WIFI] Failed to get connection list\n");
+    char frame[260];
+    const char *value = strchr(command, ' ');
+    int len, err;
+
+    if (!value) {
+        printf("[PROXY] Warning: malformed command '%s'\n", command);
         return;
     }
-    
-    while (fgets(line, sizeof(line), fp)) {
-        // 移除换行符
-        line[strcspn(line, "\n")] = 0;
-        
-        // 跳过当前SSID的连接
-        if (strcmp(line, current_ssid) == 0) {
-            continue;
-        }
-        
-        // 删除其他WiFi连接
-        snprintf(cmd, sizeof(cmd), "nmcli connection delete '%s'", line);
-        printf("[WIFI] Removing old connection: %s\n", line);
-        system(cmd);
+
+    len = snprintf(frame + 4, sizeof(frame) - 4, "{\"cmd-%.*s\": \"%s\"}",
+                   (int) (value - command), command, value + 1);
+    if (len < 0 || len >= (int) sizeof(frame) - 4) {
+        printf("[PROXY] Warning: command too long '%s'\n", command);
+        return;
     }
-    
-    pclose(fp);
+
+    // 4-byte big-endian length prefix
+    frame[0] = (len >> 24) & 0xff;
+    frame[1] = (len >> 16) & 0xff;
+    frame[2] = (len >> 8) & 0xff;
+    frame[3] = len & 0xff;
+
+    printf("[PROXY] Sending: %s\n", frame + 4);
+
+    pthread_mutex_lock(&supervisor_lock);
+    err = supervisor_send(frame, len + 4);
+    pthread_mutex_unlock(&supervisor_lock);
+
+    if (err < 0)
+        printf("[PROXY] Warning: socket command failed: %s\n", strerror(-err));
 }
 
-static int process_wifi_config(const char *json_str, char *response, size_t response_len)
+struct wifi_job;
+static bool wifi_job_cancelled(struct wifi_job *job);
+static bool wifi_job_wait_ip(struct wifi_job *job, char *ip, size_t len);
+static void wifi_job_mark(struct wifi_job *job, enum session_phase phase);
+
+// Monotonic clock in milliseconds, immune to wall-clock changes via NTP
+static uint64_t now_ms(void)
 {
-    printf("[DEBUG] Processing JSON: %s\n", json_str);
-    
-    // 发送WiFi配置中LED指令
-    send_socket_command(LED_SYS_WIFI_CONFIGURING);
-    
-    cJSON *root = cJSON_Parse(json_str);
-    if (!root) {
-        printf("[DEBUG] Failed to parse JSON\n");
-        snprintf(response, response_len, "{\"err\":\"bad fmt\"}");
+    struct timespec ts;
 
-        send_socket_command(LED_SYS_WIFI_CONFIG_PENDING);
-        return -1;
-    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-    cJSON *ssid_item = cJSON_GetObjectItem(root, "ssid");
-    if (!ssid_item || !cJSON_IsString(ssid_item)) {
-        printf("[DEBUG] Missing or invalid SSID\n");
-        cJSON_Delete(root);
-        snprintf(response, response_len, "{\"err\":\"bad ssid\"}");
+/*
+ * Hot-path tracing.
+ *
+ * TRACE() records are formatted into a fixed lock-free ring (any thread may
+ * produce, only the mainloop consumes) and written to stdout in batches a
+ * short while after the first record of a batch arrives, rather than one
+ * write(2) per line.  Records carry a category and a level; the level is
+ * chosen at runtime with -v.  Build with -DBTGATT_TRACE=0 to compile every
+ * call site out.  Trace payload lengths and offsets, never payload bytes:
+ * writes carry WiFi passwords.
+ */
+#ifndef BTGATT_TRACE
+#define BTGATT_TRACE 1
+#endif
 
-        send_socket_command(LED_SYS_WIFI_CONFIG_PENDING);
-        return -1;
-    }
+enum trace_level {
+    TRACE_ERROR = 0,
+    TRACE_INFO,
+    TRACE_DEBUG,
+};
 
-    char *ssid = ssid_item->valuestring;
-    cJSON *password_item = cJSON_GetObjectItem(root, "pw");
-    char *password = NULL;
-    if (password_item && cJSON_IsString(password_item)) {
-        password = password_item->valuestring;
-    }
+#define TRACE_ATT   0x01
+#define TRACE_ADV   0x02
+#define TRACE_WIFI  0x04
+#define TRACE_HCI   0x08
+#define TRACE_ALL   0x0f
 
-    printf("[DEBUG] Target SSID: %s, Password: %s\n", 
-           ssid, password ? "***" : "none");
+static MAIN_ONLY int trace_level = TRACE_INFO;
 
-    // 1. 检查当前连接的SSID是否与目标SSID一致
-    char *current_ssid = get_current_wifi_ssid();
-    if (current_ssid && strcmp(current_ssid, ssid) == 0) {
-        printf("[WIFI] Already connected to target SSID: %s\n", ssid);
-        
-        // 获取当前IP地址
-        char *current_ip = get_wlan_ip_address();
-        if (current_ip && is_valid_ip(current_ip)) {
-            printf("[WIFI] Current connection is valid with IP: %s\n", current_ip);
-            wifi_success_count++;
-            
-            // 发送成功LED指令
-            send_socket_command(LED_SYS_WIFI_SUCCESS);
+#if BTGATT_TRACE
+#define TRACE_RING_SIZE 256     // power of two
+#define TRACE_MSG_LEN 120
+#define TRACE_FLUSH_DELAY_MS 100
 
-            // 确保网络配置被及时保护
-            system("sync");         
-            
-            snprintf(response, response_len, "{\"ip\":\"%s\"}", current_ip);
-            
-            free(current_ssid);
-            free(current_ip);
-            cJSON_Delete(root);
-            return 0;
-        }
-        
-        if (current_ip) free(current_ip);
-    }
-    
-    if (current_ssid) free(current_ssid);
+enum {
+    TRACE_SLOT_FREE = 0,
+    TRACE_SLOT_BUSY,            // claimed, being formatted
+    TRACE_SLOT_READY,
+};
 
-    // 2. 使用nmcli连接新的WiFi网络
-    char connect_cmd[512];
-    if (password && strlen(password) > 0) {
-        snprintf(connect_cmd, sizeof(connect_cmd), 
-                "nmcli device wifi connect '%s' password '%s' 2>&1", ssid, password);
-    } else {
-        snprintf(connect_cmd, sizeof(connect_cmd), 
-                "nmcli device wifi connect '%s' 2>&1", ssid);
-    }
-    
-    printf("[WIFI] Connecting with command: nmcli device wifi connect '%s' password '%s'\n", 
-           ssid, password ? "***" : "none");
-    
-    // 执行连接命令
-    FILE *cmd_fp = popen(connect_cmd, "r");
-    if (!cmd_fp) {
-        printf("[WIFI] Failed to execute nmcli command\n");
-        snprintf(response, response_len, "{\"err\":\"cmd fail\"}");
-        cJSON_Delete(root);
-        return -1;
-    }
-    
-    // Device 'wlan0' successfully activated with '26229f20-a62f-4192-9858-70e241bd141d'.
-    // Error: Connection activation failed: Secrets were required, but not provided.
-    // Error: No network with SSID 'TPLINK-20202' found.
-    char cmd_output[512] = {0};
-    bool cmd_success = false;
-    bool need_scan_retry = false;
-    
-    if (fgets(cmd_output, sizeof(cmd_output), cmd_fp)) {
-        printf("[WIFI] nmcli output: %s", cmd_output);
-        
-        // Simple check: if output contains "successfully activated", command succeeded
-        if (strstr(cmd_output, "successfully activated") != NULL) {
-            cmd_success = true;
-            printf("[WIFI] nmcli command executed successfully\n");
-        } else {
-            printf("[WIFI] nmcli command failed\n");
-            // Check if error is "No network with SSID ... found"
-            if (strstr(cmd_output, "No network with SSID") != NULL) {
-                need_scan_retry = true;
-                printf("[WIFI] Network not found in cache, will try scanning\n");
-            }
-        }
-    } else {
-        printf("[WIFI] No output from nmcli command\n");
-    }
-    
-    int cmd_exit_status = pclose(cmd_fp);
-    printf("[WIFI] nmcli exit status: %d\n", cmd_exit_status);
-    
-    // If command failed but it's a "network not found" error, try scanning and reconnecting
-    if (!cmd_success && need_scan_retry) {
-        printf("[WIFI] Scanning for WiFi networks before retry...\n");
-        // Perform WiFi scan
-        system("nmcli device wifi list ifname wlan0 > /dev/null 2>&1");
-        if (system("nmcli device wifi list ifname wlan0 > /dev/null 2>&1") == 0) {
-            printf("[WIFI] Scan results:\n");
-            system("nmcli device wifi list ifname wlan0");
-        } else {
-            printf("[WIFI] Failed to perform WiFi scan\n");
-        }
-        
-        // Wait a moment for scan to complete
-        sleep(1);
-        
-        // Retry the connection command
-        printf("[WIFI] Retrying connection after scan...\n");
-        cmd_fp = popen(connect_cmd, "r");
-        if (!cmd_fp) {
-            printf("[WIFI] Failed to execute retry nmcli command\n");
-            snprintf(response, response_len, "{\"err\":\"cmd fail\"}");
-            cJSON_Delete(root);
+struct trace_record {
+    volatile uint32_t state;
+    uint8_t category;
+    uint8_t level;
+    uint64_t ts;
+    char msg[TRACE_MSG_LEN];
+};
 
-            send_socket_command(LED_SYS_WIFI_CONFIG_PENDING);
-            return -1;
-        }
-        
-        // Check retry result
-        cmd_success = false;
-        memset(cmd_output, 0, sizeof(cmd_output));
-        
-        if (fgets(cmd_output, sizeof(cmd_output), cmd_fp)) {
-            printf("[WIFI] nmcli retry output: %s", cmd_output);
-            
-            if (strstr(cmd_output, "successfully activated") != NULL) {
-                cmd_success = true;
-                printf("[WIFI] nmcli retry command executed successfully\n");
-            } else {
-                printf("[WIFI] nmcli retry command failed\n");
-            }
-        } else {
-            printf("[WIFI] No output from nmcli retry command\n");
-        }
-        
-        cmd_exit_status = pclose(cmd_fp);
-        printf("[WIFI] nmcli retry exit status: %d\n", cmd_exit_status);
+static struct trace_record trace_ring[TRACE_RING_SIZE];
+static unsigned int trace_head;         // next slot to claim (producers)
+static unsigned int trace_tail;         // next slot to print (mainloop)
+static unsigned int trace_dropped;
+static int trace_pending;               // producers have signalled a flush
+static int trace_event_fd = -1;
+static int trace_timer_id = -1;
+static unsigned int trace_categories = TRACE_ALL;
+
+#define TRACE(cat, lvl, fmt, ...) do { \
+        if ((lvl) <= trace_level && (trace_categories & (cat))) \
+            trace_log((cat), (lvl), fmt, ##__VA_ARGS__); \
+    } while (0)
+
+static const char *trace_category_str(uint8_t category)
+{
+    switch (category) {
+    case TRACE_ATT:
+        return "ATT";
+    case TRACE_ADV:
+        return "ADV";
+    case TRACE_WIFI:
+        return "WIFI";
+    case TRACE_HCI:
+        return "HCI";
     }
-    
-    // If command failed after retry (or no retry was needed), return error
-    if (!cmd_success || cmd_exit_status != 0) {
-        printf("[WIFI] nmcli command failed, not checking IP address\n");
-        snprintf(response, response_len, "{\"err\":\"conn fail\"}");
-        cJSON_Delete(root);
 
-        send_socket_command(LED_SYS_WIFI_CONFIG_PENDING);
-        return -1;
-    }
-    
-    // 3. 在1秒内检查IP地址 (极大减少阻塞时间防止BLE超时)
-    printf("[WIFI] nmcli command successful, waiting up to 1 second for IP address...\n");
-    for (int i = 0; i < 1; i++) {
-        sleep(1);
-        
-        // 检查BLE连接状态，如果已断开则立即退出
-        if (!client_connected) {
-            printf("[WIFI] BLE client disconnected during WiFi config, aborting\n");
-            snprintf(response, response_len, "{\"err\":\"BLE lost\"}");
-            cJSON_Delete(root);
+    return "?";
+}
 
-            send_socket_command(LED_SYS_WIFI_CONFIG_PENDING);
-            return -1;
-        }
-        
-        char *ip = get_wlan_ip_address();
-        if (ip && is_valid_ip(ip)) {
-            printf("[WIFI] WiFi connection successful! IP: %s (after %d seconds)\n", ip, i + 1);
-            wifi_success_count++;
-            
-            // 发送成功LED指令
-            send_socket_command(LED_SYS_WIFI_SUCCESS);
-            
-            // 4. 清理旧的连接
-            cleanup_old_connections(ssid);
+static void trace_log(uint8_t category, uint8_t level, const char *fmt, ...)
+                        __attribute__((format(printf, 3, 4)));
 
-            // 5. 确保网络配置被及时保护
-            printf("[WIFI] Executing sync to protect network configuration...\n");
-            system("sync");
-            printf("[WIFI] Sync command executed after successful WiFi configuration.\n");            
-            
-            snprintf(response, response_len, "{\"ip\":\"%s\"}", ip);
-            
-            free(ip);
-            cJSON_Delete(root);
-            return 0;
-        }
-        
-        if (ip) free(ip);
-        
-        // 打印进度  
-        printf("[WIFI] Still waiting for IP address... (%d/1 seconds)\n", i + 1);
-    }
-    
-    // 1秒后仍未获得有效IP地址
-    printf("[WIFI] WiFi connection failed - no valid IP address after 1 second\n");
-    
-    // 发送配置中LED指令（表示等待重试）
-    send_socket_command(LED_SYS_WIFI_CONFIG_PENDING);
-    
-    // 检查nmcli连接状态
-    char status_cmd[256];
-    snprintf(status_cmd, sizeof(status_cmd), "nmcli connection show '%s' 2>/dev/null", ssid);
-    FILE *status_fp = popen(status_cmd, "r");
-    
-    char error_detail[256] = "Connection timeout";
-    if (status_fp) {
-        char status_line[256];
-        if (fgets(status_line, sizeof(status_line), status_fp)) {
-            if (strstr(status_line, "GENERAL.STATE")) {
-                snprintf(error_detail, sizeof(error_detail), "Connection created but not activated");
-            }
+static void trace_log(uint8_t category, uint8_t level, const char *fmt, ...)
+{
+    struct trace_record *rec;
+    unsigned int head;
+    uint64_t one = 1;
+    va_list ap;
+
+    /*
+     * Only claim a slot the mainloop has already printed, so every claimed
+     * slot is filled in: a full ring drops the record without a claim.
+     */
+    do {
+        head = trace_head;
+        if (head - __sync_fetch_and_add(&trace_tail, 0) >= TRACE_RING_SIZE) {
+            __sync_fetch_and_add(&trace_dropped, 1);
+            return;
         }
-        pclose(status_fp);
-    }
-    
-    snprintf(response, response_len, "{\"ip\":\"\"}");
-    
-    cJSON_Delete(root);
-    return -1;
-}
+    } while (!__sync_bool_compare_and_swap(&trace_head, head, head + 1));
 
+    rec = &trace_ring[head & (TRACE_RING_SIZE - 1)];
+    rec->state = TRACE_SLOT_BUSY;
 
-/*******************config wifi zone end*********************************************/
-static struct bt_hci *hci_dev;
+    rec->category = category;
+    rec->level = level;
+    rec->ts = now_ms();
+    va_start(ap, fmt);
+    vsnprintf(rec->msg, sizeof(rec->msg), fmt, ap);
+    va_end(ap);
 
+    __sync_synchronize();
+    rec->state = TRACE_SLOT_READY;
 
+    // First record of a batch wakes the mainloop
+    if (__sync_bool_compare_and_swap(&trace_pending, 0, 1) &&
+                            trace_event_fd >= 0) {
+        ssize_t ret = write(trace_event_fd, &one, sizeof(one));
 
-static void att_connect_cb(bool success, uint8_t att_ecode, void *user_data)
+        (void) ret;     // a full eventfd counter is still readable
+    }
+}
+
+/*
+ * Print every ready record in one batch, in claim order.  A slot that is
+ * claimed but not filled in yet ends the batch; its producer signals again
+ * once it is, and the flush carries on from there.
+ */
+static void trace_flush(void)
 {
-    struct server *server = user_data;
+    char buf[4096];
+    size_t len = 0;
+    unsigned int head, dropped;
+
+    __sync_lock_release(&trace_pending);
+    __sync_synchronize();
+    head = trace_head;
+
+    while (trace_tail != head) {
+        struct trace_record *rec =
+                &trace_ring[trace_tail & (TRACE_RING_SIZE - 1)];
+        int n;
+
+        if (rec->state != TRACE_SLOT_READY)
+            break;
+
+        if (len + sizeof(rec->msg) + 32 > sizeof(buf)) {
+            fflush(stdout);
+            if (write(STDOUT_FILENO, buf, len) < 0)
+                break;
+            len = 0;
+        }
+
+        n = snprintf(buf + len, sizeof(buf) - len,
+                "[%s] %llu.%03llu %s%s\n",
+                trace_category_str(rec->category),
+                (unsigned long long) rec->ts / 1000,
+                (unsigned long long) rec->ts % 1000,
+                rec->level == TRACE_ERROR ? "ERROR: " : "",
+                rec->msg);
+        if (n > 0)
+            len += (size_t) n < sizeof(buf) - len ?
+                        (size_t) n : sizeof(buf) - len - 1;
+
+        rec->state = TRACE_SLOT_FREE;
+
+        // Frees the slot for producers
+        __sync_fetch_and_add(&trace_tail, 1);
+    }
+
+    dropped = __sync_fetch_and_and(&trace_dropped, 0);
+    if (dropped)
+        len += snprintf(buf + len, sizeof(buf) - len,
+                "[TRACE] %u records dropped\n", dropped);
+
+    if (len > 0) {
+        // Keep ordering with plain printf output
+        fflush(stdout);
+        if (write(STDOUT_FILENO, buf, len) < 0)
+            return;
+    }
+}
+
+static void trace_timer_cb(int timeout_id, void *user_data)
+{
+    trace_flush();
+}
+
+static void trace_event_cb(int fd, uint32_t events, void *user_data)
+{
+    uint64_t count;
+
+    if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        return;
+
+    // Give the rest of the batch a moment to arrive
+    if (mainloop_modify_timeout(trace_timer_id, TRACE_FLUSH_DELAY_MS) < 0)
+        trace_flush();
+}
+
+// Called once the mainloop exists; records logged before then are flushed here
+static MAIN_ONLY void trace_init(void)
+{
+    trace_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (trace_event_fd < 0) {
+        perror("[TRACE] Failed to create eventfd");
+        return;
+    }
+
+    if (mainloop_add_fd(trace_event_fd, EPOLLIN, trace_event_cb,
+                            NULL, NULL) < 0) {
+        close(trace_event_fd);
+        trace_event_fd = -1;
+        return;
+    }
+
+    trace_timer_id = mainloop_add_timeout(0, trace_timer_cb, NULL, NULL);
+    trace_flush();
+}
+#else
+// Keeps the arguments type-checked; the compiler drops the dead branch
+#define TRACE(cat, lvl, fmt, ...) do { \
+        if (0) \
+            printf(fmt, ##__VA_ARGS__); \
+    } while (0)
+
+static inline void trace_flush(void)
+{
+}
+
+static inline void trace_init(void)
+{
+}
+#endif
+
+// Hex dump of non-sensitive data (advertising payloads, UUIDs)
+static const char *trace_hex(char *buf, size_t size, const uint8_t *data,
+                            size_t len)
+{
+    size_t i, pos = 0;
+
+    buf[0] = '\0';
+    for (i = 0; i < len && pos + 3 < size; i++)
+        pos += snprintf(buf + pos, size - pos, "%02X ", data[i]);
+
+    return buf;
+}
+
+/*
+ * Session trace records, one JSON object per line, phases given in ms since
+ * accept.  The file lives on tmpfs and is rotated to SESSION_TRACE_PATH.1
+ * once it passes SESSION_TRACE_MAX_SIZE; the supervisor serves both over
+ * /api/ble/sessions.  Marking a phase is a clock read, the file is only
+ * touched once per connection.  Build with -DBTGATT_SESSION_TRACE=0 to
+ * drop it.
+ */
+#ifndef BTGATT_SESSION_TRACE
+#define BTGATT_SESSION_TRACE 1
+#endif
+
+#define SESSION_TRACE_DIR "/run/btgatt-server"
+#define SESSION_TRACE_PATH SESSION_TRACE_DIR "/sessions.log"
+#define SESSION_TRACE_MAX_SIZE (64 * 1024)
+
+static unsigned int session_count;
+
+static void session_trace_init(struct session_trace *s)
+{
+    memset(s, 0, sizeof(*s));
+    s->id = ++session_count;
+    s->status = -1;
+    s->tx_phy = LE_PHY_1M;
+    s->rx_phy = LE_PHY_1M;
+    s->phase_ms[SESSION_ACCEPT] = now_ms();
+}
+
+static void session_mark(struct session_trace *s, enum session_phase phase)
+{
+#if BTGATT_SESSION_TRACE
+    if (!s->phase_ms[phase] || phase == SESSION_LAST_WRITE)
+        s->phase_ms[phase] = now_ms();
+#endif
+}
+
+// Copy phases reached by a provisioning worker into the connection's trace
+static void session_merge(struct session_trace *s,
+                const struct session_trace *from)
+{
+    int i;
+
+    for (i = 0; i < SESSION_PHASE_COUNT; i++) {
+        if (from->phase_ms[i] && !s->phase_ms[i])
+            s->phase_ms[i] = from->phase_ms[i];
+    }
+}
+
+static void session_trace_emit(const struct session_trace *s, uint16_t mtu,
+                int err)
+{
+#if BTGATT_SESSION_TRACE
+    static const char *const session_phase_names[SESSION_PHASE_COUNT] = {
+        [SESSION_ACCEPT]         = "accept",
+        [SESSION_FIRST_PDU]      = "first_pdu",
+        [SESSION_MTU_EXCHANGE]   = "mtu_exchange",
+        [SESSION_PHY_UPDATE]     = "phy_update",
+        [SESSION_CCCD_ENABLE]    = "cccd_enable",
+        [SESSION_FIRST_WRITE]    = "first_write",
+        [SESSION_LAST_WRITE]     = "last_write",
+        [SESSION_REQUEST_PARSED] = "request_parsed",
+        [SESSION_CONNECT_START]  = "connect_start",
+        [SESSION_CONNECT_END]    = "connect_end",
+        [SESSION_IP_ACQUIRED]    = "ip_acquired",
+        [SESSION_CLEANUP_DONE]   = "cleanup_done",
+        [SESSION_SYNC_START]     = "sync_start",
+        [SESSION_SYNC_DONE]      = "sync_done",
+        [SESSION_NOTIFY_SENT]    = "notify_sent",
+        [SESSION_NOTIFY_ACKED]   = "notify_acked",
+    };
+    uint64_t base = s->phase_ms[SESSION_ACCEPT];
+    char line[768];
+    size_t len;
+    struct stat st;
+    int fd, i;
+
+    len = snprintf(line, sizeof(line),
+                   "{\"session\":%u,\"time\":%lld,\"mtu\":%u,\"tx_phy\":%u,"
+                   "\"rx_phy\":%u,\"requests\":%u,\"proto\":%s%s%s,\"status\":",
+                   s->id, (long long) time(NULL), mtu, s->tx_phy, s->rx_phy,
+                   s->requests,
+                   s->proto ? "\"" : "", s->proto ? s->proto : "null",
+                   s->proto ? "\"" : "");
+    if (s->status >= 0)
+        len += snprintf(line + len, sizeof(line) - len, "%d", s->status);
+    else
+        len += snprintf(line + len, sizeof(line) - len, "null");
+    len += snprintf(line + len, sizeof(line) - len,
+                    ",\"disconnect_err\":%d,\"duration_ms\":%llu,\"phases\":{",
+                    err, (unsigned long long) (now_ms() - base));
+
+    for (i = 0; i < SESSION_PHASE_COUNT; i++) {
+        if (!s->phase_ms[i])
+            continue;
+        len += snprintf(line + len, sizeof(line) - len, "%s\"%s\":%llu",
+                        i ? "," : "", session_phase_names[i],
+                        (unsigned long long) (s->phase_ms[i] - base));
+    }
+    len += snprintf(line + len, sizeof(line) - len, "}}\n");
+
+    TRACE(TRACE_ATT, TRACE_INFO, "Session trace: %.*s", (int) len - 1, line);
+
+    if (mkdir(SESSION_TRACE_DIR, 0755) < 0 && errno != EEXIST)
+        return;
+
+    if (stat(SESSION_TRACE_PATH, &st) == 0 && st.st_size >= SESSION_TRACE_MAX_SIZE)
+        rename(SESSION_TRACE_PATH, SESSION_TRACE_PATH ".1");
+
+    fd = open(SESSION_TRACE_PATH, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+              0644);
+    if (fd < 0) {
+        printf("[SESSION] Failed to open %s: %s\n", SESSION_TRACE_PATH,
+               strerror(errno));
+        return;
+    }
+
+    // A single O_APPEND write so readers never see half a record
+    if (write(fd, line, len) != (ssize_t) len)
+        printf("[SESSION] Failed to write trace record: %s\n", strerror(errno));
+    close(fd);
+#endif
+}
+
+/*
+ * Cumulative counters and fixed-bucket histograms over the life of the
+ * process, for fleet-wide aggregates that per-session traces cannot give.
+ * An update is one atomic add, from the mainloop or a provisioning worker
+ * alike.  The control socket "metrics" command returns a snapshot, which
+ * the supervisor serves over /api/ble/metrics.  Build with
+ * -DBTGATT_METRICS=0 to drop the updates.
+ */
+#ifndef BTGATT_METRICS
+#define BTGATT_METRICS 1
+#endif
+
+enum metrics_counter {
+    METRICS_ATT_PREP_WRITE,
+    METRICS_ATT_EXEC_WRITE,
+    METRICS_ATT_WRITE_REQ,
+    METRICS_ATT_WRITE_CMD,
+    METRICS_NOTIFY_SENT,        // fragments handed to ATT
+    METRICS_NOTIFY_FAILED,      // fragments dropped after NOTIFY_MAX_RETRIES
+    METRICS_COUNTER_COUNT,
+};
+
+enum metrics_hist_id {
+    METRICS_MTU,                // final ATT MTU of each connection
+    METRICS_RESULT_MS,          // accept to a job's result notification
+    METRICS_BACKEND_MS,         // one backend connect or rescan call
+    METRICS_HCI_MS,             // HCI command queued to Command Complete
+    METRICS_RECONNECT_MS,       // disconnect to the next accept
+    METRICS_HIST_COUNT,
+};
+
+// Bucket upper bounds; one more bucket counts everything above the last
+static const uint32_t metrics_ms_bounds[] = {
+    1, 2, 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 30000,
+};
+static const uint32_t metrics_mtu_bounds[] = { 23, 64, 128, 185, 247, 512 };
+
+#define METRICS_HIST_BUCKETS \
+    (sizeof(metrics_ms_bounds) / sizeof(metrics_ms_bounds[0]) + 1)
+
+struct metrics_hist {
+    const char *name;
+    const uint32_t *bounds;
+    unsigned int bound_count;
+    uint32_t counts[METRICS_HIST_BUCKETS];
+    uint64_t sum;
+};
+
+#define METRICS_HIST(_name, _bounds) \
+    { _name, _bounds, sizeof(_bounds) / sizeof((_bounds)[0]), { 0 }, 0 }
+
+static struct metrics_hist metrics_hists[METRICS_HIST_COUNT] = {
+    [METRICS_MTU]          = METRICS_HIST("mtu", metrics_mtu_bounds),
+    [METRICS_RESULT_MS]    = METRICS_HIST("result_ms", metrics_ms_bounds),
+    [METRICS_BACKEND_MS]   = METRICS_HIST("backend_ms", metrics_ms_bounds),
+    [METRICS_HCI_MS]       = METRICS_HIST("hci_ms", metrics_ms_bounds),
+    [METRICS_RECONNECT_MS] = METRICS_HIST("reconnect_ms", metrics_ms_bounds),
+};
+
+static const char *const metrics_counter_names[METRICS_COUNTER_COUNT] = {
+    [METRICS_ATT_PREP_WRITE] = "att_prep_write",
+    [METRICS_ATT_EXEC_WRITE] = "att_exec_write",
+    [METRICS_ATT_WRITE_REQ]  = "att_write_req",
+    [METRICS_ATT_WRITE_CMD]  = "att_write_cmd",
+    [METRICS_NOTIFY_SENT]    = "notify_sent",
+    [METRICS_NOTIFY_FAILED]  = "notify_failed",
+};
+
+static uint32_t metrics_counters[METRICS_COUNTER_COUNT];
+static uint64_t metrics_disconnect_ms;      // mainloop only, 0 once reported
+
+static void metrics_count(enum metrics_counter counter, uint32_t n)
+{
+#if BTGATT_METRICS
+    __sync_fetch_and_add(&metrics_counters[counter], n);
+#endif
+}
+
+static void metrics_observe(enum metrics_hist_id id, uint64_t value)
+{
+#if BTGATT_METRICS
+    struct metrics_hist *hist = &metrics_hists[id];
+    unsigned int i = 0;
+
+    while (i < hist->bound_count && value > hist->bounds[i])
+        i++;
+    __sync_fetch_and_add(&hist->counts[i], 1);
+    __sync_fetch_and_add(&hist->sum, value);
+#endif
+}
+
+/*
+ * {"counters":{..},"<hist>":{"le":[bounds],"counts":[..],"sum":N},..}, with
+ * one more count than bounds.  Returns the length, or -1 if @size is too
+ * small.
+ */
+static int metrics_encode(char *buf, size_t size)
+{
+    size_t len = 0;
+    unsigned int i, j;
+    int n;
+
+#define METRICS_PUT(...) do { \
+        n = snprintf(buf + len, size - len, __VA_ARGS__); \
+        if (n < 0 || (size_t) n >= size - len) \
+            return -1; \
+        len += n; \
+    } while (0)
+
+    METRICS_PUT("{\"counters\":{");
+    for (i = 0; i < METRICS_COUNTER_COUNT; i++)
+        METRICS_PUT("%s\"%s\":%u", i ? "," : "", metrics_counter_names[i],
+                    __sync_fetch_and_add(&metrics_counters[i], 0));
+    METRICS_PUT("}");
+
+    for (i = 0; i < METRICS_HIST_COUNT; i++) {
+        struct metrics_hist *hist = &metrics_hists[i];
+
+        METRICS_PUT(",\"%s\":{\"le\":[", hist->name);
+        for (j = 0; j < hist->bound_count; j++)
+            METRICS_PUT("%s%u", j ? "," : "", hist->bounds[j]);
+        METRICS_PUT("],\"counts\":[");
+        for (j = 0; j <= hist->bound_count; j++)
+            METRICS_PUT("%s%u", j ? "," : "",
+                        __sync_fetch_and_add(&hist->counts[j], 0));
+        METRICS_PUT("],\"sum\":%llu}", (unsigned long long)
+                    __sync_fetch_and_add(&hist->sum, 0));
+    }
+    METRICS_PUT("}\n");
+
+#undef METRICS_PUT
+    return len;
+}
+
+/*
+ * WiFi network backend.
+ *
+ * With WIFI_BACKEND_NM_DBUS the backend talks to NetworkManager directly
+ * over the system bus; otherwise it falls back to the nmcli pipelines.  Every
+ * call blocks, so the backend is only used from provisioning workers, never
+ * from the mainloop.  Results come back as enum wifi_result instead of
+ * parsed command output.
+ */
+#define WIFI_IFNAME "wlan0"
+#define WIFI_SSID_MAX_LEN 32
+
+enum wifi_result {
+    WIFI_RESULT_OK = 0,
+    WIFI_RESULT_NOT_FOUND,      // SSID not in the scan results
+    WIFI_RESULT_AUTH_FAILED,    // secrets missing or rejected
+    WIFI_RESULT_TIMEOUT,
+    WIFI_RESULT_FAILED,         // activation failed for another reason
+    WIFI_RESULT_BACKEND_ERROR,  // NetworkManager/nmcli not reachable
+    WIFI_RESULT_CANCELLED,
+};
+
+static const char *wifi_result_str(enum wifi_result res)
+{
+    switch (res) {
+    case WIFI_RESULT_OK:
+        return "ok";
+    case WIFI_RESULT_NOT_FOUND:
+        return "network not found";
+    case WIFI_RESULT_AUTH_FAILED:
+        return "authentication failed";
+    case WIFI_RESULT_TIMEOUT:
+        return "timeout";
+    case WIFI_RESULT_FAILED:
+        return "activation failed";
+    case WIFI_RESULT_BACKEND_ERROR:
+        return "backend error";
+    case WIFI_RESULT_CANCELLED:
+        return "cancelled";
+    }
+
+    return "unknown";
+}
+
+struct wifi_backend {
+#if WIFI_BACKEND_NM_DBUS
+    DBusConnection *conn;
+    char device_path[128];
+    char connection_path[128];  // profile created by the last connect
+#else
+    int unused;
+#endif
+};
+
+// One access point as seen by the last background scan
+enum wifi_security {
+    WIFI_SECURITY_OPEN = 0,
+    WIFI_SECURITY_WEP,
+    WIFI_SECURITY_WPA,
+    WIFI_SECURITY_WPA2,
+    WIFI_SECURITY_WPA3,
+    WIFI_SECURITY_ENTERPRISE,
+    WIFI_SECURITY_UNKNOWN = 0xff,   // not stated by the client
+};
+
+struct wifi_scan_entry {
+    char ssid[WIFI_SSID_MAX_LEN + 1];
+    uint8_t bssid[6];
+    int8_t rssi;                // dBm
+    uint8_t security;           // enum wifi_security
+    uint16_t freq;              // MHz
+};
+
+/*
+ * One provisioning request, decoded on the mainloop from either wire format
+ * (JSON or TLV) before it is handed to a worker.
+ */
+#define WIFI_PSK_MAX_LEN 64
+
+struct wifi_request {
+    char ssid[WIFI_SSID_MAX_LEN + 1];
+    char psk[WIFI_PSK_MAX_LEN + 1];
+    uint8_t security;           // enum wifi_security
+    uint8_t bssid[6];           // preferred access point, if has_bssid
+    bool has_bssid;
+};
+
+/*
+ * A request carries up to WIFI_BATCH_MAX candidate networks.  The worker
+ * tries them in order, or strongest first in the scan cache with by_rssi,
+ * until one gets an address; the others are then stored as NetworkManager
+ * fallbacks.  A single-network request is a batch of one.
+ */
+#define WIFI_BATCH_MAX 4
+
+struct wifi_batch {
+    struct wifi_request nets[WIFI_BATCH_MAX];
+    uint8_t count;
+    bool by_rssi;
+    bool progress;      // client asked for progress notifications
+};
+
+#if !WIFI_BACKEND_MOCK
+/*
+ * NetworkManager only reports signal quality in percent, derived from the
+ * driver's dBm as 2 * (dBm + 100); map it back so clients get an RSSI.
+ */
+static int8_t wifi_strength_to_rssi(unsigned int strength)
+{
+    if (strength > 100)
+        strength = 100;
+
+    return (int8_t) ((int) strength / 2 - 100);
+}
+#endif
+
+#if WIFI_BACKEND_NM_DBUS
+
+#define NM_SERVICE              "org.freedesktop.NetworkManager"
+#define NM_PATH                 "/org/freedesktop/NetworkManager"
+#define NM_IFACE                NM_SERVICE
+#define NM_WIRELESS_IFACE       NM_SERVICE ".Device.Wireless"
+#define NM_AP_IFACE             NM_SERVICE ".AccessPoint"
+#define NM_ACTIVE_IFACE         NM_SERVICE ".Connection.Active"
+#define NM_SETTINGS_PATH        NM_PATH "/Settings"
+#define NM_SETTINGS_IFACE       NM_SERVICE ".Settings"
+#define NM_CONNECTION_IFACE     NM_SERVICE ".Settings.Connection"
+#define DBUS_PROPERTIES_IFACE   "org.freedesktop.DBus.Properties"
+
+#define NM_CALL_TIMEOUT_MS      5000
+#define NM_ACTIVATE_TIMEOUT_MS  30000
+#define NM_SCAN_TIMEOUT_MS      5000
+#define NM_POLL_INTERVAL_MS     200
+
+// NMActiveConnectionState and NMActiveConnectionStateReason values
+#define NM_ACTIVE_STATE_ACTIVATED       2
+#define NM_ACTIVE_STATE_DEACTIVATED     4
+#define NM_ACTIVE_REASON_CONNECT_TIMEOUT        6
+#define NM_ACTIVE_REASON_SERVICE_START_TIMEOUT  7
+#define NM_ACTIVE_REASON_NO_SECRETS             9
+#define NM_ACTIVE_REASON_LOGIN_FAILED           10
+
+#define NM_ACTIVE_STATE_MATCH "type='signal',sender='" NM_SERVICE "'," \
+        "interface='" NM_ACTIVE_IFACE "',member='StateChanged'"
+
+/*
+ * Call @method on NetworkManager and wait for its reply.  Arguments follow
+ * dbus_message_append_args() conventions.  On failure NULL is returned and
+ * @err carries the D-Bus error, which the caller must free.
+ */
+static DBusMessage *nm_call(struct wifi_backend *be, const char *path,
+                const char *iface, const char *method, DBusError *err,
+                int first_type, ...)
+{
+    DBusMessage *msg, *reply;
+    va_list args;
+    dbus_bool_t ok;
+
+    msg = dbus_message_new_method_call(NM_SERVICE, path, iface, method);
+    if (!msg)
+        return NULL;
+
+    va_start(args, first_type);
+    ok = dbus_message_append_args_valist(msg, first_type, args);
+    va_end(args);
+    if (!ok) {
+        dbus_message_unref(msg);
+        return NULL;
+    }
+
+    reply = dbus_connection_send_with_reply_and_block(be->conn, msg,
+                                                      NM_CALL_TIMEOUT_MS, err);
+    dbus_message_unref(msg);
+
+    if (!reply)
+        printf("[NM] %s.%s failed: %s\n", iface, method,
+               dbus_error_is_set(err) ? err->message : "out of memory");
+    return reply;
+}
+
+// Fetch a property; on success @value points into the returned reply
+static DBusMessage *nm_get_property(struct wifi_backend *be, const char *path,
+                const char *iface, const char *prop, DBusMessageIter *value)
+{
+    DBusMessageIter iter;
+    DBusMessage *reply;
+    DBusError err;
+
+    dbus_error_init(&err);
+    reply = nm_call(be, path, DBUS_PROPERTIES_IFACE, "Get", &err,
+                    DBUS_TYPE_STRING, &iface, DBUS_TYPE_STRING, &prop,
+                    DBUS_TYPE_INVALID);
+    dbus_error_free(&err);
+    if (!reply)
+        return NULL;
+
+    if (!dbus_message_iter_init(reply, &iter) ||
+            dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_VARIANT) {
+        dbus_message_unref(reply);
+        return NULL;
+    }
+
+    dbus_message_iter_recurse(&iter, value);
+    return reply;
+}
+
+// Read a fixed-size (integer), string or object path property into @out
+static int nm_get_basic_property(struct wifi_backend *be, const char *path,
+                const char *iface, const char *prop, int type, void *out,
+                size_t out_len)
+{
+    DBusMessageIter value;
+    DBusMessage *reply;
+
+    reply = nm_get_property(be, path, iface, prop, &value);
+    if (!reply)
+        return -EIO;
+
+    if (dbus_message_iter_get_arg_type(&value) != type) {
+        dbus_message_unref(reply);
+        return -EINVAL;
+    }
+
+    if (type == DBUS_TYPE_OBJECT_PATH || type == DBUS_TYPE_STRING) {
+        const char *str;
+
+        dbus_message_iter_get_basic(&value, &str);
+        snprintf(out, out_len, "%s", str);
+    } else {
+        dbus_message_iter_get_basic(&value, out);
+    }
+
+    dbus_message_unref(reply);
+    return 0;
+}
+
+// AccessPoint.Ssid is a byte array, not a string
+static int nm_get_ssid(struct wifi_backend *be, const char *ap_path,
+                char *ssid, size_t len)
+{
+    DBusMessageIter value, array;
+    DBusMessage *reply;
+    const char *bytes;
+    int n;
+
+    reply = nm_get_property(be, ap_path, NM_AP_IFACE, "Ssid", &value);
+    if (!reply)
+        return -EIO;
+
+    if (dbus_message_iter_get_arg_type(&value) != DBUS_TYPE_ARRAY) {
+        dbus_message_unref(reply);
+        return -EINVAL;
+    }
+
+    dbus_message_iter_recurse(&value, &array);
+    dbus_message_iter_get_fixed_array(&array, &bytes, &n);
+    if ((size_t) n >= len)
+        n = len - 1;
+    memcpy(ssid, bytes, n);
+    ssid[n] = '\0';
+
+    dbus_message_unref(reply);
+    return 0;
+}
+
+static void nm_dict_append_variant(DBusMessageIter *dict, const char *key,
+                int type, const void *value)
+{
+    DBusMessageIter entry, variant;
+    char sig[2] = { (char) type, '\0' };
+
+    dbus_message_iter_open_container(dict, DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+    dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &key);
+    dbus_message_iter_open_container(&entry, DBUS_TYPE_VARIANT, sig, &variant);
+    dbus_message_iter_append_basic(&variant, type, value);
+    dbus_message_iter_close_container(&entry, &variant);
+    dbus_message_iter_close_container(dict, &entry);
+}
+
+static void nm_dict_append_bytes(DBusMessageIter *dict, const char *key,
+                const char *bytes, int len)
+{
+    DBusMessageIter entry, variant, array;
+
+    dbus_message_iter_open_container(dict, DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+    dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &key);
+    dbus_message_iter_open_container(&entry, DBUS_TYPE_VARIANT, "ay", &variant);
+    dbus_message_iter_open_container(&variant, DBUS_TYPE_ARRAY,
+                                     DBUS_TYPE_BYTE_AS_STRING, &array);
+    dbus_message_iter_append_fixed_array(&array, DBUS_TYPE_BYTE, &bytes, len);
+    dbus_message_iter_close_container(&variant, &array);
+    dbus_message_iter_close_container(&entry, &variant);
+    dbus_message_iter_close_container(dict, &entry);
+}
+
+// Open one "group" entry of an a{sa{sv}} settings dictionary
+static void nm_settings_open_group(DBusMessageIter *settings, const char *name,
+                DBusMessageIter *entry, DBusMessageIter *group)
+{
+    dbus_message_iter_open_container(settings, DBUS_TYPE_DICT_ENTRY, NULL, entry);
+    dbus_message_iter_append_basic(entry, DBUS_TYPE_STRING, &name);
+    dbus_message_iter_open_container(entry, DBUS_TYPE_ARRAY, "{sv}", group);
+}
+
+static void nm_settings_close_group(DBusMessageIter *settings,
+                DBusMessageIter *entry, DBusMessageIter *group)
+{
+    dbus_message_iter_close_container(entry, group);
+    dbus_message_iter_close_container(settings, entry);
+}
+
+// Look up a string setting such as connection.type in a GetSettings reply
+static int nm_settings_get_string(DBusMessage *reply, const char *group,
+                const char *key, char *out, size_t len)
+{
+    DBusMessageIter iter, groups;
+
+    if (!dbus_message_iter_init(reply, &iter) ||
+            dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_ARRAY)
+        return -EINVAL;
+
+    dbus_message_iter_recurse(&iter, &groups);
+    while (dbus_message_iter_get_arg_type(&groups) == DBUS_TYPE_DICT_ENTRY) {
+        DBusMessageIter entry, props;
+        const char *name;
+
+        dbus_message_iter_recurse(&groups, &entry);
+        dbus_message_iter_get_basic(&entry, &name);
+        dbus_message_iter_next(&entry);
+
+        if (!strcmp(name, group) &&
+                dbus_message_iter_get_arg_type(&entry) == DBUS_TYPE_ARRAY) {
+            dbus_message_iter_recurse(&entry, &props);
+            while (dbus_message_iter_get_arg_type(&props) == DBUS_TYPE_DICT_ENTRY) {
+                DBusMessageIter prop, value;
+                const char *prop_name, *str;
+
+                dbus_message_iter_recurse(&props, &prop);
+                dbus_message_iter_get_basic(&prop, &prop_name);
+                dbus_message_iter_next(&prop);
+
+                if (!strcmp(prop_name, key)) {
+                    dbus_message_iter_recurse(&prop, &value);
+                    if (dbus_message_iter_get_arg_type(&value) != DBUS_TYPE_STRING)
+                        return -EINVAL;
+                    dbus_message_iter_get_basic(&value, &str);
+                    snprintf(out, len, "%s", str);
+                    return 0;
+                }
+                dbus_message_iter_next(&props);
+            }
+        }
+        dbus_message_iter_next(&groups);
+    }
+
+    return -ENOENT;
+}
+
+static int wifi_backend_open(struct wifi_backend *be)
+{
+    const char *ifname = WIFI_IFNAME;
+    DBusMessage *reply;
+    DBusError err;
+    const char *path;
+
+    memset(be, 0, sizeof(*be));
+    dbus_threads_init_default();
+
+    dbus_error_init(&err);
+    be->conn = dbus_bus_get_private(DBUS_BUS_SYSTEM, &err);
+    if (!be->conn) {
+        printf("[NM] Cannot connect to system bus: %s\n",
+               dbus_error_is_set(&err) ? err.message : "unknown error");
+        dbus_error_free(&err);
+        return -EIO;
+    }
+    dbus_connection_set_exit_on_disconnect(be->conn, FALSE);
+
+    // Subscribe before any activation so no state change can be missed
+    dbus_bus_add_match(be->conn, NM_ACTIVE_STATE_MATCH, &err);
+    if (dbus_error_is_set(&err)) {
+        printf("[NM] Failed to add match rule: %s\n", err.message);
+        dbus_error_free(&err);
+    }
+
+    reply = nm_call(be, NM_PATH, NM_IFACE, "GetDeviceByIpIface", &err,
+                    DBUS_TYPE_STRING, &ifname, DBUS_TYPE_INVALID);
+    dbus_error_free(&err);
+    if (!reply || !dbus_message_get_args(reply, NULL, DBUS_TYPE_OBJECT_PATH,
+                                         &path, DBUS_TYPE_INVALID)) {
+        printf("[NM] No NetworkManager device for %s\n", WIFI_IFNAME);
+        if (reply)
+            dbus_message_unref(reply);
+        dbus_connection_close(be->conn);
+        dbus_connection_unref(be->conn);
+        be->conn = NULL;
+        return -ENODEV;
+    }
+
+    snprintf(be->device_path, sizeof(be->device_path), "%s", path);
+    dbus_message_unref(reply);
+    return 0;
+}
+
+static void wifi_backend_close(struct wifi_backend *be)
+{
+    if (!be->conn)
+        return;
+
+    dbus_connection_close(be->conn);
+    dbus_connection_unref(be->conn);
+    be->conn = NULL;
+}
+
+static int wifi_backend_get_active_ssid(struct wifi_backend *be, char *ssid,
+                size_t len)
+{
+    char ap_path[128];
+    int err;
+
+    err = nm_get_basic_property(be, be->device_path, NM_WIRELESS_IFACE,
+                                "ActiveAccessPoint", DBUS_TYPE_OBJECT_PATH,
+                                ap_path, sizeof(ap_path));
+    if (err < 0)
+        return err;
+
+    if (!strcmp(ap_path, "/"))
+        return -ENOENT;
+
+    return nm_get_ssid(be, ap_path, ssid, len);
+}
+
+// Find the strongest access point advertising @ssid, or the one at @bssid
+static int nm_find_access_point(struct wifi_backend *be, const char *ssid,
+                const uint8_t *bssid, char *ap_path, size_t len)
+{
+    DBusMessage *reply;
+    DBusError err;
+    char **paths;
+    int n, i, best = -1;
+    uint8_t best_strength = 0;
+
+    dbus_error_init(&err);
+    reply = nm_call(be, be->device_path, NM_WIRELESS_IFACE,
+                    "GetAllAccessPoints", &err, DBUS_TYPE_INVALID);
+    dbus_error_free(&err);
+    if (!reply)
+        return -EIO;
+
+    if (!dbus_message_get_args(reply, NULL, DBUS_TYPE_ARRAY,
+                               DBUS_TYPE_OBJECT_PATH, &paths, &n,
+                               DBUS_TYPE_INVALID)) {
+        dbus_message_unref(reply);
+        return -EINVAL;
+    }
+
+    for (i = 0; i < n; i++) {
+        char ap_ssid[WIFI_SSID_MAX_LEN + 1];
+        uint8_t strength = 0;
+
+        if (nm_get_ssid(be, paths[i], ap_ssid, sizeof(ap_ssid)) < 0 ||
+                strcmp(ap_ssid, ssid))
+            continue;
+
+        if (bssid) {
+            char hw[18], want[18];
+
+            snprintf(want, sizeof(want), "%02X:%02X:%02X:%02X:%02X:%02X",
+                     bssid[0], bssid[1], bssid[2], bssid[3], bssid[4], bssid[5]);
+            if (nm_get_basic_property(be, paths[i], NM_AP_IFACE, "HwAddress",
+                                      DBUS_TYPE_STRING, hw, sizeof(hw)) == 0 &&
+                    !strcasecmp(hw, want)) {
+                best = i;
+                break;
+            }
+        }
+
+        nm_get_basic_property(be, paths[i], NM_AP_IFACE, "Strength",
+                              DBUS_TYPE_BYTE, &strength, sizeof(strength));
+        if (best < 0 || strength > best_strength) {
+            best = i;
+            best_strength = strength;
+        }
+    }
+
+    if (best >= 0)
+        snprintf(ap_path, len, "%s", paths[best]);
+
+    dbus_free_string_array(paths);
+    dbus_message_unref(reply);
+    return best >= 0 ? 0 : -ENOENT;
+}
+
+static void nm_delete_connection(struct wifi_backend *be, const char *path)
+{
+    DBusMessage *reply;
+    DBusError err;
+
+    dbus_error_init(&err);
+    reply = nm_call(be, path, NM_CONNECTION_IFACE, "Delete", &err,
+                    DBUS_TYPE_INVALID);
+    dbus_error_free(&err);
+    if (reply)
+        dbus_message_unref(reply);
+}
+
+static enum wifi_result nm_wait_activated(struct wifi_backend *be,
+                struct wifi_job *job, const char *active_path)
+{
+    uint64_t deadline = now_ms() + NM_ACTIVATE_TIMEOUT_MS;
+    uint32_t state = 0, reason = 0;
+
+    // The StateChanged signal may already be queued; check the current state
+    nm_get_basic_property(be, active_path, NM_ACTIVE_IFACE, "State",
+                          DBUS_TYPE_UINT32, &state, sizeof(state));
+
+    while (state != NM_ACTIVE_STATE_ACTIVATED &&
+            state != NM_ACTIVE_STATE_DEACTIVATED) {
+        DBusMessage *msg;
+
+        if (wifi_job_cancelled(job))
+            return WIFI_RESULT_CANCELLED;
+
+        if (now_ms() >= deadline)
+            return WIFI_RESULT_TIMEOUT;
+
+        if (!dbus_connection_read_write(be->conn, NM_POLL_INTERVAL_MS))
+            return WIFI_RESULT_BACKEND_ERROR;
+
+        while ((msg = dbus_connection_pop_message(be->conn))) {
+            const char *path = dbus_message_get_path(msg);
+
+            if (dbus_message_is_signal(msg, NM_ACTIVE_IFACE, "StateChanged") &&
+                    path && !strcmp(path, active_path))
+                dbus_message_get_args(msg, NULL, DBUS_TYPE_UINT32, &state,
+                                      DBUS_TYPE_UINT32, &reason,
+                                      DBUS_TYPE_INVALID);
+            dbus_message_unref(msg);
+        }
+    }
+
+    if (state == NM_ACTIVE_STATE_ACTIVATED)
+        return WIFI_RESULT_OK;
+
+    printf("[NM] Activation failed, reason %u\n", reason);
+    switch (reason) {
+    case NM_ACTIVE_REASON_NO_SECRETS:
+    case NM_ACTIVE_REASON_LOGIN_FAILED:
+        return WIFI_RESULT_AUTH_FAILED;
+    case NM_ACTIVE_REASON_CONNECT_TIMEOUT:
+    case NM_ACTIVE_REASON_SERVICE_START_TIMEOUT:
+        return WIFI_RESULT_TIMEOUT;
+    default:
+        return WIFI_RESULT_FAILED;
+    }
+}
+
+/*
+ * AddAndActivateConnection with the access point as specific object, so
+ * NetworkManager completes key-mgmt from the AP's security flags the same
+ * way "nmcli device wifi connect" does.
+ */
+static enum wifi_result wifi_backend_connect(struct wifi_backend *be,
+                struct wifi_job *job, const struct wifi_request *req)
+{
+    const char *ssid = req->ssid;
+    const char *password = req->security == WIFI_SECURITY_OPEN ? NULL : req->psk;
+    DBusMessageIter iter, settings, entry, group;
+    const char *type = "802-11-wireless", *mode = "infrastructure";
+    char ap_path_buf[128];
+    const char *device = be->device_path, *ap = ap_path_buf;
+    const char *conn_path, *active_path;
+    enum wifi_result res;
+    DBusMessage *msg, *reply;
+    DBusError err;
+
+    if (nm_find_access_point(be, ssid, req->has_bssid ? req->bssid : NULL,
+                             ap_path_buf, sizeof(ap_path_buf)) < 0) {
+        printf("[NM] No access point with SSID '%s'\n", ssid);
+        return WIFI_RESULT_NOT_FOUND;
+    }
+
+    msg = dbus_message_new_method_call(NM_SERVICE, NM_PATH, NM_IFACE,
+                                       "AddAndActivateConnection");
+    if (!msg)
+        return WIFI_RESULT_BACKEND_ERROR;
+
+    dbus_message_iter_init_append(msg, &iter);
+    dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{sa{sv}}", &settings);
+
+    nm_settings_open_group(&settings, "connection", &entry, &group);
+    nm_dict_append_variant(&group, "id", DBUS_TYPE_STRING, &ssid);
+    nm_dict_append_variant(&group, "type", DBUS_TYPE_STRING, &type);
+    nm_settings_close_group(&settings, &entry, &group);
+
+    nm_settings_open_group(&settings, "802-11-wireless", &entry, &group);
+    nm_dict_append_bytes(&group, "ssid", ssid, strlen(ssid));
+    nm_dict_append_variant(&group, "mode", DBUS_TYPE_STRING, &mode);
+    nm_settings_close_group(&settings, &entry, &group);
+
+    if (password && strlen(password) > 0) {
+        nm_settings_open_group(&settings, "802-11-wireless-security", &entry, &group);
+        nm_dict_append_variant(&group, "psk", DBUS_TYPE_STRING, &password);
+        nm_settings_close_group(&settings, &entry, &group);
+    }
+
+    dbus_message_iter_close_container(&iter, &settings);
+    dbus_message_iter_append_basic(&iter, DBUS_TYPE_OBJECT_PATH, &device);
+    dbus_message_iter_append_basic(&iter, DBUS_TYPE_OBJECT_PATH, &ap);
+
+    printf("[NM] AddAndActivateConnection ssid='%s' ap=%s\n", ssid, ap);
+
+    dbus_error_init(&err);
+    reply = dbus_connection_send_with_reply_and_block(be->conn, msg,
+                                                      NM_CALL_TIMEOUT_MS, &err);
+    dbus_message_unref(msg);
+    if (!reply) {
+        printf("[NM] AddAndActivateConnection failed: %s\n",
+               dbus_error_is_set(&err) ? err.message : "out of memory");
+        // A malformed PSK is rejected as an invalid property
+        res = dbus_error_is_set(&err) && strstr(err.name, "InvalidProperty") ?
+              WIFI_RESULT_AUTH_FAILED : WIFI_RESULT_FAILED;
+        dbus_error_free(&err);
+        return res;
+    }
+
+    if (!dbus_message_get_args(reply, NULL, DBUS_TYPE_OBJECT_PATH, &conn_path,
+                               DBUS_TYPE_OBJECT_PATH, &active_path,
+                               DBUS_TYPE_INVALID)) {
+        dbus_message_unref(reply);
+        return WIFI_RESULT_BACKEND_ERROR;
+    }
+
+    snprintf(be->connection_path, sizeof(be->connection_path), "%s", conn_path);
+    res = nm_wait_activated(be, job, active_path);
+    dbus_message_unref(reply);
+
+    printf("[NM] Activation of '%s': %s\n", ssid, wifi_result_str(res));
+
+    // Like nmcli, do not leave a profile with bad credentials behind
+    if (res != WIFI_RESULT_OK && res != WIFI_RESULT_CANCELLED) {
+        nm_delete_connection(be, be->connection_path);
+        be->connection_path[0] = '\0';
+    }
+
+    return res;
+}
+
+/*
+ * Request an active scan and wait until NetworkManager reports it done.
+ * With @ssid set the SSID is probed explicitly, so hidden networks are
+ * found too.  @job may be NULL for background scans.
+ */
+static void nm_request_scan(struct wifi_backend *be, struct wifi_job *job,
+                const char *ssid)
+{
+    DBusMessageIter iter, options, entry, variant, ssids, bytes;
+    const char *key = "ssids";
+    int64_t last_scan = 0, scan = 0;
+    uint64_t deadline;
+    DBusMessage *msg, *reply;
+    DBusError err;
+
+    nm_get_basic_property(be, be->device_path, NM_WIRELESS_IFACE, "LastScan",
+                          DBUS_TYPE_INT64, &last_scan, sizeof(last_scan));
+
+    msg = dbus_message_new_method_call(NM_SERVICE, be->device_path,
+                                       NM_WIRELESS_IFACE, "RequestScan");
+    if (!msg)
+        return;
+
+    dbus_message_iter_init_append(msg, &iter);
+    dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{sv}", &options);
+    if (ssid) {
+        dbus_message_iter_open_container(&options, DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+        dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &key);
+        dbus_message_iter_open_container(&entry, DBUS_TYPE_VARIANT, "aay", &variant);
+        dbus_message_iter_open_container(&variant, DBUS_TYPE_ARRAY, "ay", &ssids);
+        dbus_message_iter_open_container(&ssids, DBUS_TYPE_ARRAY,
+                                         DBUS_TYPE_BYTE_AS_STRING, &bytes);
+        dbus_message_iter_append_fixed_array(&bytes, DBUS_TYPE_BYTE, &ssid, strlen(ssid));
+        dbus_message_iter_close_container(&ssids, &bytes);
+        dbus_message_iter_close_container(&variant, &ssids);
+        dbus_message_iter_close_container(&entry, &variant);
+        dbus_message_iter_close_container(&options, &entry);
+    }
+    dbus_message_iter_close_container(&iter, &options);
+
+    printf("[NM] Requesting scan%s%s%s\n", ssid ? " for '" : "",
+           ssid ? ssid : "", ssid ? "'" : "");
+
+    dbus_error_init(&err);
+    reply = dbus_connection_send_with_reply_and_block(be->conn, msg,
+                                                      NM_CALL_TIMEOUT_MS, &err);
+    dbus_message_unref(msg);
+    if (!reply) {
+        // Usually "scanning not allowed" while a scan is already running
+        printf("[NM] RequestScan: %s\n",
+               dbus_error_is_set(&err) ? err.message : "out of memory");
+        dbus_error_free(&err);
+    } else {
+        dbus_message_unref(reply);
+    }
+
+    deadline = now_ms() + NM_SCAN_TIMEOUT_MS;
+    while (now_ms() < deadline && !wifi_job_cancelled(job)) {
+        usleep(NM_POLL_INTERVAL_MS * 1000);
+        if (nm_get_basic_property(be, be->device_path, NM_WIRELESS_IFACE,
+                                  "LastScan", DBUS_TYPE_INT64, &scan,
+                                  sizeof(scan)) == 0 && scan != last_scan) {
+            printf("[NM] Scan completed\n");
+            return;
+        }
+    }
+
+    printf("[NM] Scan did not complete within %d ms\n", NM_SCAN_TIMEOUT_MS);
+}
+
+static void wifi_backend_rescan(struct wifi_backend *be, struct wifi_job *job,
+                const char *ssid)
+{
+    nm_request_scan(be, job, ssid);
+}
+
+// NM80211ApFlags / NM80211ApSecurityFlags bits used to classify security
+#define NM_AP_FLAGS_PRIVACY             0x1
+#define NM_AP_SEC_KEY_MGMT_PSK          0x100
+#define NM_AP_SEC_KEY_MGMT_802_1X       0x200
+#define NM_AP_SEC_KEY_MGMT_SAE          0x400
+
+static enum wifi_security nm_ap_security(uint32_t flags, uint32_t wpa_flags,
+                uint32_t rsn_flags)
+{
+    if ((wpa_flags | rsn_flags) & NM_AP_SEC_KEY_MGMT_802_1X)
+        return WIFI_SECURITY_ENTERPRISE;
+    if (rsn_flags & NM_AP_SEC_KEY_MGMT_SAE)
+        return WIFI_SECURITY_WPA3;
+    if (rsn_flags & NM_AP_SEC_KEY_MGMT_PSK)
+        return WIFI_SECURITY_WPA2;
+    if (wpa_flags & NM_AP_SEC_KEY_MGMT_PSK)
+        return WIFI_SECURITY_WPA;
+    if (flags & NM_AP_FLAGS_PRIVACY)
+        return WIFI_SECURITY_WEP;
+    return WIFI_SECURITY_OPEN;
+}
+
+// Fill @entry from one GetAll on the access point, rather than a Get per field
+static int nm_read_access_point(struct wifi_backend *be, const char *ap_path,
+                struct wifi_scan_entry *entry)
+{
+    const char *iface = NM_AP_IFACE;
+    DBusMessageIter iter, props;
+    uint32_t flags = 0, wpa_flags = 0, rsn_flags = 0, freq = 0;
+    uint8_t strength = 0;
+    DBusMessage *reply;
+    DBusError err;
+
+    dbus_error_init(&err);
+    reply = nm_call(be, ap_path, DBUS_PROPERTIES_IFACE, "GetAll", &err,
+                    DBUS_TYPE_STRING, &iface, DBUS_TYPE_INVALID);
+    dbus_error_free(&err);
+    if (!reply)
+        return -EIO;
+
+    if (!dbus_message_iter_init(reply, &iter) ||
+            dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_ARRAY) {
+        dbus_message_unref(reply);
+        return -EINVAL;
+    }
+
+    memset(entry, 0, sizeof(*entry));
+    dbus_message_iter_recurse(&iter, &props);
+    while (dbus_message_iter_get_arg_type(&props) == DBUS_TYPE_DICT_ENTRY) {
+        DBusMessageIter prop, value;
+        const char *name;
+        int type;
+
+        dbus_message_iter_recurse(&props, &prop);
+        dbus_message_iter_get_basic(&prop, &name);
+        dbus_message_iter_next(&prop);
+        dbus_message_iter_recurse(&prop, &value);
+        type = dbus_message_iter_get_arg_type(&value);
+
+        if (!strcmp(name, "Ssid") && type == DBUS_TYPE_ARRAY) {
+            DBusMessageIter array;
+            const char *bytes;
+            int n;
+
+            dbus_message_iter_recurse(&value, &array);
+            dbus_message_iter_get_fixed_array(&array, &bytes, &n);
+            if (n > WIFI_SSID_MAX_LEN)
+                n = WIFI_SSID_MAX_LEN;
+            memcpy(entry->ssid, bytes, n);
+            entry->ssid[n] = '\0';
+        } else if (!strcmp(name, "HwAddress") && type == DBUS_TYPE_STRING) {
+            const char *str;
+
+            dbus_message_iter_get_basic(&value, &str);
+            sscanf(str, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx", &entry->bssid[0],
+                   &entry->bssid[1], &entry->bssid[2], &entry->bssid[3],
+                   &entry->bssid[4], &entry->bssid[5]);
+        } else if (!strcmp(name, "Strength") && type == DBUS_TYPE_BYTE) {
+            dbus_message_iter_get_basic(&value, &strength);
+        } else if (!strcmp(name, "Frequency") && type == DBUS_TYPE_UINT32) {
+            dbus_message_iter_get_basic(&value, &freq);
+        } else if (!strcmp(name, "Flags") && type == DBUS_TYPE_UINT32) {
+            dbus_message_iter_get_basic(&value, &flags);
+        } else if (!strcmp(name, "WpaFlags") && type == DBUS_TYPE_UINT32) {
+            dbus_message_iter_get_basic(&value, &wpa_flags);
+        } else if (!strcmp(name, "RsnFlags") && type == DBUS_TYPE_UINT32) {
+            dbus_message_iter_get_basic(&value, &rsn_flags);
+        }
+        dbus_message_iter_next(&props);
+    }
+
+    entry->rssi = wifi_strength_to_rssi(strength);
+    entry->freq = freq;
+    entry->security = nm_ap_security(flags, wpa_flags, rsn_flags);
+
+    dbus_message_unref(reply);
+    return 0;
+}
+
+// Scan and list up to @max access points; returns the number filled in
+static int wifi_backend_scan(struct wifi_backend *be,
+                struct wifi_scan_entry *entries, int max)
+{
+    DBusMessage *reply;
+    DBusError err;
+    char **paths;
+    int n, i, count = 0;
+
+    nm_request_scan(be, NULL, NULL);
+
+    dbus_error_init(&err);
+    reply = nm_call(be, be->device_path, NM_WIRELESS_IFACE,
+                    "GetAllAccessPoints", &err, DBUS_TYPE_INVALID);
+    dbus_error_free(&err);
+    if (!reply)
+        return -EIO;
+
+    if (!dbus_message_get_args(reply, NULL, DBUS_TYPE_ARRAY,
+                               DBUS_TYPE_OBJECT_PATH, &paths, &n,
+                               DBUS_TYPE_INVALID)) {
+        dbus_message_unref(reply);
+        return -EINVAL;
+    }
+
+    for (i = 0; i < n && count < max; i++) {
+        // Hidden networks carry an empty SSID and cannot be picked anyway
+        if (nm_read_access_point(be, paths[i], &entries[count]) == 0 &&
+                entries[count].ssid[0])
+            count++;
+    }
+
+    dbus_free_string_array(paths);
+    dbus_message_unref(reply);
+    return count;
+}
+
+/*
+ * Delete every WiFi profile except the one activated by the last connect
+ * (or, when nothing was activated, the ones named @current_ssid).
+ */
+static void wifi_backend_cleanup(struct wifi_backend *be, const char *current_ssid)
+{
+    DBusMessage *reply;
+    DBusError err;
+    char **paths;
+    int n, i;
+
+    printf("[WIFI] Cleaning up old WiFi connections (keeping: %s)\n", current_ssid);
+
+    dbus_error_init(&err);
+    reply = nm_call(be, NM_SETTINGS_PATH, NM_SETTINGS_IFACE, "ListConnections",
+                    &err, DBUS_TYPE_INVALID);
+    dbus_error_free(&err);
+    if (!reply) {
+        printf("[WIFI] Failed to get connection list\n");
+        return;
+    }
+
+    if (!dbus_message_get_args(reply, NULL, DBUS_TYPE_ARRAY,
+                               DBUS_TYPE_OBJECT_PATH, &paths, &n,
+                               DBUS_TYPE_INVALID)) {
+        dbus_message_unref(reply);
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        DBusMessage *settings;
+        char type[64], id[256];
+
+        if (!strcmp(paths[i], be->connection_path))
+            continue;
+
+        dbus_error_init(&err);
+        settings = nm_call(be, paths[i], NM_CONNECTION_IFACE, "GetSettings",
+                           &err, DBUS_TYPE_INVALID);
+        dbus_error_free(&err);
+        if (!settings)
+            continue;
+
+        if (nm_settings_get_string(settings, "connection", "type", type, sizeof(type)) < 0 ||
+                nm_settings_get_string(settings, "connection", "id", id, sizeof(id)) < 0 ||
+                strcmp(type, "802-11-wireless") ||
+                (!be->connection_path[0] && !strcmp(id, current_ssid))) {
+            dbus_message_unref(settings);
+            continue;
+        }
+        dbus_message_unref(settings);
+
+        printf("[WIFI] Removing old connection: %s\n", id);
+        nm_delete_connection(be, paths[i]);
+    }
+
+    dbus_free_string_array(paths);
+    dbus_message_unref(reply);
+}
+
+/*
+ * Store @req as a profile without activating it.  Unlike connect there is
+ * no access point to complete the security settings from, so key-mgmt is
+ * set from what the client stated.
+ */
+static void wifi_backend_add_profile(struct wifi_backend *be,
+                const struct wifi_request *req, int priority)
+{
+    DBusMessageIter iter, settings, entry, group;
+    const char *type = "802-11-wireless", *mode = "infrastructure";
+    const char *ssid = req->ssid, *psk = req->psk;
+    const char *key_mgmt = req->security == WIFI_SECURITY_WPA3 ? "sae" : "wpa-psk";
+    dbus_int32_t prio = priority;
+    DBusMessage *msg, *reply;
+    DBusError err;
+
+    msg = dbus_message_new_method_call(NM_SERVICE, NM_SETTINGS_PATH,
+                                       NM_SETTINGS_IFACE, "AddConnection");
+    if (!msg)
+        return;
+
+    dbus_message_iter_init_append(msg, &iter);
+    dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{sa{sv}}", &settings);
+
+    nm_settings_open_group(&settings, "connection", &entry, &group);
+    nm_dict_append_variant(&group, "id", DBUS_TYPE_STRING, &ssid);
+    nm_dict_append_variant(&group, "type", DBUS_TYPE_STRING, &type);
+    nm_dict_append_variant(&group, "autoconnect-priority", DBUS_TYPE_INT32, &prio);
+    nm_settings_close_group(&settings, &entry, &group);
+
+    nm_settings_open_group(&settings, "802-11-wireless", &entry, &group);
+    nm_dict_append_bytes(&group, "ssid", ssid, strlen(ssid));
+    nm_dict_append_variant(&group, "mode", DBUS_TYPE_STRING, &mode);
+    nm_settings_close_group(&settings, &entry, &group);
+
+    if (req->security != WIFI_SECURITY_OPEN && psk[0]) {
+        nm_settings_open_group(&settings, "802-11-wireless-security", &entry, &group);
+        nm_dict_append_variant(&group, "key-mgmt", DBUS_TYPE_STRING, &key_mgmt);
+        nm_dict_append_variant(&group, "psk", DBUS_TYPE_STRING, &psk);
+        nm_settings_close_group(&settings, &entry, &group);
+    }
+
+    dbus_message_iter_close_container(&iter, &settings);
+
+    dbus_error_init(&err);
+    reply = dbus_connection_send_with_reply_and_block(be->conn, msg,
+                                                      NM_CALL_TIMEOUT_MS, &err);
+    dbus_message_unref(msg);
+    if (!reply) {
+        printf("[NM] AddConnection '%s' failed: %s\n", ssid,
+               dbus_error_is_set(&err) ? err.message : "out of memory");
+        dbus_error_free(&err);
+        return;
+    }
+    dbus_message_unref(reply);
+
+    printf("[WIFI] Stored fallback '%s' (priority %d)\n", ssid, priority);
+}
+
+#elif WIFI_BACKEND_MOCK
+
+/*
+ * Mock backend for the provisioning benchmark (btgatt_benchmark.py).  Every
+ * connect succeeds after BTGATT_MOCK_CONNECT_MS and DHCP "completes" after
+ * BTGATT_MOCK_DHCP_MS with a TEST-NET address; wlan0 is never touched.
+ */
+#define WIFI_MOCK_IP "192.0.2.10"
+
+static unsigned int wifi_mock_delay_ms(const char *name, unsigned int def)
+{
+    const char *val = getenv(name);
+
+    return val ? (unsigned int) strtoul(val, NULL, 10) : def;
+}
+
+// Sleep in short slices so a disconnect still cancels the job promptly
+static bool wifi_mock_sleep(struct wifi_job *job, unsigned int ms)
+{
+    uint64_t deadline = now_ms() + ms;
+
+    while (now_ms() < deadline) {
+        if (wifi_job_cancelled(job))
+            return false;
+        usleep(10000);
+    }
+
+    return !wifi_job_cancelled(job);
+}
+
+static int wifi_backend_open(struct wifi_backend *be)
+{
+    memset(be, 0, sizeof(*be));
+    return 0;
+}
+
+static void wifi_backend_close(struct wifi_backend *be)
+{
+}
+
+static int wifi_backend_get_active_ssid(struct wifi_backend *be, char *ssid,
+                size_t len)
+{
+    return -ENOENT;
+}
+
+static enum wifi_result wifi_backend_connect(struct wifi_backend *be,
+                struct wifi_job *job, const struct wifi_request *req)
+{
+    printf("[MOCK] Connecting to '%s'\n", req->ssid);
+    if (!wifi_mock_sleep(job, wifi_mock_delay_ms("BTGATT_MOCK_CONNECT_MS", 1000)))
+        return WIFI_RESULT_CANCELLED;
+
+    return WIFI_RESULT_OK;
+}
+
+static void wifi_backend_rescan(struct wifi_backend *be, struct wifi_job *job,
+                const char *ssid)
+{
+}
+
+static int wifi_backend_scan(struct wifi_backend *be,
+                struct wifi_scan_entry *entries, int max)
+{
+    static const struct wifi_scan_entry mock_entries[] = {
+        { "bench-ap", { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 }, -45,
+          WIFI_SECURITY_WPA2, 2437 },
+        { "bench-ap-5g", { 0x02, 0x00, 0x00, 0x00, 0x00, 0x02 }, -60,
+          WIFI_SECURITY_WPA3, 5180 },
+    };
+    int n = (int) (sizeof(mock_entries) / sizeof(mock_entries[0]));
+
+    if (n > max)
+        n = max;
+    memcpy(entries, mock_entries, n * sizeof(*entries));
+    return n;
+}
+
+static void wifi_backend_cleanup(struct wifi_backend *be, const char *current_ssid)
+{
+}
+
+static void wifi_backend_add_profile(struct wifi_backend *be,
+                const struct wifi_request *req, int priority)
+{
+    printf("[MOCK] Stored fallback '%s' (priority %d)\n", req->ssid, priority);
+}
+
+#else /* nmcli */
+
+static int wifi_backend_open(struct wifi_backend *be)
+{
+    memset(be, 0, sizeof(*be));
+    return 0;
+}
+
+static void wifi_backend_close(struct wifi_backend *be)
+{
+}
+
+/*
+ * Start nmcli with @argv.  The arguments reach nmcli as they are, without a
+ * shell, so SSIDs, passphrases and profile names from the client need no
+ * quoting.  With @out, its stdout and stderr come back on *@out; otherwise
+ * they are discarded.  Returns the pid for nmcli_wait().
+ */
+static pid_t nmcli_spawn(const char *const argv[], FILE **out)
+{
+    int fds[2] = { -1, -1 };
+    pid_t pid;
+    int fd;
+
+    if (out) {
+        if (pipe(fds) < 0)
+            return -errno;
+        fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+        fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    }
+
+    pid = fork();
+    if (pid < 0) {
+        int err = -errno;
+
+        if (out) {
+            close(fds[0]);
+            close(fds[1]);
+        }
+        return err;
+    }
+
+    if (pid == 0) {
+        fd = out ? fds[1] : open("/dev/null", O_WRONLY);
+        if (fd >= 0) {
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+        }
+        execvp("nmcli", (char *const *) argv);
+        _exit(127);
+    }
+
+    if (out) {
+        close(fds[1]);
+        *out = fdopen(fds[0], "r");
+        if (!*out)
+            close(fds[0]);
+    }
+
+    return pid;
+}
+
+// Reap nmcli and return its exit status
+static int nmcli_wait(pid_t pid)
+{
+    int status;
+
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR)
+            return -errno;
+    }
+
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -ECHILD;
+}
+
+// Run nmcli with @argv, output discarded, and return its exit status
+static int nmcli_run(const char *const argv[])
+{
+    pid_t pid = nmcli_spawn(argv, NULL);
+
+    return pid < 0 ? pid : nmcli_wait(pid);
+}
+
+static int wifi_backend_get_active_ssid(struct wifi_backend *be, char *ssid,
+                size_t len)
+{
+    FILE *fp = popen("nmcli -t -f active,ssid dev wifi | grep '^yes:' | cut -d':' -f2", "r");
+    if (!fp) {
+        return -EIO;
+    }
+    
+    if (fgets(ssid, len, fp)) {
+        // Remove newline character
+        ssid[strcspn(ssid, "\n")] = 0;
+        pclose(fp);
+        return 0;
+    }
+    
+    pclose(fp);
+    return -ENOENT;
+}
+
+static enum wifi_result wifi_backend_connect(struct wifi_backend *be,
+                struct wifi_job *job, const struct wifi_request *req)
+{
+    const char *ssid = req->ssid;
+    const char *password = req->security == WIFI_SECURITY_OPEN ? NULL : req->psk;
+    const char *argv[12];
+    char bssid_arg[18];
+    char cmd_output[512] = {0};
+    char line[256];
+    enum wifi_result res = WIFI_RESULT_FAILED;
+    FILE *cmd_fp = NULL;
+    pid_t pid;
+    int n = 0;
+
+    argv[n++] = "nmcli";
+    argv[n++] = "device";
+    argv[n++] = "wifi";
+    argv[n++] = "connect";
+    argv[n++] = ssid;
+    if (password && strlen(password) > 0) {
+        argv[n++] = "password";
+        argv[n++] = password;
+    }
+    if (req->has_bssid) {
+        snprintf(bssid_arg, sizeof(bssid_arg), "%02X:%02X:%02X:%02X:%02X:%02X",
+                 req->bssid[0], req->bssid[1], req->bssid[2],
+                 req->bssid[3], req->bssid[4], req->bssid[5]);
+        argv[n++] = "bssid";
+        argv[n++] = bssid_arg;
+    }
+    argv[n] = NULL;
+    
+    printf("[WIFI] Connecting with command: nmcli device wifi connect '%s' password '%s'\n", 
+           ssid, password ? "***" : "none");
+    
+    pid = nmcli_spawn(argv, &cmd_fp);
+    if (pid < 0) {
+        printf("[WIFI] Failed to execute nmcli command\n");
+        return WIFI_RESULT_BACKEND_ERROR;
+    }
+    
+    // Device 'wlan0' successfully activated with '26229f20-a62f-4192-9858-70e241bd141d'.
+    // Error: Connection activation failed: Secrets were required, but not provided.
+    // Error: No network with SSID 'TPLINK-20202' found.
+    if (cmd_fp && fgets(cmd_output, sizeof(cmd_output), cmd_fp)) {
+        printf("[WIFI] nmcli output: %s", cmd_output);
+        
+        if (strstr(cmd_output, "successfully activated") != NULL) {
+            res = WIFI_RESULT_OK;
+        } else if (strstr(cmd_output, "No network with SSID") != NULL) {
+            res = WIFI_RESULT_NOT_FOUND;
+        } else if (strstr(cmd_output, "Secrets were required") != NULL) {
+            res = WIFI_RESULT_AUTH_FAILED;
+        }
+    } else {
+        printf("[WIFI] No output from nmcli command\n");
+    }
+
+    // Drain the rest so nmcli never dies on a closed pipe
+    if (cmd_fp) {
+        while (fgets(line, sizeof(line), cmd_fp))
+            ;
+        fclose(cmd_fp);
+    }
+    
+    int cmd_exit_status = nmcli_wait(pid);
+    printf("[WIFI] nmcli exit status: %d\n", cmd_exit_status);
+    if (res == WIFI_RESULT_OK && cmd_exit_status != 0)
+        res = WIFI_RESULT_FAILED;
+
+    return res;
+}
+
+static void wifi_backend_rescan(struct wifi_backend *be, struct wifi_job *job,
+                const char *ssid)
+{
+    printf("[WIFI] Scanning for WiFi networks before retry...\n");
+    // Perform WiFi scan
+    system("nmcli device wifi list ifname wlan0 > /dev/null 2>&1");
+    if (system("nmcli device wifi list ifname wlan0 > /dev/null 2>&1") == 0) {
+        printf("[WIFI] Scan results:\n");
+        system("nmcli device wifi list ifname wlan0");
+    } else {
+        printf("[WIFI] Failed to perform WiFi scan\n");
+    }
+    
+    // Wait a moment for scan to complete
+    sleep(1);
+}
+
+// Split one nmcli -t field; ':' inside a value is escaped as "\:"
+static char *nmcli_next_field(char **line)
+{
+    char *start = *line, *src = start, *dst = start;
+
+    if (!start)
+        return NULL;
+
+    while (*src && *src != ':') {
+        if (*src == '\\' && src[1])
+            src++;
+        *dst++ = *src++;
+    }
+
+    *line = *src ? src + 1 : NULL;
+    *dst = '\0';
+    return start;
+}
+
+static enum wifi_security nmcli_security(const char *str)
+{
+    if (strstr(str, "802.1X"))
+        return WIFI_SECURITY_ENTERPRISE;
+    if (strstr(str, "WPA3") || strstr(str, "SAE"))
+        return WIFI_SECURITY_WPA3;
+    if (strstr(str, "WPA2"))
+        return WIFI_SECURITY_WPA2;
+    if (strstr(str, "WPA"))
+        return WIFI_SECURITY_WPA;
+    if (strstr(str, "WEP"))
+        return WIFI_SECURITY_WEP;
+    return WIFI_SECURITY_OPEN;
+}
+
+static int wifi_backend_scan(struct wifi_backend *be,
+                struct wifi_scan_entry *entries, int max)
+{
+    char line[256];
+    int count = 0;
+    FILE *fp;
+
+    fp = popen("nmcli -t -f SSID,BSSID,SIGNAL,SECURITY,FREQ device wifi list "
+               "ifname " WIFI_IFNAME " --rescan yes 2>/dev/null", "r");
+    if (!fp)
+        return -EIO;
+
+    while (count < max && fgets(line, sizeof(line), fp)) {
+        struct wifi_scan_entry *entry = &entries[count];
+        char *rest = line, *ssid, *bssid, *signal, *security, *freq;
+
+        line[strcspn(line, "\n")] = '\0';
+        ssid = nmcli_next_field(&rest);
+        bssid = nmcli_next_field(&rest);
+        signal = nmcli_next_field(&rest);
+        security = nmcli_next_field(&rest);
+        freq = nmcli_next_field(&rest);
+        if (!freq || !ssid[0])
+            continue;
+
+        memset(entry, 0, sizeof(*entry));
+        snprintf(entry->ssid, sizeof(entry->ssid), "%s", ssid);
+        sscanf(bssid, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx", &entry->bssid[0],
+               &entry->bssid[1], &entry->bssid[2], &entry->bssid[3],
+               &entry->bssid[4], &entry->bssid[5]);
+        entry->rssi = wifi_strength_to_rssi(atoi(signal));
+        entry->security = nmcli_security(security);
+        entry->freq = atoi(freq);   // "2437 MHz"
+        count++;
+    }
+
+    pclose(fp);
+    return count;
+}
+
+static void wifi_backend_cleanup(struct wifi_backend *be, const char *current_ssid)
+{
+    static const char *const list_argv[] = {
+        "nmcli", "-t", "-f", "name,type", "connection", "show", NULL
+    };
+    const char *argv[] = { "nmcli", "connection", "delete", NULL, NULL };
+    FILE *fp = NULL;
+    char line[256];
+    char *rest, *name, *type;
+    pid_t pid;
+    
+    printf("[WIFI] Cleaning up old WiFi connections (keeping: %s)\n", current_ssid);
+    
+    // 获取所有WiFi连接
+    pid = nmcli_spawn(list_argv, &fp);
+    if (pid < 0 || !fp) {
+        printf("[WIFI] Failed to get connection list\n");
+        if (pid >= 0)
+            nmcli_wait(pid);
+        return;
+    }
+    
+    while (fgets(line, sizeof(line), fp)) {
+        // 移除换行符
+        line[strcspn(line, "\n")] = 0;
+        rest = line;
+        name = nmcli_next_field(&rest);
+        type = nmcli_next_field(&rest);
+        if (!type || strcmp(type, "802-11-wireless"))
+            continue;
+        
+        // 跳过当前SSID的连接
+        if (strcmp(name, current_ssid) == 0) {
+            continue;
+        }
+        
+        // 删除其他WiFi连接
+        printf("[WIFI] Removing old connection: %s\n", name);
+        argv[3] = name;
+        nmcli_run(argv);
+    }
+    
+    fclose(fp);
+    nmcli_wait(pid);
+}
+
+static void wifi_backend_add_profile(struct wifi_backend *be,
+                const struct wifi_request *req, int priority)
+{
+    const char *argv[20];
+    char prio[12];
+    int n = 0;
+
+    snprintf(prio, sizeof(prio), "%d", priority);
+
+    argv[n++] = "nmcli";
+    argv[n++] = "connection";
+    argv[n++] = "add";
+    argv[n++] = "type";
+    argv[n++] = "wifi";
+    argv[n++] = "ifname";
+    argv[n++] = WIFI_IFNAME;
+    argv[n++] = "con-name";
+    argv[n++] = req->ssid;
+    argv[n++] = "ssid";
+    argv[n++] = req->ssid;
+    argv[n++] = "connection.autoconnect-priority";
+    argv[n++] = prio;
+    if (req->security != WIFI_SECURITY_OPEN && req->psk[0]) {
+        argv[n++] = "wifi-sec.key-mgmt";
+        argv[n++] = req->security == WIFI_SECURITY_WPA3 ? "sae" : "wpa-psk";
+        argv[n++] = "wifi-sec.psk";
+        argv[n++] = req->psk;
+    }
+    argv[n] = NULL;
+
+    if (nmcli_run(argv) == 0)
+        printf("[WIFI] Stored fallback '%s' (priority %d)\n", req->ssid, priority);
+    else
+        printf("[WIFI] Failed to store fallback '%s'\n", req->ssid);
+}
+
+#endif /* WIFI_BACKEND_NM_DBUS / WIFI_BACKEND_MOCK */
+
+static char* get_wlan_ip_address(void)
+{
+    struct ifaddrs *ifaddr, *ifa;
+    char *ip = NULL;
+
+    if (getifaddrs(&ifaddr) < 0) {
+        return NULL;
+    }
+
+    for (ifa = ifaddr; ifa; ifa = ifa->ifa_next) {
+        if (!ifa->ifa_addr || ifa->ifa_addr->sa_family != AF_INET ||
+                strcmp(ifa->ifa_name, WIFI_IFNAME))
+            continue;
+
+        ip = malloc(INET_ADDRSTRLEN);
+        if (ip && !inet_ntop(AF_INET,
+                    &((struct sockaddr_in *) ifa->ifa_addr)->sin_addr,
+                    ip, INET_ADDRSTRLEN)) {
+            free(ip);
+            ip = NULL;
+        }
+        break;
+    }
+
+    freeifaddrs(ifaddr);
+    return ip;
+}
+
+static bool is_valid_ip(const char *ip)
+{
+    if (!ip || strlen(ip) == 0) {
+        return false;
+    }
+    
+    // 检查是否为有效的IPv4地址（简单检查）
+    int parts = 0;
+    char *ip_copy = strdup(ip);
+    char *token = strtok(ip_copy, ".");
+    
+    while (token != NULL && parts < 4) {
+        int num = atoi(token);
+        if (num < 0 || num > 255) {
+            free(ip_copy);
+            return false;
+        }
+        parts++;
+        token = strtok(NULL, ".");
+    }
+    
+    free(ip_copy);
+    return parts == 4;
+}
+
+/*
+ * Scan results cache.
+ *
+ * A background worker refreshes the table every WIFI_SCAN_INTERVAL_SECONDS
+ * while a client is connected, or when a client asks for it, and the
+ * mainloop serves it to clients from the scan-results characteristic.
+ * With nobody connected the worker sleeps until the next connection.
+ * Entries are kept strongest first.
+ */
+#define WIFI_SCAN_MAX_ENTRIES 32
+#define WIFI_SCAN_INTERVAL_SECONDS 60
+#define WIFI_SCAN_RETRY_SECONDS 10          // after a failed or deferred scan
+#define WIFI_SCAN_MIN_INTERVAL_MS 10000     // on-demand requests within this reuse the table
+#define WIFI_SCAN_FRESH_MS 30000            // trusted by the connect path
+
+struct wifi_scan_cache {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;                    // wakes the worker for a request
+    struct wifi_scan_entry entries[WIFI_SCAN_MAX_ENTRIES];
+    unsigned int count;
+    uint8_t generation;                     // bumped on every completed scan
+    uint64_t updated_ms;                    // 0 until the first scan completes
+    bool requested;
+    bool periodic;                          // a client is connected
+    int event_fd;                           // worker -> mainloop
+};
+
+static struct wifi_scan_cache scan_cache = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .requested = true,                      // scan once at startup
+    .event_fd = -1,
+};
+
+/*
+ * Returns 1 when a scan younger than WIFI_SCAN_FRESH_MS saw @ssid, 0 when
+ * such a scan did not, and -1 when there is no recent scan to go by.
+ */
+static int wifi_scan_cache_lookup(const char *ssid)
+{
+    unsigned int i;
+    int found = -1;
+
+    pthread_mutex_lock(&scan_cache.lock);
+    if (scan_cache.updated_ms &&
+            now_ms() - scan_cache.updated_ms < WIFI_SCAN_FRESH_MS) {
+        found = 0;
+        for (i = 0; i < scan_cache.count; i++) {
+            if (!strcmp(scan_cache.entries[i].ssid, ssid)) {
+                found = 1;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&scan_cache.lock);
+
+    return found;
+}
+
+// Strongest RSSI a recent scan saw for @ssid, INT8_MIN when it did not
+static int wifi_scan_cache_rssi(const char *ssid)
+{
+    unsigned int i;
+    int rssi = INT8_MIN;
+
+    pthread_mutex_lock(&scan_cache.lock);
+    if (scan_cache.updated_ms &&
+            now_ms() - scan_cache.updated_ms < WIFI_SCAN_FRESH_MS) {
+        // Kept strongest first
+        for (i = 0; i < scan_cache.count; i++) {
+            if (!strcmp(scan_cache.entries[i].ssid, ssid)) {
+                rssi = scan_cache.entries[i].rssi;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&scan_cache.lock);
+
+    return rssi;
+}
+
+/*
+ * Provisioning wire formats.
+ *
+ * The original app writes '\n'-terminated JSON, {"ssid":"..","pw":".."},
+ * and gets {"ip":".."} or {"err":".."} back.  A batch of candidates is
+ * sent as {"nets":[{"ssid":"..","pw":".."},..],"order":"rssi"} ("order"
+ * is optional) and answered {"ip":"..","net":<index>}.  Newer apps read the
+ * protocol version characteristic and may use the binary framing instead:
+ *
+ *   version(1) type(1) seq(1) payload_len(2, LE) payload crc16(2, LE)
+ *
+ * The payload is a sequence of tag(1) len(1) value items; unknown tags are
+ * skipped.  The CRC is CRC-16/CCITT-FALSE over everything before it.  A
+ * frame starts with WIFI_TLV_VERSION, which can never start a JSON body.
+ * Each further SSID item starts the next candidate of a batch, and the
+ * items after it describe that candidate.  A result frame with an IPv4
+ * address and a network index is 19 bytes, so it always fits one
+ * notification at the default MTU.
+ *
+ * A request with a PROGRESS item (JSON: "progress":1) also gets a progress
+ * frame as each phase of the job starts: the phase code, the milliseconds
+ * since the request was accepted and, while connecting a batch, the
+ * candidate index.  Progress frames are at most 19 bytes (JSON 20) and stop
+ * once the result has been sent.
+ */
+enum wifi_proto {
+    WIFI_PROTO_JSON,
+    WIFI_PROTO_TLV,
+};
+
+// Result of a request; the values are the TLV status codes
+enum wifi_status {
+    WIFI_STATUS_OK = 0x00,
+    WIFI_STATUS_NO_IP = 0x01,       // associated, but DHCP never answered
+    WIFI_STATUS_BAD_FORMAT = 0x02,
+    WIFI_STATUS_BAD_SSID = 0x03,
+    WIFI_STATUS_CMD_FAIL = 0x04,    // backend unreachable
+    WIFI_STATUS_CONN_FAIL = 0x05,
+    WIFI_STATUS_BLE_LOST = 0x06,
+    WIFI_STATUS_BUSY = 0x07,
+};
+
+// Phase codes of progress frames
+enum wifi_progress_phase {
+    WIFI_PROGRESS_CONFIGURING = 0x01,
+    WIFI_PROGRESS_SCANNING = 0x02,
+    WIFI_PROGRESS_CONNECTING = 0x03,
+    WIFI_PROGRESS_WAIT_IP = 0x04,
+};
+
+#define WIFI_TLV_VERSION 0x01
+#define WIFI_TLV_HDR_LEN 5
+#define WIFI_TLV_CRC_LEN 2
+
+#define WIFI_TLV_MSG_CONNECT 0x01
+#define WIFI_TLV_MSG_RESULT 0x81
+#define WIFI_TLV_MSG_PROGRESS 0x82
+
+#define WIFI_TLV_TAG_SSID 0x01
+#define WIFI_TLV_TAG_PSK 0x02
+#define WIFI_TLV_TAG_SECURITY 0x03
+#define WIFI_TLV_TAG_BSSID 0x04
+#define WIFI_TLV_TAG_ORDER 0x05     // 0: as listed, 1: strongest first
+#define WIFI_TLV_TAG_PROGRESS 0x06  // 1: send progress frames
+#define WIFI_TLV_TAG_STATUS 0x10
+#define WIFI_TLV_TAG_IPV4 0x11
+#define WIFI_TLV_TAG_NETWORK 0x12   // index of the candidate that connected
+#define WIFI_TLV_TAG_PHASE 0x13
+#define WIFI_TLV_TAG_ELAPSED 0x14   // LE32, ms since the request
+
+// Supported formats, as reported by the protocol version characteristic
+#define WIFI_PROTO_FLAG_JSON 0x01
+#define WIFI_PROTO_FLAG_TLV 0x02
+#define WIFI_PROTO_FLAG_BATCH 0x04
+#define WIFI_PROTO_FLAG_PROGRESS 0x08
+
+static uint16_t crc16_ccitt(const uint8_t *data, size_t len)
+{
+    uint16_t crc = 0xffff;
+    size_t i;
+    int bit;
+
+    for (i = 0; i < len; i++) {
+        crc ^= (uint16_t) data[i] << 8;
+        for (bit = 0; bit < 8; bit++)
+            crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+
+    return crc;
+}
+
+// Length of the whole frame at @buf, or 0 while the header is incomplete
+static size_t wifi_tlv_frame_len(const uint8_t *buf, size_t len)
+{
+    if (len < WIFI_TLV_HDR_LEN)
+        return 0;
+
+    return WIFI_TLV_HDR_LEN + get_le16(buf + 3) + WIFI_TLV_CRC_LEN;
+}
+
+// Empty batch; each slot's security is unknown until the client states it
+static void wifi_batch_init(struct wifi_batch *batch)
+{
+    int i;
+
+    memset(batch, 0, sizeof(*batch));
+    for (i = 0; i < WIFI_BATCH_MAX; i++)
+        batch->nets[i].security = WIFI_SECURITY_UNKNOWN;
+}
+
+// Decode a request frame in place; @buf must hold the whole frame
+static enum wifi_status wifi_tlv_decode(const uint8_t *buf, size_t len,
+                struct wifi_batch *batch, uint8_t *seq)
+{
+    size_t frame_len = wifi_tlv_frame_len(buf, len);
+    struct wifi_request *req = batch->nets;
+    const uint8_t *item, *end;
+
+    wifi_batch_init(batch);
+
+    if (!frame_len || frame_len > len || buf[0] != WIFI_TLV_VERSION)
+        return WIFI_STATUS_BAD_FORMAT;
+
+    *seq = buf[2];
+    if (get_le16(buf + frame_len - WIFI_TLV_CRC_LEN) !=
+            crc16_ccitt(buf, frame_len - WIFI_TLV_CRC_LEN) ||
+            buf[1] != WIFI_TLV_MSG_CONNECT)
+        return WIFI_STATUS_BAD_FORMAT;
+
+    item = buf + WIFI_TLV_HDR_LEN;
+    end = buf + frame_len - WIFI_TLV_CRC_LEN;
+    while (item < end) {
+        uint8_t tag, item_len;
+
+        if (end - item < 2 || end - item - 2 < item[1])
+            return WIFI_STATUS_BAD_FORMAT;
+        tag = item[0];
+        item_len = item[1];
+        item += 2;
+
+        switch (tag) {
+        case WIFI_TLV_TAG_SSID:
+            if (item_len == 0 || item_len > WIFI_SSID_MAX_LEN)
+                return WIFI_STATUS_BAD_SSID;
+            if (req->ssid[0]) {
+                if (req == &batch->nets[WIFI_BATCH_MAX - 1])
+                    return WIFI_STATUS_BAD_FORMAT;
+                req++;
+            }
+            memcpy(req->ssid, item, item_len);
+            req->ssid[item_len] = '\0';
+            break;
+        case WIFI_TLV_TAG_PSK:
+            if (item_len > WIFI_PSK_MAX_LEN)
+                return WIFI_STATUS_BAD_FORMAT;
+            memcpy(req->psk, item, item_len);
+            req->psk[item_len] = '\0';
+            break;
+        case WIFI_TLV_TAG_SECURITY:
+            if (item_len != 1)
+                return WIFI_STATUS_BAD_FORMAT;
+            req->security = item[0];
+            break;
+        case WIFI_TLV_TAG_BSSID:
+            if (item_len != 6)
+                return WIFI_STATUS_BAD_FORMAT;
+            memcpy(req->bssid, item, 6);
+            req->has_bssid = true;
+            break;
+        case WIFI_TLV_TAG_ORDER:
+            if (item_len != 1)
+                return WIFI_STATUS_BAD_FORMAT;
+            batch->by_rssi = item[0] == 1;
+            break;
+        case WIFI_TLV_TAG_PROGRESS:
+            if (item_len != 1)
+                return WIFI_STATUS_BAD_FORMAT;
+            batch->progress = item[0] == 1;
+            break;
+        }
+        item += item_len;
+    }
+
+    // Items after the last SSID must belong to a candidate
+    if (!req->ssid[0])
+        return WIFI_STATUS_BAD_SSID;
+
+    batch->count = req - batch->nets + 1;
+    return WIFI_STATUS_OK;
+}
+
+// @net: index of the candidate that connected, or -1 to leave it out
+static size_t wifi_tlv_encode_result(uint8_t seq, enum wifi_status status,
+                const char *ip, int net, uint8_t *buf)
+{
+    size_t len = WIFI_TLV_HDR_LEN;
+    struct in_addr addr;
+
+    buf[len++] = WIFI_TLV_TAG_STATUS;
+    buf[len++] = 1;
+    buf[len++] = status;
+    if (ip && inet_pton(AF_INET, ip, &addr) == 1) {
+        buf[len++] = WIFI_TLV_TAG_IPV4;
+        buf[len++] = 4;
+        memcpy(buf + len, &addr.s_addr, 4);
+        len += 4;
+    }
+    if (net >= 0) {
+        buf[len++] = WIFI_TLV_TAG_NETWORK;
+        buf[len++] = 1;
+        buf[len++] = net;
+    }
+
+    buf[0] = WIFI_TLV_VERSION;
+    buf[1] = WIFI_TLV_MSG_RESULT;
+    buf[2] = seq;
+    put_le16(len - WIFI_TLV_HDR_LEN, buf + 3);
+    put_le16(crc16_ccitt(buf, len), buf + len);
+
+    return len + WIFI_TLV_CRC_LEN;
+}
+
+// @net: candidate being connected, or -1 to leave it out
+static size_t wifi_tlv_encode_progress(uint8_t seq,
+                enum wifi_progress_phase phase, int net, uint32_t elapsed_ms,
+                uint8_t *buf)
+{
+    size_t len = WIFI_TLV_HDR_LEN;
+
+    buf[len++] = WIFI_TLV_TAG_PHASE;
+    buf[len++] = 1;
+    buf[len++] = phase;
+    buf[len++] = WIFI_TLV_TAG_ELAPSED;
+    buf[len++] = 4;
+    put_le32(elapsed_ms, buf + len);
+    len += 4;
+    if (net >= 0) {
+        buf[len++] = WIFI_TLV_TAG_NETWORK;
+        buf[len++] = 1;
+        buf[len++] = net;
+    }
+
+    buf[0] = WIFI_TLV_VERSION;
+    buf[1] = WIFI_TLV_MSG_PROGRESS;
+    buf[2] = seq;
+    put_le16(len - WIFI_TLV_HDR_LEN, buf + 3);
+    put_le16(crc16_ccitt(buf, len), buf + len);
+
+    return len + WIFI_TLV_CRC_LEN;
+}
+
+// One {"ssid":"..","pw":".."} object, top level or inside "nets"
+static enum wifi_status wifi_json_decode_net(cJSON *obj,
+                struct wifi_request *req)
+{
+    cJSON *ssid_item, *password_item;
+
+    ssid_item = cJSON_GetObjectItem(obj, "ssid");
+    password_item = cJSON_GetObjectItem(obj, "pw");
+    if (!ssid_item || !cJSON_IsString(ssid_item) ||
+            strlen(ssid_item->valuestring) > WIFI_SSID_MAX_LEN) {
+        printf("[DEBUG] Missing or invalid SSID\n");
+        return WIFI_STATUS_BAD_SSID;
+    }
+    if (password_item && cJSON_IsString(password_item) &&
+            strlen(password_item->valuestring) > WIFI_PSK_MAX_LEN)
+        return WIFI_STATUS_BAD_FORMAT;
+
+    snprintf(req->ssid, sizeof(req->ssid), "%s", ssid_item->valuestring);
+    if (password_item && cJSON_IsString(password_item))
+        snprintf(req->psk, sizeof(req->psk), "%s", password_item->valuestring);
+
+    return WIFI_STATUS_OK;
+}
+
+/*
+ * Decode the original JSON request, or a "nets" batch.  @data is parsed
+ * where it lies, without a NUL-terminated copy; cJSON stops at the end of
+ * the object, so a '\n' terminator and anything after it are ignored.
+ */
+static enum wifi_status wifi_json_decode(const uint8_t *data, size_t len,
+                struct wifi_batch *batch)
+{
+    enum wifi_status status = WIFI_STATUS_OK;
+    cJSON *root, *nets, *net, *order, *progress;
+
+    wifi_batch_init(batch);
+
+    root = cJSON_ParseWithLength((const char *) data, len);
+    if (!root) {
+        printf("[DEBUG] Failed to parse JSON\n");
+        return WIFI_STATUS_BAD_FORMAT;
+    }
+
+    nets = cJSON_GetObjectItem(root, "nets");
+    if (!nets) {
+        status = wifi_json_decode_net(root, &batch->nets[0]);
+        batch->count = 1;
+    } else if (!cJSON_IsArray(nets) || !cJSON_GetArraySize(nets) ||
+            cJSON_GetArraySize(nets) > WIFI_BATCH_MAX) {
+        status = WIFI_STATUS_BAD_FORMAT;
+    } else {
+        cJSON_ArrayForEach(net, nets) {
+            if (!cJSON_IsObject(net))
+                status = WIFI_STATUS_BAD_FORMAT;
+            else
+                status = wifi_json_decode_net(net, &batch->nets[batch->count++]);
+            if (status != WIFI_STATUS_OK)
+                break;
+        }
+
+        order = cJSON_GetObjectItem(root, "order");
+        batch->by_rssi = order && cJSON_IsString(order) &&
+                         !strcmp(order->valuestring, "rssi");
+    }
+
+    progress = cJSON_GetObjectItem(root, "progress");
+    batch->progress = progress && (cJSON_IsTrue(progress) ||
+                      (cJSON_IsNumber(progress) && progress->valueint == 1));
+
+    cJSON_Delete(root);
+    return status;
+}
+
+static size_t wifi_json_encode_result(enum wifi_status status,
+                const char *ip, int net, char *buf, size_t size)
+{
+    const char *err;
+
+    switch (status) {
+    case WIFI_STATUS_OK:
+        if (net >= 0)
+            return snprintf(buf, size, "{\"ip\":\"%s\",\"net\":%d}",
+                            ip ? ip : "", net);
+        return snprintf(buf, size, "{\"ip\":\"%s\"}", ip ? ip : "");
+    case WIFI_STATUS_NO_IP:
+        return snprintf(buf, size, "{\"ip\":\"\"}");
+    case WIFI_STATUS_BAD_FORMAT:
+        err = "bad fmt";
+        break;
+    case WIFI_STATUS_BAD_SSID:
+        err = "bad ssid";
+        break;
+    case WIFI_STATUS_CMD_FAIL:
+        err = "cmd fail";
+        break;
+    case WIFI_STATUS_BLE_LOST:
+        err = "BLE lost";
+        break;
+    case WIFI_STATUS_BUSY:
+        err = "busy";
+        break;
+    case WIFI_STATUS_CONN_FAIL:
+    default:
+        err = "conn fail";
+        break;
+    }
+
+    return snprintf(buf, size, "{\"err\":\"%s\"}", err);
+}
+
+/*
+ * {"p":3,"t":1234} is at most 20 bytes up to ~27 hours, so it always goes
+ * out as a single unterminated packet; JSON clients read the candidate
+ * being connected from the result instead.
+ */
+static size_t wifi_json_encode_progress(enum wifi_progress_phase phase,
+                uint32_t elapsed_ms, char *buf, size_t size)
+{
+    return snprintf(buf, size, "{\"p\":%d,\"t\":%u}", phase,
+                    (unsigned int) elapsed_ms);
+}
+
+static void wifi_job_post_result(struct wifi_job *job,
+                enum wifi_status status, const char *ip, int net);
+static void wifi_job_progress(struct wifi_job *job,
+                enum wifi_progress_phase phase, int net);
+
+/*
+ * Make the NetworkManager profiles survive a power cut without a global
+ * sync(2): fsync the keyfiles modified since @since and the directory that
+ * holds them (new and deleted entries).  Other data on the same eMMC, such
+ * as the Home Assistant and Zigbee databases, is left to writeback.
+ */
+#define NM_SYSTEM_CONNECTIONS_DIR "/etc/NetworkManager/system-connections"
+
+static void wifi_persist_profiles(struct wifi_job *job, time_t since)
+{
+    uint64_t start = now_ms();
+    struct dirent *de;
+    int synced = 0;
+    DIR *dir;
+    int dfd;
+
+    wifi_job_mark(job, SESSION_SYNC_START);
+
+    dir = opendir(NM_SYSTEM_CONNECTIONS_DIR);
+    if (!dir) {
+        printf("[WIFI] Cannot open %s: %s\n", NM_SYSTEM_CONNECTIONS_DIR,
+               strerror(errno));
+        return;
+    }
+    dfd = dirfd(dir);
+
+    while ((de = readdir(dir))) {
+        struct stat st;
+        int fd;
+
+        if (de->d_name[0] == '.')
+            continue;
+        if (fstatat(dfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0 ||
+                !S_ISREG(st.st_mode) || st.st_mtime < since)
+            continue;
+
+        fd = openat(dfd, de->d_name, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+        if (fsync(fd) == 0)
+            synced++;
+        else
+            printf("[WIFI] fsync %s failed: %s\n", de->d_name, strerror(errno));
+        close(fd);
+    }
+
+    if (fsync(dfd) < 0)
+        printf("[WIFI] fsync %s failed: %s\n", NM_SYSTEM_CONNECTIONS_DIR,
+               strerror(errno));
+    closedir(dir);
+
+    wifi_job_mark(job, SESSION_SYNC_DONE);
+    printf("[WIFI] Persisted %d connection profile(s) in %llu ms\n", synced,
+           (unsigned long long) (now_ms() - start));
+}
+
+// Blocking backend calls, timed for the metrics
+static enum wifi_result wifi_timed_connect(struct wifi_backend *backend,
+                struct wifi_job *job, const struct wifi_request *req)
+{
+    uint64_t start = now_ms();
+    enum wifi_result res = wifi_backend_connect(backend, job, req);
+
+    metrics_observe(METRICS_BACKEND_MS, now_ms() - start);
+    return res;
+}
+
+static void wifi_timed_rescan(struct wifi_backend *backend,
+                struct wifi_job *job, const char *ssid)
+{
+    uint64_t start = now_ms();
+
+    wifi_backend_rescan(backend, job, ssid);
+    metrics_observe(METRICS_BACKEND_MS, now_ms() - start);
+}
+
+/*
+ * One candidate: probe for it if a fresh scan missed it, connect and wait
+ * for DHCP.  @res tells how the association itself went.
+ */
+static enum wifi_status wifi_try_network(struct wifi_job *job,
+                struct wifi_backend *backend, const struct wifi_request *req,
+                int net, char *ip, size_t ip_len, enum wifi_result *res)
+{
+    const char *ssid = req->ssid;
+    int seen;
+
+    *res = WIFI_RESULT_CANCELLED;
+    if (wifi_job_cancelled(job)) {
+        printf("[WIFI] Job cancelled before connecting, aborting\n");
+        return WIFI_STATUS_BLE_LOST;
+    }
+
+    // 2. 连接新的WiFi网络
+    // A fresh background scan that missed the SSID means it is hidden or
+    // out of range: probe for it once up front instead of failing first
+    seen = wifi_scan_cache_lookup(ssid);
+    if (seen == 0) {
+        printf("[WIFI] '%s' not in recent scan results, probing before connecting\n", ssid);
+        wifi_job_progress(job, WIFI_PROGRESS_SCANNING, net);
+        wifi_timed_rescan(backend, job, ssid);
+    }
+
+    wifi_job_mark(job, SESSION_CONNECT_START);
+    wifi_job_progress(job, WIFI_PROGRESS_CONNECTING, net);
+    *res = wifi_timed_connect(backend, job, req);
+
+    // Without recent scan results, scan once and retry a network not found
+    if (*res == WIFI_RESULT_NOT_FOUND && seen < 0 && !wifi_job_cancelled(job)) {
+        printf("[WIFI] Network not found in cache, will try scanning\n");
+        wifi_job_progress(job, WIFI_PROGRESS_SCANNING, net);
+        wifi_timed_rescan(backend, job, ssid);
+
+        printf("[WIFI] Retrying connection after scan...\n");
+        wifi_job_progress(job, WIFI_PROGRESS_CONNECTING, net);
+        *res = wifi_timed_connect(backend, job, req);
+    }
+    wifi_job_mark(job, SESSION_CONNECT_END);
+    
+    if (*res != WIFI_RESULT_OK) {
+        printf("[WIFI] Connect failed (%s), not checking IP address\n",
+               wifi_result_str(*res));
+        if (*res == WIFI_RESULT_BACKEND_ERROR)
+            return WIFI_STATUS_CMD_FAIL;
+        if (*res == WIFI_RESULT_CANCELLED)
+            return WIFI_STATUS_BLE_LOST;
+        return WIFI_STATUS_CONN_FAIL;
+    }
+    
+    // 3. 等待 wlan0 获得 IPv4 地址 (由主循环的 rtnetlink 监听通知)
+    printf("[WIFI] Connect successful, waiting up to %d seconds for IP address...\n",
+           ip_wait_seconds);
+    wifi_job_progress(job, WIFI_PROGRESS_WAIT_IP, net);
+    if (wifi_job_wait_ip(job, ip, ip_len)) {
+        printf("[WIFI] WiFi connection successful! IP: %s\n", ip);
+        wifi_job_mark(job, SESSION_IP_ACQUIRED);
+        return WIFI_STATUS_OK;
+    }
+
+    if (wifi_job_cancelled(job)) {
+        printf("[WIFI] BLE client disconnected during WiFi config, aborting\n");
+        return WIFI_STATUS_BLE_LOST;
+    }
+    
+    // 超时仍未获得有效IP地址
+    printf("[WIFI] WiFi connection failed - no valid IP address after %d seconds\n",
+           ip_wait_seconds);
+    return WIFI_STATUS_NO_IP;
+}
+
+// Order in which to try the candidates of @batch
+static void wifi_batch_order(const struct wifi_batch *batch, int *order)
+{
+    int rssi[WIFI_BATCH_MAX];
+    int i, j, k;
+
+    for (i = 0; i < batch->count; i++) {
+        order[i] = i;
+        rssi[i] = batch->by_rssi ? wifi_scan_cache_rssi(batch->nets[i].ssid) : 0;
+    }
+
+    // Stable insertion sort: unseen networks keep their place at the end
+    for (i = 1; i < batch->count; i++) {
+        k = order[i];
+        for (j = i; j > 0 && rssi[order[j - 1]] < rssi[k]; j--)
+            order[j] = order[j - 1];
+        order[j] = k;
+    }
+}
+
+/*
+ * Keep the candidates not used as lower-priority profiles, in the order
+ * they were listed, so NetworkManager can fall back to them.  Credentials
+ * the access point rejected are not kept.
+ */
+static void wifi_store_fallbacks(struct wifi_backend *backend,
+                const struct wifi_batch *batch, int used,
+                const enum wifi_result *res)
+{
+    int i, priority = 0;
+
+    for (i = 0; i < batch->count; i++) {
+        if (i == used || !strcmp(batch->nets[i].ssid, batch->nets[used].ssid))
+            continue;
+        if (res[i] == WIFI_RESULT_AUTH_FAILED) {
+            printf("[WIFI] Not keeping '%s': credentials rejected\n",
+                   batch->nets[i].ssid);
+            continue;
+        }
+        wifi_backend_add_profile(backend, &batch->nets[i], --priority);
+    }
+}
+
+/*
+ * Run one provisioning request.  On WIFI_STATUS_OK, @ip holds the address
+ * wlan0 ended up with.
+ */
+static enum wifi_status process_wifi_config(struct wifi_job *job,
+                const struct wifi_batch *batch, char *ip, size_t ip_len)
+{
+    enum wifi_result res[WIFI_BATCH_MAX];
+    struct wifi_backend backend;
+    char current_ssid[WIFI_SSID_MAX_LEN + 1];
+    enum wifi_status status = WIFI_STATUS_CONN_FAIL;
+    int order[WIFI_BATCH_MAX];
+    int i, k;
+    // Keyfiles written from here on belong to this job; allow for coarse mtimes
+    time_t started = time(NULL) - 2;
+
+    for (i = 0; i < batch->count; i++) {
+        TRACE(TRACE_WIFI, TRACE_INFO, "Target SSID %d/%u: %s, Password: %s",
+              i + 1, batch->count, batch->nets[i].ssid,
+              batch->nets[i].psk[0] ? "***" : "none");
+        res[i] = WIFI_RESULT_NOT_FOUND;
+    }
+    
+    // 发送WiFi配置中LED指令
+    send_socket_command(LED_SYS_WIFI_CONFIGURING);
+    wifi_job_progress(job, WIFI_PROGRESS_CONFIGURING, -1);
+
+    if (wifi_backend_open(&backend) < 0) {
+        send_socket_command(LED_SYS_WIFI_CONFIG_PENDING);
+        return WIFI_STATUS_CMD_FAIL;
+    }
+
+    // 1. 检查当前连接的SSID是否与某个目标SSID一致
+    if (wifi_backend_get_active_ssid(&backend, current_ssid, sizeof(current_ssid)) == 0) {
+        for (i = 0; i < batch->count; i++) {
+            if (!strcmp(current_ssid, batch->nets[i].ssid))
+                break;
+        }
+    } else {
+        i = batch->count;
+    }
+    if (i < batch->count) {
+        printf("[WIFI] Already connected to target SSID: %s\n", current_ssid);
+        
+        // 获取当前IP地址
+        char *current_ip = get_wlan_ip_address();
+        if (current_ip && is_valid_ip(current_ip)) {
+            printf("[WIFI] Current connection is valid with IP: %s\n", current_ip);
+            wifi_job_mark(job, SESSION_IP_ACQUIRED);
+            snprintf(ip, ip_len, "%s", current_ip);
+            free(current_ip);
+
+            // The client gets its answer first, then the deferred work runs
+            wifi_job_post_result(job, WIFI_STATUS_OK, ip, i);
+
+            // 发送成功LED指令
+            send_socket_command(LED_SYS_WIFI_SUCCESS);
+
+            // A batch replaces the stored profiles with its own candidates
+            if (batch->count > 1) {
+                wifi_backend_cleanup(&backend, current_ssid);
+                wifi_store_fallbacks(&backend, batch, i, res);
+            }
+
+            // 确保网络配置被及时保护
+            wifi_persist_profiles(job, started);
+            
+            status = WIFI_STATUS_OK;
+            goto done;
+        }
+        
+        if (current_ip) free(current_ip);
+    }
+
+    // The retry loop runs here rather than over the BLE link
+    wifi_batch_order(batch, order);
+    for (k = 0; k < batch->count; k++) {
+        i = order[k];
+        if (batch->count > 1)
+            printf("[WIFI] Trying candidate %d/%u: '%s'\n", k + 1,
+                   batch->count, batch->nets[i].ssid);
+
+        status = wifi_try_network(job, &backend, &batch->nets[i], i, ip,
+                                  ip_len, &res[i]);
+        if (status == WIFI_STATUS_OK || status == WIFI_STATUS_BLE_LOST ||
+                status == WIFI_STATUS_CMD_FAIL)
+            break;
+    }
+
+    if (status == WIFI_STATUS_OK) {
+        // The client gets its answer first, then the deferred work runs
+        wifi_job_post_result(job, WIFI_STATUS_OK, ip, i);
+        
+        // 发送成功LED指令
+        send_socket_command(LED_SYS_WIFI_SUCCESS);
+        
+        // 4. 清理旧的连接
+        wifi_backend_cleanup(&backend, batch->nets[i].ssid);
+        wifi_job_mark(job, SESSION_CLEANUP_DONE);
+        if (batch->count > 1)
+            wifi_store_fallbacks(&backend, batch, i, res);
+
+        // 5. 确保网络配置被及时保护
+        wifi_persist_profiles(job, started);
+        goto done;
+    }
+
+    // 发送配置中LED指令（表示等待重试）
+    send_socket_command(LED_SYS_WIFI_CONFIG_PENDING);
+
+done:
+    wifi_backend_close(&backend);
+    return status;
+}
+
+/*
+ * The last success, keyed by a hash of the request's candidates.  A client
+ * that lost the link and resends the same credentials gets the address
+ * right away instead of NetworkManager activating the profile again.  Only
+ * the latest success can describe what wlan0 is on, so there is a single
+ * entry: a new job drops it, and it only answers while wlan0 is still on
+ * that network with that address.  Failures are not kept: a failed request
+ * is resent to be retried.  Mainloop side only.
+ */
+#define WIFI_RESULT_CACHE_TTL_MS 60000
+
+struct wifi_result_entry {
+    uint64_t key;
+    uint64_t stored_ms;
+    char ssid[WIFI_SSID_MAX_LEN + 1];
+    char ip[INET_ADDRSTRLEN];   // empty while there is no entry
+    int net;
+};
+
+static struct wifi_result_entry wifi_result_cache;
+
+static uint64_t fnv1a_64(uint64_t hash, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+
+    while (len--) {
+        hash ^= *p++;
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+// Everything that decides where a request connects, in the order listed
+static uint64_t wifi_batch_key(const struct wifi_batch *batch)
+{
+    uint64_t key = 0xcbf29ce484222325ULL;
+    const struct wifi_request *req;
+    int i;
+
+    for (i = 0; i < batch->count; i++) {
+        req = &batch->nets[i];
+        key = fnv1a_64(key, req->ssid, strlen(req->ssid) + 1);
+        key = fnv1a_64(key, req->psk, strlen(req->psk) + 1);
+        key = fnv1a_64(key, &req->security, sizeof(req->security));
+        if (req->has_bssid)
+            key = fnv1a_64(key, req->bssid, sizeof(req->bssid));
+    }
+
+    return key;
+}
+
+static void wifi_result_cache_clear(void)
+{
+    memset(&wifi_result_cache, 0, sizeof(wifi_result_cache));
+}
+
+/*
+ * The entry for @key, if it is recent and wlan0 is still associated with
+ * its network and holds its address; a stale entry is dropped.
+ */
+static const struct wifi_result_entry *wifi_result_cache_lookup(uint64_t key)
+{
+    struct wifi_result_entry *entry = &wifi_result_cache;
+    struct wifi_backend backend;
+    char ssid[WIFI_SSID_MAX_LEN + 1];
+    char *ip;
+    bool valid;
+
+    if (!entry->ip[0] || entry->key != key)
+        return NULL;
+
+    if (now_ms() - entry->stored_ms >= WIFI_RESULT_CACHE_TTL_MS) {
+        wifi_result_cache_clear();
+        return NULL;
+    }
+
+    ip = get_wlan_ip_address();
+    valid = ip && !strcmp(ip, entry->ip);
+    free(ip);
+
+    if (valid && wifi_backend_open(&backend) == 0) {
+        valid = wifi_backend_get_active_ssid(&backend, ssid, sizeof(ssid)) == 0 &&
+                !strcmp(ssid, entry->ssid);
+        wifi_backend_close(&backend);
+    } else {
+        valid = false;
+    }
+
+    if (!valid) {
+        printf("[JOB] Cached result no longer matches %s, dropping it\n",
+               WIFI_IFNAME);
+        wifi_result_cache_clear();
+        return NULL;
+    }
+
+    return entry;
+}
+
+static void wifi_result_cache_put(uint64_t key, const char *ssid,
+                const char *ip, int net)
+{
+    struct wifi_result_entry *entry = &wifi_result_cache;
+
+    entry->key = key;
+    entry->stored_ms = now_ms();
+    entry->net = net;
+    snprintf(entry->ssid, sizeof(entry->ssid), "%s", ssid);
+    snprintf(entry->ip, sizeof(entry->ip), "%s", ip);
+}
+
+/*
+ * Provisioning job engine.
+ *
+ * process_wifi_config() blocks for seconds (nmcli, scan retry, sync), so it
+ * runs on a worker thread while the mainloop keeps serving ATT.  The worker
+ * never touches bt_att/bt_gatt_server: it stores the result in the job and
+ * signals the job eventfd, and wifi_job_event_cb() delivers it from the
+ * mainloop.  Only one job may exist at a time.
+ *
+ * Work that the client does not need to wait for (success LED, deleting old
+ * profiles, sync) is deferred: once the IP is known the worker posts the
+ * result with wifi_job_post_result(), the mainloop notifies it right away,
+ * and the job only completes after the deferred steps.  A new request is
+ * answered BUSY meanwhile, and main() drains a running job before exiting.
+ *
+ * Reconnects: att_disconnect_cb() calls wifi_job_detach(), and the job keeps
+ * running without a server for up to WIFI_JOB_ORPHAN_MS.  If the client
+ * comes back and resends the same request meanwhile, wifi_job_attach() hands
+ * the job to the new connection; a success reached while detached goes to
+ * the result cache.
+ *
+ * Cancellation: a job nobody came back for is cancelled by
+ * wifi_job_cancel(), which drops the mainloop reference.  The worker checks
+ * wifi_job_cancelled() between steps, aborts, and frees the job when it
+ * drops the last reference.
+ */
+enum wifi_job_phase {
+    WIFI_JOB_RUNNING,
+    WIFI_JOB_WAIT_IP,       // worker blocked until the mainloop sees an address
+    WIFI_JOB_RESULT,        // result posted, deferred work still running
+    WIFI_JOB_DONE,
+};
+
+/*
+ * Progress frames queued by the worker for the mainloop to notify.  A full
+ * queue drops the oldest frame: the client only needs the latest phase.
+ */
+#define WIFI_PROGRESS_QUEUE 8
+
+struct wifi_progress {
+    enum wifi_progress_phase phase;
+    int net;
+    uint32_t elapsed_ms;
+};
+
+struct wifi_job {
+    int ref_count;
+    int event_fd;
+    pthread_t thread;
+    struct server *server;      // mainloop side only, NULL while detached
+    struct wifi_batch batch;
+    uint64_t key;               // wifi_batch_key(), to recognize a resend
+    enum wifi_proto proto;      // answer in the format the client used
+    uint8_t seq;
+    enum wifi_status status;
+    char result_ip[INET_ADDRSTRLEN];
+    int result_net;             // candidate that connected, -1 for no batch
+    bool result_posted;         // worker side
+    bool result_sent;           // mainloop side
+    struct session_trace trace; // worker phases, merged on completion
+    uint64_t started_ms;        // time base of the progress frames
+    int cancelled;
+
+    // Worker <-> mainloop handshake, protected by lock
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    enum wifi_job_phase phase;
+    bool ip_wait_done;
+    char ip[INET_ADDRSTRLEN];
+    struct wifi_progress progress[WIFI_PROGRESS_QUEUE];
+    unsigned int progress_head;
+    unsigned int progress_count;
+};
+
+static struct wifi_job *wifi_job;
+static int wifi_job_workers;    // workers still running, including cancelled ones
+
+// How long a job outlives its client, waiting for the request to be resent
+#define WIFI_JOB_ORPHAN_MS 30000
+
+static int wifi_job_orphan_id;
+
+static void wifi_job_orphan_stop(void)
+{
+    if (wifi_job_orphan_id > 0) {
+        mainloop_remove_timeout(wifi_job_orphan_id);
+        wifi_job_orphan_id = 0;
+    }
+}
+
+static void wifi_send_result(struct server *server, enum wifi_proto proto,
+                uint8_t seq, enum wifi_status status, const char *ip, int net);
+static void wifi_send_progress(struct server *server, enum wifi_proto proto,
+                uint8_t seq, const struct wifi_progress *progress);
+static void notify_queue_reset(struct server *server);
+
+static void wifi_job_unref(struct wifi_job *job)
+{
+    if (__sync_sub_and_fetch(&job->ref_count, 1))
+        return;
+
+    close(job->event_fd);
+    pthread_cond_destroy(&job->cond);
+    pthread_mutex_destroy(&job->lock);
+    memset(&job->batch, 0, sizeof(job->batch));         // drop the PSKs
+    free(job);
+}
+
+static bool wifi_job_cancelled(struct wifi_job *job)
+{
+    if (!job)
+        return false;
+
+    return __sync_fetch_and_add(&job->cancelled, 0) != 0;
+}
+
+// Worker side; the mainloop only reads the trace once the job is done
+static void wifi_job_mark(struct wifi_job *job, enum session_phase phase)
+{
+    if (job)
+        session_mark(&job->trace, phase);
+}
+
+/*
+ * Hand the result to the mainloop before the job is over; the worker then
+ * carries on with the deferred steps.
+ */
+static void wifi_job_post_result(struct wifi_job *job,
+                enum wifi_status status, const char *ip, int net)
+{
+    uint64_t val = 1;
+
+    pthread_mutex_lock(&job->lock);
+    job->status = status;
+    snprintf(job->result_ip, sizeof(job->result_ip), "%s", ip ? ip : "");
+    job->result_net = job->batch.count > 1 ? net : -1;
+    job->result_posted = true;
+    job->phase = WIFI_JOB_RESULT;
+    pthread_mutex_unlock(&job->lock);
+
+    if (write(job->event_fd, &val, sizeof(val)) < 0)
+        printf("[JOB] Failed to signal mainloop: %s\n", strerror(errno));
+}
+
+/*
+ * Queue a progress frame as @phase starts, if the client asked for them;
+ * @net is the candidate involved, or -1.  Worker side, until the result is
+ * posted.
+ */
+static void wifi_job_progress(struct wifi_job *job,
+                enum wifi_progress_phase phase, int net)
+{
+    struct wifi_progress *progress;
+    uint64_t val = 1;
+
+    if (!job || !job->batch.progress || job->result_posted)
+        return;
+
+    pthread_mutex_lock(&job->lock);
+    if (job->progress_count == WIFI_PROGRESS_QUEUE) {
+        job->progress_head = (job->progress_head + 1) % WIFI_PROGRESS_QUEUE;
+        job->progress_count--;
+    }
+    progress = &job->progress[(job->progress_head + job->progress_count++) %
+                              WIFI_PROGRESS_QUEUE];
+    progress->phase = phase;
+    progress->net = job->batch.count > 1 ? net : -1;
+    progress->elapsed_ms = now_ms() - job->started_ms;
+    pthread_mutex_unlock(&job->lock);
+
+    if (write(job->event_fd, &val, sizeof(val)) < 0)
+        printf("[JOB] Failed to signal mainloop: %s\n", strerror(errno));
+}
+
+static void *wifi_job_thread(void *arg)
+{
+    struct wifi_job *job = arg;
+    char ip[INET_ADDRSTRLEN] = "";
+    enum wifi_status status;
+    uint64_t val = 1;
+
+    printf("[JOB] Worker started\n");
+    status = process_wifi_config(job, &job->batch, ip, sizeof(ip));
+
+    pthread_mutex_lock(&job->lock);
+    if (!job->result_posted) {
+        job->status = status;
+        snprintf(job->result_ip, sizeof(job->result_ip), "%s", ip);
+    }
+    pthread_mutex_unlock(&job->lock);
+
+    printf("[JOB] Worker finished: status=%d, ip=%s%s\n", job->status,
+           job->status == WIFI_STATUS_OK ? job->result_ip : "-",
+           wifi_job_cancelled(job) ? " (cancelled)" : "");
+
+    pthread_mutex_lock(&job->lock);
+    job->phase = WIFI_JOB_DONE;
+    pthread_mutex_unlock(&job->lock);
+
+    if (write(job->event_fd, &val, sizeof(val)) < 0)
+        printf("[JOB] Failed to signal mainloop: %s\n", strerror(errno));
+
+    __sync_sub_and_fetch(&wifi_job_workers, 1);
+    wifi_job_unref(job);
+    return NULL;
+}
+
+/*
+ * Block the worker until the mainloop reports an IPv4 address on wlan0, the
+ * ip_wait_seconds deadline passes or the job is cancelled.  Returns true and
+ * fills @ip when an address was acquired.
+ */
+static bool wifi_job_wait_ip(struct wifi_job *job, char *ip, size_t len)
+{
+    uint64_t val = 1;
+    bool found;
+
+#if WIFI_BACKEND_MOCK
+    if (!wifi_mock_sleep(job, wifi_mock_delay_ms("BTGATT_MOCK_DHCP_MS", 2000)))
+        return false;
+    snprintf(ip, len, "%s", WIFI_MOCK_IP);
+    return true;
+#endif
+
+    pthread_mutex_lock(&job->lock);
+    job->phase = WIFI_JOB_WAIT_IP;
+    job->ip_wait_done = false;
+    job->ip[0] = '\0';
+    pthread_mutex_unlock(&job->lock);
+
+    if (write(job->event_fd, &val, sizeof(val)) < 0)
+        return false;
+
+    pthread_mutex_lock(&job->lock);
+    while (!job->ip_wait_done && !wifi_job_cancelled(job))
+        pthread_cond_wait(&job->cond, &job->lock);
+
+    found = job->ip[0] != '\0';
+    if (found)
+        snprintf(ip, len, "%s", job->ip);
+    job->phase = WIFI_JOB_RUNNING;
+    pthread_mutex_unlock(&job->lock);
+
+    return found;
+}
+
+/*
+ * rtnetlink IPv4 address watch.  While a job waits for DHCP the mainloop
+ * listens for RTM_NEWADDR on wlan0 and completes the wait the moment an
+ * address appears, instead of polling "ip addr" after a fixed sleep.
+ */
+static int ip_watch_fd = -1;
+static int ip_watch_timeout_id;
+static unsigned int ip_watch_ifindex;
+static struct wifi_job *ip_watch_job;
+
+static void ip_watch_stop(void)
+{
+    if (ip_watch_timeout_id > 0) {
+        mainloop_remove_timeout(ip_watch_timeout_id);
+        ip_watch_timeout_id = 0;
+    }
+
+    if (ip_watch_fd >= 0) {
+        mainloop_remove_fd(ip_watch_fd);
+        close(ip_watch_fd);
+        ip_watch_fd = -1;
+    }
+
+    ip_watch_job = NULL;
+}
+
+// Hand the result (or NULL on timeout) to the waiting worker
+static void ip_watch_finish(const char *ip)
+{
+    struct wifi_job *job = ip_watch_job;
+
+    ip_watch_stop();
+    if (!job)
+        return;
+
+    pthread_mutex_lock(&job->lock);
+    if (ip)
+        snprintf(job->ip, sizeof(job->ip), "%s", ip);
+    job->ip_wait_done = true;
+    pthread_cond_broadcast(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+}
+
+static void ip_watch_read_cb(int fd, uint32_t events, void *user_data)
+{
+    char buf[8192];
+    struct nlmsghdr *nlh;
+    ssize_t len;
+
+    len = recv(fd, buf, sizeof(buf), 0);
+    if (len < 0) {
+        if (errno == EAGAIN || errno == EINTR)
+            return;
+        printf("[NETLINK] recv failed: %s\n", strerror(errno));
+        return;
+    }
+
+    for (nlh = (struct nlmsghdr *) buf; NLMSG_OK(nlh, len);
+            nlh = NLMSG_NEXT(nlh, len)) {
+        struct ifaddrmsg *ifa = NLMSG_DATA(nlh);
+        struct rtattr *rta;
+        const void *addr = NULL;
+        char ip[INET_ADDRSTRLEN];
+        int rta_len;
+
+        if (nlh->nlmsg_type != RTM_NEWADDR || ifa->ifa_family != AF_INET ||
+                ifa->ifa_index != ip_watch_ifindex)
+            continue;
+
+        rta_len = IFA_PAYLOAD(nlh);
+        for (rta = IFA_RTA(ifa); RTA_OK(rta, rta_len);
+                rta = RTA_NEXT(rta, rta_len)) {
+            if (rta->rta_type == IFA_LOCAL)
+                addr = RTA_DATA(rta);
+            else if (rta->rta_type == IFA_ADDRESS && !addr)
+                addr = RTA_DATA(rta);
+        }
+
+        if (addr && inet_ntop(AF_INET, addr, ip, sizeof(ip)) && is_valid_ip(ip)) {
+            printf("[NETLINK] %s acquired IPv4 address %s\n", WIFI_IFNAME, ip);
+            ip_watch_finish(ip);
+            return;
+        }
+    }
+}
+
+static void ip_watch_timeout_cb(int timeout_id, void *user_data)
+{
+    printf("[NETLINK] No IPv4 address on %s within %d seconds\n",
+           WIFI_IFNAME, ip_wait_seconds);
+    ip_watch_finish(NULL);
+}
+
+static void ip_watch_start(struct wifi_job *job)
+{
+    struct sockaddr_nl addr;
+    struct {
+        struct nlmsghdr nlh;
+        struct ifaddrmsg ifa;
+    } req;
+    char *ip;
+
+    ip_watch_stop();
+    ip_watch_job = job;
+
+    ip_watch_ifindex = if_nametoindex(WIFI_IFNAME);
+    ip_watch_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK,
+                         NETLINK_ROUTE);
+    if (ip_watch_fd < 0) {
+        printf("[NETLINK] Failed to open rtnetlink socket: %s\n", strerror(errno));
+        goto fallback;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = RTMGRP_IPV4_IFADDR;
+    if (bind(ip_watch_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        printf("[NETLINK] Failed to bind rtnetlink socket: %s\n", strerror(errno));
+        goto fallback;
+    }
+
+    if (mainloop_add_fd(ip_watch_fd, EPOLLIN, ip_watch_read_cb, NULL, NULL) < 0)
+        goto fallback;
+
+    ip_watch_timeout_id = mainloop_add_timeout(ip_wait_seconds * 1000,
+                                               ip_watch_timeout_cb, NULL, NULL);
+
+    // Subscribed; now dump current addresses in case DHCP already finished
+    memset(&req, 0, sizeof(req));
+    req.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(req.ifa));
+    req.nlh.nlmsg_type = RTM_GETADDR;
+    req.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    req.ifa.ifa_family = AF_INET;
+    if (send(ip_watch_fd, &req, req.nlh.nlmsg_len, 0) < 0)
+        printf("[NETLINK] Address dump request failed: %s\n", strerror(errno));
+
+    printf("[NETLINK] Watching %s for an IPv4 address (deadline %d s)\n",
+           WIFI_IFNAME, ip_wait_seconds);
+    return;
+
+fallback:
+    if (ip_watch_fd >= 0) {
+        close(ip_watch_fd);
+        ip_watch_fd = -1;
+    }
+    ip = get_wlan_ip_address();
+    ip_watch_finish(ip && is_valid_ip(ip) ? ip : NULL);
+    free(ip);
+}
+
+static void wifi_job_event_cb(int fd, uint32_t events, void *user_data)
+{
+    struct wifi_job *job = user_data;
+    struct server *server = job->server;
+    struct wifi_progress progress[WIFI_PROGRESS_QUEUE];
+    unsigned int i, count;
+    uint64_t val;
+    enum wifi_job_phase phase;
+    bool wait_ip;
+
+    if (read(fd, &val, sizeof(val)) < 0 && errno == EAGAIN)
+        return;
+
+    pthread_mutex_lock(&job->lock);
+    phase = job->phase;
+    wait_ip = !job->ip_wait_done;
+    count = job->progress_count;
+    for (i = 0; i < count; i++)
+        progress[i] = job->progress[(job->progress_head + i) %
+                                    WIFI_PROGRESS_QUEUE];
+    job->progress_head = 0;
+    job->progress_count = 0;
+    pthread_mutex_unlock(&job->lock);
+
+    // Progress queued before the result goes out first
+    for (i = 0; server && i < count && !job->result_sent; i++)
+        wifi_send_progress(server, job->proto, job->seq, &progress[i]);
+
+    // Progress wakeups may arrive while the worker waits: start the watch
+    // once, and not again after it has answered
+    if (phase == WIFI_JOB_WAIT_IP) {
+        if (wait_ip && ip_watch_job != job)
+            ip_watch_start(job);
+        return;
+    }
+
+    if (phase != WIFI_JOB_RESULT && phase != WIFI_JOB_DONE)
+        return;
+
+    // A posted result may only be seen together with DONE
+    if (!job->result_sent) {
+        job->result_sent = true;
+        if (job->status == WIFI_STATUS_OK) {
+            wifi_success_count++;
+            wifi_result_cache_put(job->key,
+                    job->batch.nets[job->result_net < 0 ? 0 : job->result_net].ssid,
+                    job->result_ip, job->result_net);
+        }
+
+        if (server) {
+            // Only job results: rejects and cache answers would skew it
+            if (server->connected)
+                metrics_observe(METRICS_RESULT_MS, now_ms() -
+                                server->session.phase_ms[SESSION_ACCEPT]);
+            wifi_send_result(server, job->proto, job->seq, job->status,
+                             job->result_ip, job->result_net);
+        } else {
+            printf("[JOB] Client gone, result kept for a resend\n");
+        }
+        if (phase == WIFI_JOB_RESULT)
+            printf("[JOB] Result delivered, deferred work still running\n");
+    }
+
+    if (phase != WIFI_JOB_DONE)
+        return;
+
+    mainloop_remove_fd(fd);
+    wifi_job = NULL;
+    wifi_job_orphan_stop();
+
+    if (server)
+        session_merge(&server->session, &job->trace);
+    printf("[DEBUG] ================== WIFI CONFIG COMPLETE ==================\n");
+
+    wifi_job_unref(job);
+}
+
+/*
+ * Start a provisioning job for @batch on behalf of @server; the result is
+ * sent back framed as @proto with sequence number @seq.  Returns 0 on
+ * success or a negative errno; -EBUSY means a previous job (possibly one
+ * already cancelled) is still running.
+ */
+static int wifi_job_start(struct server *server,
+                const struct wifi_batch *batch, enum wifi_proto proto,
+                uint8_t seq)
+{
+    struct wifi_job *job;
+    pthread_attr_t attr;
+    int err;
+
+    if (wifi_job || __sync_fetch_and_add(&wifi_job_workers, 0) > 0) {
+        printf("[JOB] Provisioning job already running, rejecting request\n");
+        return -EBUSY;
+    }
+
+    job = calloc(1, sizeof(*job));
+    if (!job)
+        return -ENOMEM;
+
+    job->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (job->event_fd < 0) {
+        err = -errno;
+        free(job);
+        return err;
+    }
+
+    // Whatever wlan0 was on, this job may move it elsewhere
+    wifi_result_cache_clear();
+
+    job->batch = *batch;
+    job->key = wifi_batch_key(batch);
+    job->result_net = -1;
+    job->started_ms = now_ms();
+    job->proto = proto;
+    job->seq = seq;
+
+    job->server = server;
+    job->ref_count = 2;     // mainloop + worker
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->cond, NULL);
+
+    if (mainloop_add_fd(job->event_fd, EPOLLIN, wifi_job_event_cb,
+                        job, NULL) < 0) {
+        close(job->event_fd);
+        free(job);
+        return -EIO;
+    }
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    __sync_add_and_fetch(&wifi_job_workers, 1);
+    err = pthread_create(&job->thread, &attr, wifi_job_thread, job);
+    pthread_attr_destroy(&attr);
+    if (err) {
+        __sync_sub_and_fetch(&wifi_job_workers, 1);
+        mainloop_remove_fd(job->event_fd);
+        close(job->event_fd);
+        free(job);
+        return -err;
+    }
+
+    wifi_job = job;
+    printf("[JOB] Provisioning job started\n");
+    return 0;
+}
+
+// Abort the job of @server (NULL: the detached one); the worker finishes on its own.
+static void wifi_job_cancel(struct server *server)
+{
+    struct wifi_job *job = wifi_job;
+
+    if (!job || job->server != server)
+        return;
+
+    printf("[JOB] Cancelling provisioning job (client gone)\n");
+    __sync_fetch_and_add(&job->cancelled, 1);
+    ip_watch_stop();
+    wifi_job_orphan_stop();
+
+    // Wake the worker if it is blocked in wifi_job_wait_ip()
+    pthread_mutex_lock(&job->lock);
+    pthread_cond_broadcast(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+
+    mainloop_remove_fd(job->event_fd);
+    job->server = NULL;
+    wifi_job = NULL;
+    wifi_job_unref(job);
+}
+
+static void wifi_job_orphan_cb(int timeout_id, void *user_data)
+{
+    printf("[JOB] Client did not come back within %d ms\n", WIFI_JOB_ORPHAN_MS);
+    wifi_job_cancel(NULL);
+}
+
+// The client of the running job went away: give it a while to reconnect
+static void wifi_job_detach(struct server *server)
+{
+    struct wifi_job *job = wifi_job;
+
+    if (!job || job->server != server)
+        return;
+
+    printf("[JOB] Client gone, keeping provisioning job for %d ms\n",
+           WIFI_JOB_ORPHAN_MS);
+    job->server = NULL;
+    wifi_job_orphan_id = mainloop_add_timeout(WIFI_JOB_ORPHAN_MS,
+                                              wifi_job_orphan_cb, NULL, NULL);
+    if (wifi_job_orphan_id <= 0)
+        wifi_job_cancel(NULL);
+}
+
+/*
+ * Let a resent request take over the running job with the same @key,
+ * detached or still owned by @server, instead of starting another.  The
+ * answer then goes to @server, framed as @proto with @seq.
+ */
+static bool wifi_job_attach(struct server *server, uint64_t key,
+                enum wifi_proto proto, uint8_t seq)
+{
+    struct wifi_job *job = wifi_job;
+
+    if (!job || job->key != key || job->result_sent ||
+            (job->server && job->server != server))
+        return false;
+
+    printf("[JOB] Resent request attached to the running job\n");
+    wifi_job_orphan_stop();
+    job->server = server;
+    job->proto = proto;
+    job->seq = seq;
+    return true;
+}
+
+// Shutdown: abort a pending job and let the worker finish its deferred work
+#define WIFI_JOB_DRAIN_TIMEOUT_MS 10000
+
+static MAIN_ONLY void wifi_job_drain(void)
+{
+    uint64_t deadline = now_ms() + WIFI_JOB_DRAIN_TIMEOUT_MS;
+
+    if (wifi_job)
+        wifi_job_cancel(wifi_job->server);
+
+    if (__sync_fetch_and_add(&wifi_job_workers, 0) == 0)
+        return;
+
+    printf("[JOB] Waiting for provisioning worker to finish deferred work...\n");
+    while (__sync_fetch_and_add(&wifi_job_workers, 0) > 0) {
+        if (now_ms() >= deadline) {
+            printf("[JOB] Worker still busy after %d ms, exiting anyway\n",
+                   WIFI_JOB_DRAIN_TIMEOUT_MS);
+            return;
+        }
+        usleep(50000);
+    }
+}
+
+static int wifi_scan_entry_cmp(const void *a, const void *b)
+{
+    const struct wifi_scan_entry *ea = a, *eb = b;
+
+    return eb->rssi - ea->rssi;
+}
+
+/*
+ * Background scanner.  Sleeps until the next periodic scan (only while a
+ * client is connected) or a client request, never scans while a
+ * provisioning job owns the radio, and signals the mainloop after each
+ * refresh so subscribed clients can re-read.
+ */
+static void *wifi_scan_thread(void *arg)
+{
+    struct wifi_scan_entry entries[WIFI_SCAN_MAX_ENTRIES];
+    struct wifi_backend backend;
+    uint64_t val = 1, last_scan = 0;
+    bool reuse, retry = false;
+    int n;
+
+    for (;;) {
+        struct timespec deadline;
+
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += retry ? WIFI_SCAN_RETRY_SECONDS :
+                                   WIFI_SCAN_INTERVAL_SECONDS;
+        retry = false;
+
+        pthread_mutex_lock(&scan_cache.lock);
+        while (!scan_cache.requested) {
+            if (!scan_cache.periodic)
+                pthread_cond_wait(&scan_cache.cond, &scan_cache.lock);
+            else if (pthread_cond_timedwait(&scan_cache.cond, &scan_cache.lock,
+                                            &deadline) == ETIMEDOUT)
+                break;
+        }
+        scan_cache.requested = false;
+        pthread_mutex_unlock(&scan_cache.lock);
+
+        if (__sync_fetch_and_add(&wifi_job_workers, 0) > 0) {
+            printf("[SCAN] Provisioning in progress, deferring scan\n");
+            retry = true;
+            continue;
+        }
+
+        reuse = last_scan && now_ms() - last_scan < WIFI_SCAN_MIN_INTERVAL_MS;
+        if (!reuse) {
+            n = wifi_backend_open(&backend);
+            if (n == 0) {
+                n = wifi_backend_scan(&backend, entries, WIFI_SCAN_MAX_ENTRIES);
+                wifi_backend_close(&backend);
+            }
+            if (n < 0) {
+                printf("[SCAN] Scan failed: %s\n", strerror(-n));
+                retry = true;
+                continue;
+            }
+
+            qsort(entries, n, sizeof(entries[0]), wifi_scan_entry_cmp);
+            last_scan = now_ms();
+
+            pthread_mutex_lock(&scan_cache.lock);
+            memcpy(scan_cache.entries, entries, n * sizeof(entries[0]));
+            scan_cache.count = n;
+            scan_cache.generation++;
+            scan_cache.updated_ms = last_scan;
+            pthread_mutex_unlock(&scan_cache.lock);
+
+            TRACE(TRACE_WIFI, TRACE_INFO, "Scan cache refreshed: %d networks", n);
+        }
+
+        if (write(scan_cache.event_fd, &val, sizeof(val)) < 0)
+            printf("[SCAN] Failed to signal mainloop: %s\n", strerror(errno));
+    }
+
+    return NULL;
+}
+
+// Ask the scanner for a refresh; called from the mainloop
+static void wifi_scan_request(void)
+{
+    pthread_mutex_lock(&scan_cache.lock);
+    scan_cache.requested = true;
+    pthread_cond_signal(&scan_cache.cond);
+    pthread_mutex_unlock(&scan_cache.lock);
+}
+
+/*
+ * Periodic refreshes only run while someone is connected; a client arriving
+ * to a stale table gets a scan right away.  Called from the mainloop.
+ */
+static void wifi_scan_set_active(bool active)
+{
+    pthread_mutex_lock(&scan_cache.lock);
+    if (active && !scan_cache.periodic &&
+            (!scan_cache.updated_ms ||
+             now_ms() - scan_cache.updated_ms >= WIFI_SCAN_FRESH_MS))
+        scan_cache.requested = true;
+    scan_cache.periodic = active;
+    pthread_cond_signal(&scan_cache.cond);
+    pthread_mutex_unlock(&scan_cache.lock);
+}
+
+static void wifi_scan_notify_server(void *data, void *user_data);
+
+static void wifi_scan_event_cb(int fd, uint32_t events, void *user_data)
+{
+    uint64_t val;
+
+    if (read(fd, &val, sizeof(val)) < 0)
+        return;
+
+    queue_foreach(servers, wifi_scan_notify_server, NULL);
+}
+
+static MAIN_ONLY int wifi_scan_init(void)
+{
+    pthread_condattr_t cattr;
+    pthread_attr_t attr;
+    pthread_t tid;
+    int err;
+
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&scan_cache.cond, &cattr);
+    pthread_condattr_destroy(&cattr);
+
+    scan_cache.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (scan_cache.event_fd < 0)
+        return -errno;
+
+    if (mainloop_add_fd(scan_cache.event_fd, EPOLLIN, wifi_scan_event_cb,
+                        NULL, NULL) < 0) {
+        close(scan_cache.event_fd);
+        scan_cache.event_fd = -1;
+        return -EIO;
+    }
+
+    // Warm the table once so the first client doesn't wait for it
+    scan_cache.requested = true;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    err = pthread_create(&tid, &attr, wifi_scan_thread, NULL);
+    pthread_attr_destroy(&attr);
+    if (err) {
+        mainloop_remove_fd(scan_cache.event_fd);
+        close(scan_cache.event_fd);
+        scan_cache.event_fd = -1;
+        return -err;
+    }
+
+    return 0;
+}
+
+/*******************config wifi zone end*********************************************/
+static struct bt_hci *hci_dev;
+
+static bool server_match_att(const void *data, const void *match_data)
+{
+    const struct server *server = data;
+
+    return server->att == match_data;
+}
+
+/*
+ * The attribute callbacks are registered once on the shared gatt_db, so the
+ * connection a request belongs to is found from the bt_att it arrived on.
+ */
+static struct server *server_lookup(struct bt_att *att)
+{
+    return queue_find(servers, server_match_att, att);
+}
+
+static bool server_match_handle(const void *data, const void *match_data)
+{
+    const struct server *server = data;
+
+    return server->conn_handle == PTR_TO_UINT(match_data);
+}
+
+
+
+static void att_connect_cb(bool success, uint8_t att_ecode, void *user_data)
+{
+    struct server *server = user_data;
     printf("ATT Connect callback: success=%d, att_ecode=%d\n", success, att_ecode);
     
     if (success) {
         printf("[CONNECT] Client connected successfully\n");
         
         // Update connection status
-        client_connected = true;
+        server->connected = true;
         
         // Stop advertising
         stop_advertising();
@@ -573,6 +4184,160 @@ static void att_connect_cb(bool success, uint8_t att_ecode, void *user_data)
     }
 }
 
+/*
+ * Ask the controller for LE PDUs large enough to carry a whole ATT PDU at
+ * the negotiated MTU, so single-PDU transfers also fit in one radio packet.
+ */
+static void request_data_length(struct server *server)
+{
+    struct bt_hci_cmd_le_set_data_length cmd;
+    uint16_t octets = server->mtu + L2CAP_HDR_SIZE;
+
+    if (octets > LE_MAX_TX_OCTETS)
+        octets = LE_MAX_TX_OCTETS;
+
+    cmd.handle = cpu_to_le16(server->conn_handle);
+    cmd.tx_len = cpu_to_le16(octets);
+    cmd.tx_time = cpu_to_le16(LE_MAX_TX_TIME);
+
+    printf("[MTU] Requesting data length %u octets on handle 0x%04x\n",
+           octets, server->conn_handle);
+    send_cmd(BT_HCI_CMD_LE_SET_DATA_LENGTH, &cmd, sizeof(cmd));
+}
+
+/*
+ * Move a new link to the LE 2M PHY, which halves the airtime of each
+ * fragment and leaves more of the 2.4 GHz band to the WiFi being set up.
+ * A central without 2M keeps 1M; the outcome arrives as an LE PHY Update
+ * Complete event, see hci_le_meta_cb().  With -p 1m the link is pinned to
+ * 1M instead, in case the central switched on its own.
+ */
+static void request_phy(struct server *server)
+{
+    struct bt_hci_cmd_le_set_phy cmd;
+    uint8_t phys = le_2m_phy ? LE_PHYS_2M : LE_PHYS_1M;
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.handle = cpu_to_le16(server->conn_handle);
+    cmd.tx_phys = phys;
+    cmd.rx_phys = phys;
+
+    printf("[PHY] Requesting LE %s PHY on handle 0x%04x\n",
+           le_2m_phy ? "2M" : "1M", server->conn_handle);
+    send_cmd(BT_HCI_CMD_LE_SET_PHY, &cmd, sizeof(cmd));
+}
+
+/*
+ * Ask the central for a short connection interval while provisioning traffic
+ * flows (fragmented writes, result notifications) and for a relaxed one
+ * once the connection has been idle for CONN_FAST_IDLE_MS with no job in
+ * flight.  The peripheral's LE Connection Update runs the LL Connection
+ * Parameters Request procedure; a central may answer with other values or,
+ * lacking the feature, reject it, and the link simply keeps its parameters.
+ */
+static void conn_params_update(struct server *server, bool fast)
+{
+    struct bt_hci_cmd_le_conn_update cmd;
+
+    if (server->conn_fast == fast)
+        return;
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.handle = cpu_to_le16(server->conn_handle);
+    cmd.min_interval = cpu_to_le16(fast ? CONN_FAST_MIN_INTERVAL :
+                                          CONN_RELAXED_MIN_INTERVAL);
+    cmd.max_interval = cpu_to_le16(fast ? CONN_FAST_MAX_INTERVAL :
+                                          CONN_RELAXED_MAX_INTERVAL);
+    cmd.latency = cpu_to_le16(fast ? CONN_FAST_LATENCY : CONN_RELAXED_LATENCY);
+    cmd.supv_timeout = cpu_to_le16(CONN_SUPERVISION_TIMEOUT);
+
+    TRACE(TRACE_HCI, TRACE_INFO, "Requesting %s connection interval on handle 0x%04x",
+          fast ? "fast" : "relaxed", server->conn_handle);
+    if (send_cmd(BT_HCI_CMD_LE_CONN_UPDATE, &cmd, sizeof(cmd)))
+        server->conn_fast = fast;
+}
+
+static void conn_params_arm(struct server *server, unsigned int ms)
+{
+    if (server->conn_timer_armed)
+        return;
+
+    if (mainloop_modify_timeout(server->conn_timer_id, ms) == 0)
+        server->conn_timer_armed = true;
+}
+
+// Provisioning traffic: switch to the fast interval and restart the idle clock
+static void conn_params_touch(struct server *server)
+{
+    server->conn_activity_ms = now_ms();
+    conn_params_update(server, true);
+    conn_params_arm(server, CONN_FAST_IDLE_MS);
+}
+
+static void conn_timer_cb(int timeout_id, void *user_data)
+{
+    struct server *server = user_data;
+    uint64_t idle = now_ms() - server->conn_activity_ms;
+
+    server->conn_timer_armed = false;
+
+    if (!server->connected || !server->conn_fast)
+        return;
+
+    // A job in flight is a transaction even when the link is quiet
+    if (wifi_job && wifi_job->server == server) {
+        conn_params_arm(server, CONN_FAST_IDLE_MS);
+        return;
+    }
+
+    if (idle < CONN_FAST_IDLE_MS) {
+        conn_params_arm(server, CONN_FAST_IDLE_MS - idle);
+        return;
+    }
+
+    conn_params_update(server, false);
+}
+
+static void att_first_pdu_cb(struct bt_att_chan *chan, uint8_t opcode,
+                const void *pdu, uint16_t length, void *user_data)
+{
+    struct server *server = user_data;
+
+    session_mark(&server->session, SESSION_FIRST_PDU);
+}
+
+static void att_write_pdu_cb(struct bt_att_chan *chan, uint8_t opcode,
+                const void *pdu, uint16_t length, void *user_data)
+{
+    switch (opcode) {
+    case BT_ATT_OP_PREP_WRITE_REQ:
+        metrics_count(METRICS_ATT_PREP_WRITE, 1);
+        break;
+    case BT_ATT_OP_EXEC_WRITE_REQ:
+        metrics_count(METRICS_ATT_EXEC_WRITE, 1);
+        break;
+    case BT_ATT_OP_WRITE_REQ:
+        metrics_count(METRICS_ATT_WRITE_REQ, 1);
+        break;
+    case BT_ATT_OP_WRITE_CMD:
+        metrics_count(METRICS_ATT_WRITE_CMD, 1);
+        break;
+    }
+}
+
+static void att_exchange_cb(uint16_t mtu, void *user_data)
+{
+    struct server *server = user_data;
+
+    printf("[MTU] Client negotiated ATT MTU %u (was %u)\n", mtu, server->mtu);
+    server->mtu = mtu;
+    session_mark(&server->session, SESSION_FIRST_PDU);
+    session_mark(&server->session, SESSION_MTU_EXCHANGE);
+
+    if (mtu > BT_ATT_DEFAULT_LE_MTU)
+        request_data_length(server);
+}
+
 static void att_disconnect_cb(int err, void *user_data)
 {
     struct server *server = user_data;
@@ -581,7 +4346,16 @@ static void att_disconnect_cb(int err, void *user_data)
     printf("[DISCONNECT] Client disconnected\n");
     
     // CRITICAL: Update connection status immediately
-    client_connected = false;
+    server->connected = false;
+    session_trace_emit(&server->session, server->mtu, err);
+    metrics_observe(METRICS_MTU, server->mtu);
+    metrics_disconnect_ms = now_ms();
+
+    // Keep a provisioning job running in case the client resends it
+    wifi_job_detach(server);
+    notify_queue_reset(server);
+    server->write_in_progress = false;
+    write_arena_release(&server->arena);
     
     // Special handling for error 8 (LINK_SUPERVISION_TIMEOUT)
     if (err == 8) {
@@ -589,19 +4363,19 @@ static void att_disconnect_cb(int err, void *user_data)
     }
     
     // Check if should exit
-    if (wifi_success_count > TEST_MAX_WIFI_SUCCESS_COUNT) {
+    if (queue_length(servers) <= 1 &&
+            wifi_success_count > TEST_MAX_WIFI_SUCCESS_COUNT) {
         printf("[EXIT] WiFi configured %d times, exiting after disconnect\n", 
                wifi_success_count);
         send_socket_command(LED_SYS_EVENT_OFF);
-        should_exit = true;
-        mainloop_quit();
-        return;
+        provisioning_finish();
+        if (should_exit)
+            return;
     }
     
     printf("[DISCONNECT] Will restart listening for new connections\n");
     
-    // Trigger mainloop exit to let main function restart listening
-    mainloop_quit();
+    schedule_restart_listen(server);
 }
 
 static void att_debug_cb(const char *str, void *user_data)
@@ -650,14 +4424,10 @@ static void user_service_write_cb(struct gatt_db_attribute *attrib,
                 void *user_data)
 {
     struct server *server = user_data;
-    char *str;
 
     printf("Write request received - handle: 0x%04x, offset: %d, len: %zu\n",
            gatt_db_attribute_get_handle(attrib), offset, len);
 
-    str = strndup((char *) value, len);
-    printf("Write value: %s\n", str);
-    free(str);
 
     if (offset > 0) {
         printf("Write with offset not supported\n");
@@ -680,184 +4450,624 @@ static void user_service_notify_cb(struct gatt_db_attribute *attrib,
                 void *user_data)
 {
     struct server *server = user_data;
-    char *str;
 
     printf("Notification request received - handle: 0x%04x, offset: %d, len: %zu\n",
            gatt_db_attribute_get_handle(attrib), offset, len);
 
-    str = strndup((char *) value, len);
-    printf("Notification value: %s\n", str);
-    free(str);
 
-    gatt_db_attribute_write_result(attrib, id, 0);
+    gatt_db_attribute_write_result(attrib, id, 0);
+}
+
+static void user_service_indicate_cb(struct gatt_db_attribute *attrib,
+                unsigned int id, uint16_t offset, const uint8_t *value,
+                size_t len, uint8_t opcode, struct bt_att *att,
+                void *user_data)
+{
+    struct server *server = user_data;
+
+    printf("Indication request received - handle: 0x%04x, offset: %d, len: %zu\n",
+           gatt_db_attribute_get_handle(attrib), offset, len);
+
+
+    gatt_db_attribute_write_result(attrib, id, 0);
+}
+
+static void wifi_config_read_cb(struct gatt_db_attribute *attrib,
+		unsigned int id, uint16_t offset,
+		uint8_t opcode, struct bt_att *att,
+		void *user_data)
+{
+	struct server *server = server_lookup(att);
+	uint8_t value[1] = { 0x00 };
+
+	printf("[DEBUG] wifi_config_read_cb called\n");
+	printf("[DEBUG] - id: %u\n", id);
+	printf("[DEBUG] - offset: %u\n", offset);
+	printf("[DEBUG] - opcode: 0x%02x\n", opcode);
+
+	if (!server || !server->notifying) {
+		printf("[DEBUG] - server not notifying, sending error\n");
+		gatt_db_attribute_read_result(attrib, id, BT_ATT_ERROR_REQUEST_NOT_SUPPORTED, NULL, 0);
+		return;
+	}
+
+	pthread_mutex_lock(&server->notification_lock);
+	if (server->notification_ready) {
+		printf("[DEBUG] - notification ready, sending error\n");
+		gatt_db_attribute_read_result(attrib, id, BT_ATT_ERROR_ATTRIBUTE_NOT_LONG, NULL, 0);
+	} else {
+		printf("[DEBUG] - waiting for notification\n");
+		// Wait for notification to be ready
+		server->notification_ready = true;
+		gatt_db_attribute_read_result(attrib, id, BT_ATT_ERROR_ATTRIBUTE_NOT_LONG, NULL, 0);
+	}
+	pthread_mutex_unlock(&server->notification_lock);
+}
+
+/*
+ * Outgoing notification queue.  Messages are copied into the per-connection
+ * buffer and sliced into MTU-sized fragments up front; the fragments are
+ * then sent one per mainloop event (a pacing timer for notifications, the
+ * client's confirmation for indications), so other ATT traffic interleaves
+ * with a long response and nothing sleeps or allocates on the way out.
+ */
+#define NOTIFY_FRAGMENT_INTERVAL_MS 50
+#define NOTIFY_MAX_RETRIES 20
+
+// JSON messages up to this long go out as one packet, without the '\n'
+#define NOTIFY_UNTERMINATED_MAX 20
+
+static void notify_frames_clear(struct notify_frames *q)
+{
+    q->head = 0;
+    q->tail = 0;
+    q->frag_head = 0;
+    q->frag_count = 0;
+}
+
+/*
+ * Append @message, followed by '\n' with @terminate, as fragments of at
+ * most @frag_size bytes.  Returns false, queueing nothing, when the buffer
+ * or the fragment ring is full.
+ */
+static bool notify_frames_push(struct notify_frames *q, const void *message,
+                size_t message_len, bool terminate, size_t frag_size)
+{
+    size_t total_len = message_len + (terminate ? 1 : 0);
+    size_t frags = (total_len + frag_size - 1) / frag_size;
+    size_t pos;
+
+    if (q->frag_count + frags > NOTIFY_QUEUE_MAX_FRAGS)
+        return false;
+
+    if (q->tail + total_len > NOTIFY_QUEUE_SIZE) {
+        // Move the unsent fragments back to the front of the buffer
+        memmove(q->buf, q->buf + q->head, q->tail - q->head);
+        q->tail -= q->head;
+        q->head = 0;
+
+        if (q->tail + total_len > NOTIFY_QUEUE_SIZE)
+            return false;
+    }
+
+    memcpy(q->buf + q->tail, message, message_len);
+    if (terminate)
+        q->buf[q->tail + message_len] = '\n';
+    q->tail += total_len;
+
+    for (pos = 0; pos < total_len; pos += frag_size) {
+        unsigned int idx = (q->frag_head + q->frag_count) %
+                           NOTIFY_QUEUE_MAX_FRAGS;
+
+        q->frag[idx] = total_len - pos > frag_size ? frag_size : total_len - pos;
+        q->frag_count++;
+    }
+
+    return true;
+}
+
+// The next fragment to send, or NULL when the queue is empty
+static const uint8_t *notify_frames_peek(const struct notify_frames *q,
+                uint16_t *len)
+{
+    if (!q->frag_count)
+        return NULL;
+
+    *len = q->frag[q->frag_head];
+    return q->buf + q->head;
+}
+
+// Drop the fragment just sent; returns the number left
+static unsigned int notify_frames_pop(struct notify_frames *q)
+{
+    q->head += q->frag[q->frag_head];
+    q->frag_head = (q->frag_head + 1) % NOTIFY_QUEUE_MAX_FRAGS;
+    if (--q->frag_count == 0)
+        notify_frames_clear(q);
+
+    return q->frag_count;
+}
+
+static void notify_queue_reset(struct server *server)
+{
+    notify_frames_clear(&server->notify);
+    server->notify_retries = 0;
+    server->notify_wait_conf = false;
+    // An armed pacing timer is left to fire and finds the queue empty
+}
+
+static void notify_queue_pop(struct server *server)
+{
+    server->notify_retries = 0;
+
+    if (notify_frames_pop(&server->notify) == 0 &&
+            server->session.phase_ms[SESSION_NOTIFY_SENT])
+        session_mark(&server->session, SESSION_NOTIFY_ACKED);
+}
+
+static void notify_queue_arm(struct server *server)
+{
+    if (server->notify_timer_armed)
+        return;
+
+    if (mainloop_modify_timeout(server->notify_timer_id,
+                    NOTIFY_FRAGMENT_INTERVAL_MS) == 0)
+        server->notify_timer_armed = true;
+}
+
+static void notify_queue_send(struct server *server);
+
+static void notify_conf_cb(void *user_data)
+{
+    struct server *server = user_data;
+
+    if (!server->notify_wait_conf)
+        return;
+
+    TRACE(TRACE_ATT, TRACE_DEBUG, "Indication confirmed, %u fragment(s) left",
+          server->notify.frag_count - 1);
+    server->notify_wait_conf = false;
+    notify_queue_pop(server);
+    notify_queue_send(server);
+}
+
+// Send the fragment at the head of the queue, if the link allows it now
+static void notify_queue_send(struct server *server)
+{
+    const uint8_t *data;
+    uint16_t len;
+    bool result;
+
+    if (server->notify_wait_conf || server->notify_timer_armed)
+        return;
+
+    data = notify_frames_peek(&server->notify, &len);
+    if (!data)
+        return;
+
+    if (server->indicating) {
+        result = bt_gatt_server_send_indication(server->gatt,
+                    wifi_chara_handle, data, len,
+                    notify_conf_cb, server, NULL);
+        if (result) {
+            // The next fragment goes out when the client confirms
+            metrics_count(METRICS_NOTIFY_SENT, 1);
+            server->notify_wait_conf = true;
+            return;
+        }
+    } else {
+        result = bt_gatt_server_send_notification(server->gatt,
+                    wifi_chara_handle, data, len, false);
+        if (result) {
+            metrics_count(METRICS_NOTIFY_SENT, 1);
+            notify_queue_pop(server);
+            if (server->notify.frag_count > 0)
+                notify_queue_arm(server);
+            return;
+        }
+    }
+
+    // ATT refused the PDU: keep the fragment and retry on the next tick
+    if (++server->notify_retries > NOTIFY_MAX_RETRIES) {
+        TRACE(TRACE_ATT, TRACE_ERROR, "Giving up after %d retries, dropping %u fragment(s)",
+              NOTIFY_MAX_RETRIES, server->notify.frag_count);
+        metrics_count(METRICS_NOTIFY_FAILED, server->notify.frag_count);
+        notify_queue_reset(server);
+        return;
+    }
+
+    TRACE(TRACE_ATT, TRACE_DEBUG, "Fragment of %u bytes refused, retry %u", len,
+          server->notify_retries);
+    notify_queue_arm(server);
+}
+
+static void notify_timer_cb(int timeout_id, void *user_data)
+{
+    struct server *server = user_data;
+
+    server->notify_timer_armed = false;
+    notify_queue_send(server);
+}
+
+static void send_notification_data(struct server *server, const void *data,
+                size_t data_len, bool terminate)
+{
+    if (!wifi_chara_att) {
+        printf("[DEBUG] No characteristic attribute available for notification\n");
+        return;
+    }
+
+    if (!server->gatt) {
+        printf("[DEBUG] No GATT server available for notification\n");
+        return;
+    }
+
+    // Notification format: opcode (1 byte) + handle (2 bytes) + data
+    size_t max_payload = server->mtu - 3;
+
+    TRACE(TRACE_ATT, TRACE_DEBUG, "Queueing %s: %zu bytes (MTU: %u, max payload: %zu)",
+          server->indicating ? "indication" : "notification",
+          data_len, server->mtu, max_payload);
+
+    if (!notify_frames_push(&server->notify, data, data_len, terminate,
+                            max_payload)) {
+        TRACE(TRACE_ATT, TRACE_ERROR, "Notification queue full, dropping message");
+        return;
+    }
+
+    notify_queue_send(server);
+}
+
+static void send_notification(struct server *server, const char *message)
+{
+    size_t message_len = strlen(message);
+
+    // 判断是否需要分片：如果消息长度<=20字节，强制单包，不加换行符，严格按表格
+    // 超过20字节的消息以 '\n' 结尾，按 MTU 分片
+    send_notification_data(server, message, message_len,
+                           message_len > NOTIFY_UNTERMINATED_MAX);
+}
+
+/*
+ * Answer a request in the format it was made in; @ip, and @net for a batch
+ * (-1 otherwise), are only reported with WIFI_STATUS_OK.  TLV results carry
+ * their own length, so they are never '\n' terminated.
+ */
+static void wifi_send_result(struct server *server, enum wifi_proto proto,
+                uint8_t seq, enum wifi_status status, const char *ip, int net)
+{
+    uint8_t buf[64];
+    size_t len;
+
+    if (!server->connected) {
+        TRACE(TRACE_ATT, TRACE_DEBUG, "BLE client disconnected, cannot send notification");
+        return;
+    }
+
+    if (status != WIFI_STATUS_OK) {
+        ip = NULL;
+        net = -1;
+    }
+
+    server->session.status = status;
+    server->session.proto = proto == WIFI_PROTO_TLV ? "tlv" : "json";
+    conn_params_touch(server);
+
+    pthread_mutex_lock(&server->notification_lock);
+    if (!server->notifying) {
+        TRACE(TRACE_ATT, TRACE_DEBUG, "Client not subscribed to notifications, cannot send result");
+    } else if (proto == WIFI_PROTO_TLV) {
+        len = wifi_tlv_encode_result(seq, status, ip, net, buf);
+        TRACE(TRACE_ATT, TRACE_DEBUG, "Sending TLV result: seq %u status 0x%02x (%zu bytes)",
+              seq, status, len);
+        send_notification_data(server, buf, len, false);
+        session_mark(&server->session, SESSION_NOTIFY_SENT);
+    } else {
+        wifi_json_encode_result(status, ip, net, (char *) buf, sizeof(buf));
+        TRACE(TRACE_ATT, TRACE_DEBUG, "Sending WiFi result notification: %s", (char *) buf);
+        send_notification(server, (char *) buf);
+        session_mark(&server->session, SESSION_NOTIFY_SENT);
+    }
+    pthread_mutex_unlock(&server->notification_lock);
+}
+
+// Progress frames are never '\n' terminated: both formats fit one packet
+static void wifi_send_progress(struct server *server, enum wifi_proto proto,
+                uint8_t seq, const struct wifi_progress *progress)
+{
+    uint8_t buf[32];
+    size_t len;
+
+    if (!server->connected)
+        return;
+
+    pthread_mutex_lock(&server->notification_lock);
+    if (!server->notifying) {
+        TRACE(TRACE_ATT, TRACE_DEBUG, "Client not subscribed to notifications, dropping progress");
+    } else if (proto == WIFI_PROTO_TLV) {
+        len = wifi_tlv_encode_progress(seq, progress->phase, progress->net,
+                                       progress->elapsed_ms, buf);
+        TRACE(TRACE_ATT, TRACE_DEBUG, "Sending TLV progress: phase %u at %u ms",
+              progress->phase, progress->elapsed_ms);
+        send_notification_data(server, buf, len, false);
+    } else {
+        len = wifi_json_encode_progress(progress->phase, progress->elapsed_ms,
+                                        (char *) buf, sizeof(buf));
+        TRACE(TRACE_ATT, TRACE_DEBUG, "Sending WiFi progress notification: %s",
+              (char *) buf);
+        send_notification_data(server, buf, len, false);
+    }
+    pthread_mutex_unlock(&server->notification_lock);
+}
+
+/*
+ * Hand a decoded request to the job engine.  Returns WIFI_STATUS_OK when it
+ * was taken care of: answered from the result cache, attached to the job
+ * already running it, or started as a new job (the result is notified
+ * later).  Otherwise returns the status to answer with right away.
+ */
+static enum wifi_status wifi_config_dispatch(struct server *server,
+                const struct wifi_batch *batch, enum wifi_proto proto,
+                uint8_t seq)
+{
+    uint64_t key = wifi_batch_key(batch);
+    const struct wifi_result_entry *cached;
+    int err;
+
+    if (wifi_job_attach(server, key, proto, seq))
+        return WIFI_STATUS_OK;
+
+    // Still set only if no job has started since that success
+    cached = wifi_result_cache_lookup(key);
+    if (cached) {
+        printf("[JOB] Same request as a recent success, answering from cache\n");
+        wifi_send_result(server, proto, seq, WIFI_STATUS_OK, cached->ip,
+                         cached->net);
+        return WIFI_STATUS_OK;
+    }
+
+    err = wifi_job_start(server, batch, proto, seq);
+
+    if (err == 0)
+        return WIFI_STATUS_OK;
+
+    printf("[JOB] Failed to start provisioning job: %s\n", strerror(-err));
+    return err == -EBUSY ? WIFI_STATUS_BUSY : WIFI_STATUS_CMD_FAIL;
+}
+
+/*
+ * Decode one complete request in either format and start it.  TLV frames
+ * are decoded in place from @data; errors are answered right away in the
+ * format the request used.
+ */
+static void wifi_config_handle(struct server *server, const uint8_t *data,
+                size_t len)
+{
+    enum wifi_proto proto = WIFI_PROTO_JSON;
+    struct wifi_batch batch;
+    enum wifi_status status;
+    uint8_t seq = 0;
+
+    if (data[0] == WIFI_TLV_VERSION) {
+        proto = WIFI_PROTO_TLV;
+        status = wifi_tlv_decode(data, len, &batch, &seq);
+    } else {
+        status = wifi_json_decode(data, len, &batch);
+    }
+
+    TRACE(TRACE_ATT, TRACE_DEBUG, "%s request complete (%zu bytes, %u network(s)): status 0x%02x",
+          proto == WIFI_PROTO_TLV ? "TLV" : "JSON", len, batch.count, status);
+    session_mark(&server->session, SESSION_REQUEST_PARSED);
+    server->session.requests++;
+
+    // 处理 WiFi 配置
+    if (status == WIFI_STATUS_OK && !server->connected)
+        status = WIFI_STATUS_BLE_LOST;
+    if (status == WIFI_STATUS_OK)
+        status = wifi_config_dispatch(server, &batch, proto, seq);
+    memset(&batch, 0, sizeof(batch));
+    if (status == WIFI_STATUS_OK)
+        return; // 结果由 wifi_job_event_cb 异步通知
+
+    if (status == WIFI_STATUS_BAD_FORMAT || status == WIFI_STATUS_BAD_SSID)
+        send_socket_command(LED_SYS_WIFI_CONFIG_PENDING);
+
+    wifi_send_result(server, proto, seq, status, NULL, -1);
+}
+
+/*
+ * Blocks are never handed back to malloc.  Growing or releasing an arena
+ * parks its old block on the free list of its class, up to one block per
+ * possible connection, so a certificate-sized transaction does not leave
+ * the heap fragmented and the next one reuses the same memory.  Only used
+ * from the mainloop.
+ */
+static uint8_t *write_arena_pool[WRITE_ARENA_CLASSES][MAX_CONNECTIONS];
+static unsigned int write_arena_pooled[WRITE_ARENA_CLASSES];
+
+static int write_arena_class(size_t size)
+{
+    int cls = 0;
+
+    while ((size_t) WRITE_ARENA_MIN << 2 * cls < size)
+        cls++;
+
+    return cls;
+}
+
+static void write_arena_put(uint8_t *block, size_t size)
+{
+    int cls = write_arena_class(size);
+
+    if (write_arena_pooled[cls] < MAX_CONNECTIONS)
+        write_arena_pool[cls][write_arena_pooled[cls]++] = block;
+    else
+        free(block);
+}
+
+// Make room for @need bytes; false past WRITE_ARENA_MAX or out of memory
+static bool write_arena_reserve(struct write_arena *arena, size_t need)
+{
+    uint8_t *block;
+    int cls;
+
+    if (need <= arena->size)
+        return true;
+    if (need > WRITE_ARENA_MAX)
+        return false;
+
+    cls = write_arena_class(need);
+    if (write_arena_pooled[cls])
+        block = write_arena_pool[cls][--write_arena_pooled[cls]];
+    else
+        block = malloc((size_t) WRITE_ARENA_MIN << 2 * cls);
+    if (!block)
+        return false;
+
+    if (arena->data) {
+        memcpy(block, arena->data, arena->len);
+        write_arena_put(arena->data, arena->size);
+    }
+
+    arena->data = block;
+    arena->size = (size_t) WRITE_ARENA_MIN << 2 * cls;
+    return true;
+}
+
+/*
+ * Store a fragment at @offset.  Fragments may overwrite but not leave a
+ * hole, so the value stays contiguous.  Returns 0 or the ATT error for the
+ * Prepare/Execute Write response.
+ */
+static uint8_t write_arena_store(struct write_arena *arena, size_t offset,
+                const uint8_t *value, size_t len)
+{
+    if (offset > arena->len)
+        return BT_ATT_ERROR_INVALID_OFFSET;
+
+    if (!write_arena_reserve(arena, offset + len))
+        return offset + len > WRITE_ARENA_MAX ?
+                BT_ATT_ERROR_PREPARE_QUEUE_FULL :
+                BT_ATT_ERROR_INSUFFICIENT_RESOURCES;
+
+    if (len)
+        memcpy(arena->data + offset, value, len);
+    if (offset + len > arena->len)
+        arena->len = offset + len;
+
+    return 0;
+}
+
+// Forget the contents; the smallest block is kept for the next request
+static void write_arena_reset(struct write_arena *arena)
+{
+    arena->len = 0;
+    arena->scanned = 0;
+
+    if (arena->size > WRITE_ARENA_MIN) {
+        write_arena_put(arena->data, arena->size);
+        arena->data = NULL;
+        arena->size = 0;
+    }
+}
+
+/*
+ * Drop the first @len bytes, a message that has been handled; what follows
+ * is the start of the next one and has not been scanned yet.
+ */
+static void write_arena_consume(struct write_arena *arena, size_t len)
+{
+    if (len >= arena->len) {
+        write_arena_reset(arena);
+        return;
+    }
+
+    memmove(arena->data, arena->data + len, arena->len - len);
+    arena->len -= len;
+    arena->scanned = 0;
+}
+
+static void write_arena_release(struct write_arena *arena)
+{
+    if (arena->data)
+        write_arena_put(arena->data, arena->size);
+
+    memset(arena, 0, sizeof(*arena));
+}
+
+static void write_transaction_abort(struct server *server)
+{
+    write_arena_reset(&server->arena);
+    server->write_in_progress = false;
 }
 
-static void user_service_indicate_cb(struct gatt_db_attribute *attrib,
-                unsigned int id, uint16_t offset, const uint8_t *value,
-                size_t len, uint8_t opcode, struct bt_att *att,
-                void *user_data)
+/*
+ * bt_gatt_server keeps the Prepare Write queue itself and replays it on
+ * Execute Write, one attribute write per queued fragment, without saying
+ * which one is last.  Each fragment re-arms this timer; it fires once the
+ * queue has drained and the value is complete.
+ */
+static void exec_timer_cb(int timeout_id, void *user_data)
 {
     struct server *server = user_data;
-    char *str;
 
-    printf("Indication request received - handle: 0x%04x, offset: %d, len: %zu\n",
-           gatt_db_attribute_get_handle(attrib), offset, len);
+    server->exec_timer_armed = false;
 
-    str = strndup((char *) value, len);
-    printf("Indication value: %s\n", str);
-    free(str);
+    if (!server->write_in_progress)
+        return;
 
-    gatt_db_attribute_write_result(attrib, id, 0);
+    TRACE(TRACE_ATT, TRACE_DEBUG, "Execute Write complete: %zu bytes",
+          server->arena.len);
+    wifi_config_handle(server, server->arena.data, server->arena.len);
+    write_transaction_abort(server);
 }
 
-static void wifi_config_read_cb(struct gatt_db_attribute *attrib,
-		unsigned int id, uint16_t offset,
-		uint8_t opcode, struct bt_att *att,
-		void *user_data)
+static void exec_timer_arm(struct server *server)
 {
-	struct server *server = user_data;
-	uint8_t value[1] = { 0x00 };
-
-	printf("[DEBUG] wifi_config_read_cb called\n");
-	printf("[DEBUG] - id: %u\n", id);
-	printf("[DEBUG] - offset: %u\n", offset);
-	printf("[DEBUG] - opcode: 0x%02x\n", opcode);
-
-	if (!server->notifying) {
-		printf("[DEBUG] - server not notifying, sending error\n");
-		gatt_db_attribute_read_result(attrib, id, BT_ATT_ERROR_REQUEST_NOT_SUPPORTED, NULL, 0);
-		return;
-	}
+    if (mainloop_modify_timeout(server->exec_timer_id, 1) == 0)
+        server->exec_timer_armed = true;
+}
 
-	pthread_mutex_lock(&server->notification_lock);
-	if (server->notification_ready) {
-		printf("[DEBUG] - notification ready, sending error\n");
-		gatt_db_attribute_read_result(attrib, id, BT_ATT_ERROR_ATTRIBUTE_NOT_LONG, NULL, 0);
-	} else {
-		printf("[DEBUG] - waiting for notification\n");
-		// Wait for notification to be ready
-		server->notification_ready = true;
-		gatt_db_attribute_read_result(attrib, id, BT_ATT_ERROR_ATTRIBUTE_NOT_LONG, NULL, 0);
-	}
-	pthread_mutex_unlock(&server->notification_lock);
+// A Write Command stream that cannot be reassembled still gets an answer
+static void write_stream_reject(struct server *server, const uint8_t *buf,
+                size_t len)
+{
+    if (len >= WIFI_TLV_HDR_LEN && buf[0] == WIFI_TLV_VERSION)
+        wifi_send_result(server, WIFI_PROTO_TLV, buf[2],
+                         WIFI_STATUS_BAD_FORMAT, NULL, -1);
+    else
+        wifi_send_result(server, WIFI_PROTO_JSON, 0,
+                         WIFI_STATUS_BAD_FORMAT, NULL, -1);
 }
 
-static void send_notification(struct server *server, const char *message)
+/*
+ * Framing of the Write Command stream: a TLV frame carries its own length,
+ * a JSON request ends at '\n'.  Returns the bytes taken by the message
+ * complete at the start of @buf, '\n' included, 0 while more fragments are
+ * needed, or -1 for a TLV frame that could never fit the arena.  @scanned
+ * carries the search for '\n' over from one fragment to the next, so each
+ * byte is looked at once however many fragments a line takes.
+ */
+static ssize_t write_stream_frame_len(const uint8_t *buf, size_t len,
+                size_t *scanned)
 {
-    if (!server->chara_att) {
-        printf("[DEBUG] No characteristic attribute available for notification\n");
-        return;
-    }
+    const uint8_t *nl;
+    size_t frame_len;
 
-    if (!server->gatt) {
-        printf("[DEBUG] No GATT server available for notification\n");
-        return;
+    if (buf[0] == WIFI_TLV_VERSION) {
+        frame_len = wifi_tlv_frame_len(buf, len);
+        if (frame_len > WRITE_ARENA_MAX)
+            return -1;
+        return frame_len <= len ? (ssize_t) frame_len : 0;
     }
 
-    size_t message_len = strlen(message);
-    // 判断是否需要分片：如果消息长度<=20字节，强制单包
-    if (message_len <= 20) {
-        uint8_t buffer[21];
-        memcpy(buffer, message, message_len);
-        // 不加换行符，严格按表格
-        bool result = bt_gatt_server_send_notification(server->gatt, server->chara_handle,
-                buffer, message_len, false);
-        printf("[DEBUG] Single packet notification result: %s\n", result ? "SUCCESS" : "FAILED");
-        return;
+    nl = memchr(buf + *scanned, '\n', len - *scanned);
+    if (!nl) {
+        *scanned = len;
+        return 0;
     }
-    // 超过20字节，按原有分片逻辑
-    // ... existing code ...
 
-    // Add '\n' terminator to the message for protocol compliance
-    size_t total_len = message_len + 1; // +1 for '\n' terminator
-    
-    // Get current MTU and calculate max payload for notifications
-    // Notification format: opcode (1 byte) + handle (2 bytes) + data
-    uint16_t current_mtu = bt_gatt_server_get_mtu(server->gatt);
-    size_t max_payload = current_mtu - 3;  // MTU - (opcode + handle)
-    
-    printf("[DEBUG] Sending notification: %s (length: %zu, total with newline: %zu)\n", 
-           message, message_len, total_len);
-    printf("[DEBUG] Current MTU: %u, Max payload: %zu\n", current_mtu, max_payload);
-    
-    if (total_len <= max_payload) {
-        // Single packet - create buffer with terminator
-        uint8_t *buffer = malloc(total_len);
-        if (!buffer) {
-            printf("[DEBUG] Failed to allocate buffer for notification\n");
-            return;
-        }
-        
-        memcpy(buffer, message, message_len);
-        buffer[message_len] = '\n'; // Add newline terminator
-        
-        bool result = bt_gatt_server_send_notification(server->gatt, server->chara_handle,
-                buffer, total_len, false);
-        printf("[DEBUG] Single packet notification result: %s\n", result ? "SUCCESS" : "FAILED");
-        
-        free(buffer);
-        return;
-    }
-    
-    // Multi-packet: need fragmentation for MTU=23
-    printf("[DEBUG] Message too long (%zu bytes with newline), fragmenting into %zu-byte chunks\n", 
-           total_len, max_payload);
-    
-    size_t offset = 0;
-    int fragment_num = 0;
-    
-    while (offset < total_len) {
-        size_t remaining = total_len - offset;
-        size_t chunk_size = (remaining > max_payload) ? max_payload : remaining;
-        
-        printf("[DEBUG] Sending fragment %d: offset=%zu, size=%zu\n", 
-               fragment_num, offset, chunk_size);
-        
-        // Create buffer for this fragment
-        uint8_t *buffer = malloc(chunk_size);
-        if (!buffer) {
-            printf("[DEBUG] Failed to allocate buffer for fragment %d\n", fragment_num);
-            break;
-        }
-        
-        // Copy data for this fragment
-        if (offset < message_len) {
-            // Copy message data
-            size_t data_to_copy = (chunk_size <= (message_len - offset)) ? chunk_size : (message_len - offset);
-            memcpy(buffer, message + offset, data_to_copy);
-            
-            // If this fragment includes the end of message, add terminator
-            if (offset + data_to_copy >= message_len) {
-                buffer[data_to_copy] = '\n';
-            }
-        } else {
-            // This fragment only contains the terminator
-            buffer[0] = '\n';
-        }
-        
-        bool result = bt_gatt_server_send_notification(server->gatt, server->chara_handle,
-                buffer, chunk_size, false);
-        
-        free(buffer);
-        
-        if (!result) {
-            printf("[DEBUG] Fragment %d failed to send\n", fragment_num);
-            break;
-        }
-        
-        printf("[DEBUG] Fragment %d sent successfully\n", fragment_num);
-        
-        offset += chunk_size;
-        fragment_num++;
-        
-        // Add delay between fragments to prevent overwhelming the client
-        if (offset < total_len) {
-            usleep(50000); // 50ms delay for MTU=23 to ensure stable delivery
-        }
-    }
-    
-    printf("[DEBUG] Fragmentation complete: sent %d fragments, total %zu bytes\n", 
-           fragment_num, offset);
+    return nl - buf + 1;
 }
 
 static void wifi_config_write_cb(struct gatt_db_attribute *attrib,
@@ -866,237 +5076,159 @@ static void wifi_config_write_cb(struct gatt_db_attribute *attrib,
                 uint8_t opcode, struct bt_att *att,
                 void *user_data)
 {
-    struct server *server = user_data;
-    char *json_str = NULL;
-    char response[256];
-    int ret;
+    struct server *server = server_lookup(att);
+    struct write_arena *arena;
+    const uint8_t *buf;
+    uint8_t err;
 
-    // Respond to write immediately to prevent timeout
-    gatt_db_attribute_write_result(attrib, id, 0);
+    if (!server) {
+        gatt_db_attribute_write_result(attrib, id, BT_ATT_ERROR_UNLIKELY);
+        return;
+    }
+
+    session_mark(&server->session, SESSION_FIRST_PDU);
+    session_mark(&server->session, SESSION_FIRST_WRITE);
+    session_mark(&server->session, SESSION_LAST_WRITE);
+    conn_params_touch(server);
+
+    arena = &server->arena;
 
     // Handle Prepare Write (0x16), Execute Write (0x18), Write Request (0x12)
     if (opcode == BT_ATT_OP_PREP_WRITE_REQ) {
-        // 分包写入，缓存数据
-        printf("[DEBUG] Prepare Write: offset=%u, len=%zu\n", offset, len);
-        if (len > 0) {
-            printf("[DEBUG] Prepare Write value (hex):");
-            for (size_t i = 0; i < len; i++) {
-                printf(" %02x", value[i]);
-            }
-            printf("\n");
-            memcpy(server->write_buffer + offset, value, len);
-            if (offset + len > server->write_buffer_len)
-                server->write_buffer_len = offset + len;
-            printf("[DEBUG] After memcpy, write_buffer_len=%zu\n", server->write_buffer_len);
-            printf("[DEBUG] Current write_buffer (hex):");
-            for (size_t i = 0; i < server->write_buffer_len; i++) {
-                printf(" %02x", (unsigned char)server->write_buffer[i]);
-            }
-            printf("\n");
-        } else {
-            printf("[DEBUG] Prepare Write: len=0, skip memcpy\n");
+        // 分包写入：bt_gatt_server 自己排队，这里只校验 offset
+        TRACE(TRACE_ATT, TRACE_DEBUG, "Prepare Write: offset=%u, len=%zu (mtu %u)",
+               offset, len, server->mtu);
+        if (!server->write_in_progress)
+            write_arena_reset(arena);
+        if (len)
+            err = write_arena_store(arena, offset, value, len);
+        else
+            err = offset > WRITE_ARENA_MAX ? BT_ATT_ERROR_PREPARE_QUEUE_FULL : 0;
+        gatt_db_attribute_write_result(attrib, id, err);
+        if (err) {
+            TRACE(TRACE_ATT, TRACE_ERROR, "Prepare Write rejected: offset %u + %zu (error 0x%02x)",
+                  offset, len, err);
+            write_transaction_abort(server);
+            return;
         }
         server->write_in_progress = true;
         return; // 等待 Execute Write
     } else if (opcode == BT_ATT_OP_EXEC_WRITE_REQ) {
-        // 分包写入完成，处理缓存
-        printf("[DEBUG] Execute Write: buffer_len=%zu\n", server->write_buffer_len);
-        printf("[DEBUG] Execute Write: buffer (hex):");
-        for (size_t i = 0; i < server->write_buffer_len; i++) {
-            printf(" %02x", (unsigned char)server->write_buffer[i]);
-        }
-        printf("\n");
-        if (!server->write_in_progress || server->write_buffer_len == 0) {
-            printf("[DEBUG] Execute Write but no data in buffer\n");
-            snprintf(response, sizeof(response), "{\"ip\":\"\"}");
-            goto send_response;
-        }
-        // 查找换行符，截断
-        size_t actual_len = server->write_buffer_len;
-        for (size_t i = 0; i < server->write_buffer_len; i++) {
-            if (server->write_buffer[i] == '\n') {
-                actual_len = i;
-                break;
+        // 队列重放：每个分片一次回调，最后一片之后由 exec_timer_cb 处理
+        TRACE(TRACE_ATT, TRACE_DEBUG, "Execute Write: offset=%u, len=%zu, buffer_len=%zu",
+              offset, len, arena->len);
+        if (!len) {
+            gatt_db_attribute_write_result(attrib, id, 0);
+            if (!server->write_in_progress || !arena->len) {
+                TRACE(TRACE_ATT, TRACE_DEBUG, "Execute Write but no data in buffer");
+                wifi_send_result(server, WIFI_PROTO_JSON, 0, WIFI_STATUS_NO_IP, NULL, -1);
+                write_transaction_abort(server);
+                return;
             }
+            wifi_config_handle(server, arena->data, arena->len);
+            write_transaction_abort(server);
+            return;
         }
-        json_str = malloc(actual_len + 1);
-        if (!json_str) {
-            snprintf(response, sizeof(response), "{\"ip\":\"\"}");
-            server->write_buffer_len = 0;
-            server->write_in_progress = false;
-            goto send_response;
+        if (!server->write_in_progress) {
+            write_arena_reset(arena);
+            server->write_in_progress = true;
         }
-        memcpy(json_str, server->write_buffer, actual_len);
-        json_str[actual_len] = '\0';
-        printf("[DEBUG] Execute Write: JSON: '%s'\n", json_str);
-        server->write_buffer_len = 0;
-        server->write_in_progress = false;
-        // 处理 WiFi 配置
-        if (!client_connected) {
-            snprintf(response, sizeof(response), "{\"err\":\"BLE lost\"}");
-            free(json_str);
-            goto send_response;
+        err = write_arena_store(arena, offset, value, len);
+        if (err) {
+            TRACE(TRACE_ATT, TRACE_ERROR, "Execute Write rejected: offset %u + %zu > %zu (error 0x%02x)",
+                  offset, len, arena->len, err);
+            write_transaction_abort(server);
+            gatt_db_attribute_write_result(attrib, id,
+                    err == BT_ATT_ERROR_PREPARE_QUEUE_FULL ?
+                    BT_ATT_ERROR_INVALID_ATTRIBUTE_VALUE_LEN : err);
+            return;
         }
-        ret = process_wifi_config(json_str, response, sizeof(response));
-        free(json_str);
-        goto send_response;
-    } else if (opcode == BT_ATT_OP_WRITE_REQ) {
+        exec_timer_arm(server);
+        gatt_db_attribute_write_result(attrib, id, 0);
+        return;
+    }
+
+    // Respond to write immediately to prevent timeout
+    gatt_db_attribute_write_result(attrib, id, 0);
+
+    if (opcode == BT_ATT_OP_WRITE_REQ) {
         // 直接写入
-        printf("[DEBUG] Direct Write: offset=%u, len=%zu\n", offset, len);
-        if (len > 0) {
-            printf("[DEBUG] Direct Write value (hex):");
-            for (size_t i = 0; i < len; i++) {
-                printf(" %02x", value[i]);
-            }
-            printf("\n");
-        }
-        if (offset > 0) {
-            printf("[DEBUG] Write request with offset not supported for WiFi config\n");
-            snprintf(response, sizeof(response), "{\"ip\":\"\"}");
-            goto send_response;
-        }
-        if (len == 0) {
-            snprintf(response, sizeof(response), "{\"ip\":\"\"}");
-            goto send_response;
-        }
-        // 查找换行符，截断
-        size_t actual_len = len;
-        for (size_t i = 0; i < len; i++) {
-            if (value[i] == '\n') {
-                actual_len = i;
-                break;
-            }
-        }
-        json_str = malloc(actual_len + 1);
-        if (!json_str) {
-            snprintf(response, sizeof(response), "{\"ip\":\"\"}");
-            goto send_response;
-        }
-        memcpy(json_str, value, actual_len);
-        json_str[actual_len] = '\0';
-        printf("[DEBUG] Direct Write: JSON: '%s'\n", json_str);
-        if (!client_connected) {
-            snprintf(response, sizeof(response), "{\"err\":\"BLE lost\"}");
-            free(json_str);
-            goto send_response;
+        TRACE(TRACE_ATT, TRACE_DEBUG, "Direct Write: offset=%u, len=%zu", offset, len);
+        if (offset > 0 || len == 0) {
+            TRACE(TRACE_ATT, TRACE_DEBUG, "Write request with offset or no data not supported for WiFi config");
+            wifi_send_result(server, WIFI_PROTO_JSON, 0, WIFI_STATUS_NO_IP, NULL, -1);
+            return;
         }
-        ret = process_wifi_config(json_str, response, sizeof(response));
-        free(json_str);
-        goto send_response;
+        wifi_config_handle(server, value, len);
     } else if (opcode == BT_ATT_OP_WRITE_CMD) {
         // Write Without Response 分片缓存处理，兼容 iOS 长数据
-        printf("[DEBUG] Write Without Response (opcode=0x52): offset=%u, len=%zu\n", offset, len);
-        if (len > 0) {
-            printf("[DEBUG] Write Without Response value (hex):");
-            for (size_t i = 0; i < len; i++) {
-                printf(" %02x", value[i]);
-            }
-            printf("\n");
-        }
+        ssize_t frame_len;
+        size_t msg_len;
+
+        TRACE(TRACE_ATT, TRACE_DEBUG, "Write Without Response (opcode=0x52): offset=%u, len=%zu (mtu %u)",
+               offset, len, server->mtu);
         if (offset > 0) {
-            printf("[DEBUG] Write Without Response with offset not supported for WiFi config\n");
+            TRACE(TRACE_ATT, TRACE_DEBUG, "Write Without Response with offset not supported for WiFi config");
             return;
         }
         if (len == 0) {
             return;
         }
         // 追加到缓存
-        if (server->write_buffer_len + len > MAX_WRITE_BUFFER) {
-            printf("[DEBUG] Write buffer overflow: %zu + %zu > %d\n", server->write_buffer_len, len, MAX_WRITE_BUFFER);
-            server->write_buffer_len = 0;
+        err = write_arena_store(arena, arena->len, value, len);
+        if (err) {
+            TRACE(TRACE_ATT, TRACE_ERROR, "Write buffer overflow: %zu + %zu > %d",
+                  arena->len, len, WRITE_ARENA_MAX);
+            write_stream_reject(server, arena->len ? arena->data : value,
+                                arena->len ? arena->len : len);
+            write_arena_reset(arena);
             return;
         }
-        memcpy(server->write_buffer + server->write_buffer_len, value, len);
-        server->write_buffer_len += len;
-        printf("[DEBUG] After append, write_buffer_len=%zu\n", server->write_buffer_len);
-        printf("[DEBUG] Current write_buffer (hex):");
-        for (size_t i = 0; i < server->write_buffer_len; i++) {
-            printf(" %02x", (unsigned char)server->write_buffer[i]);
-        }
-        printf("\n");
-        // 检查是否有换行符
-        size_t json_end = 0;
-        bool found_newline = false;
-        for (size_t i = 0; i < server->write_buffer_len; i++) {
-            if (server->write_buffer[i] == '\n') {
-                json_end = i;
-                found_newline = true;
+        TRACE(TRACE_ATT, TRACE_DEBUG, "After append, write_buffer_len=%zu", arena->len);
+
+        // TLV 帧由头部长度界定，JSON 以换行符结尾；后面剩下的字节是下一条消息的开头
+        while (arena->len) {
+            buf = arena->data;
+            frame_len = write_stream_frame_len(buf, arena->len, &arena->scanned);
+            if (frame_len < 0) {
+                TRACE(TRACE_ATT, TRACE_ERROR, "TLV frame too long: > %d", WRITE_ARENA_MAX);
+                write_stream_reject(server, buf, arena->len);
+                write_arena_reset(arena);
+                return;
+            }
+            if (frame_len == 0) {
+                TRACE(TRACE_ATT, TRACE_DEBUG, "Incomplete %s, waiting for more fragments",
+                      buf[0] == WIFI_TLV_VERSION ? "TLV frame" : "JSON line");
                 break;
             }
+
+            // Handled in place; an empty line is skipped
+            msg_len = buf[0] == WIFI_TLV_VERSION ? frame_len : frame_len - 1;
+            if (msg_len)
+                wifi_config_handle(server, buf, msg_len);
+            write_arena_consume(arena, frame_len);
         }
-        if (!found_newline) {
-            printf("[DEBUG] No newline found, waiting for more fragments\n");
-            return;
-        }
-        // 处理完整 JSON
-        char *json_str = malloc(json_end + 1);
-        if (!json_str) {
-            server->write_buffer_len = 0;
-            return;
-        }
-        memcpy(json_str, server->write_buffer, json_end);
-        json_str[json_end] = '\0';
-        printf("[DEBUG] Write Without Response: JSON: '%s'\n", json_str);
-        // 清空缓存
-        server->write_buffer_len = 0;
-        if (!client_connected) {
-            free(json_str);
-            return;
-        }
-        int ret = process_wifi_config(json_str, response, sizeof(response));
-        free(json_str);
-        // 发送通知
-        pthread_mutex_lock(&server->notification_lock);
-        if (server->notifying && client_connected) {
-            printf("[DEBUG] Sending WiFi result notification: %s\n", response);
-            send_notification(server, response);
-        } else {
-            printf("[DEBUG] Client not subscribed to notifications or disconnected, cannot send result\n");
-        }
-        pthread_mutex_unlock(&server->notification_lock);
-        printf("[DEBUG] ================== WIFI CONFIG COMPLETE ==================\n");
-        return;
     } else {
-        printf("[DEBUG] Unsupported opcode: 0x%02x\n", opcode);
-        snprintf(response, sizeof(response), "{\"ip\":\"\"}");
-        goto send_response;
+        TRACE(TRACE_ATT, TRACE_DEBUG, "Unsupported opcode: 0x%02x", opcode);
+        wifi_send_result(server, WIFI_PROTO_JSON, 0, WIFI_STATUS_NO_IP, NULL, -1);
     }
 
-send_response:
-    if (!client_connected) {
-        printf("[DEBUG] BLE client disconnected, cannot send notification\n");
-        return;
-    }
-    usleep(100000);
-    if (!client_connected) {
-        printf("[DEBUG] BLE client disconnected during delay, cannot send notification\n");
-        return;
-    }
-    pthread_mutex_lock(&server->notification_lock);
-    if (server->notifying && client_connected) {
-        printf("[DEBUG] Sending WiFi result notification: %s\n", response);
-        send_notification(server, response);
-    } else {
-        printf("[DEBUG] Client not subscribed to notifications or disconnected, cannot send result\n");
-    }
-    pthread_mutex_unlock(&server->notification_lock);
-    printf("[DEBUG] ================== WIFI CONFIG COMPLETE ==================\n");
+    TRACE(TRACE_ATT, TRACE_DEBUG, "================== WIFI CONFIG COMPLETE ==================");
 }
 
-static void str2uuid(const char *str, uint8_t *value, uint8_t type)
+/*
+ * Parse 6e400000-0000-4e98-8024-bc5b71e0893e into 16 bytes in the order
+ * written, so apps display the same UUID.  Returns -1 on a bad length.
+ */
+static int uuid_parse(const char *str, uint8_t *value)
 {
-    // Parse UUID: 6e400000-0000-4e98-8024-bc5b71e0893e
-    // Should result in the same UUID when displayed in apps
-    
-    if (strlen(str) != 36) {
-        printf("[ERROR] Invalid UUID length: %zu, expected 36\n", strlen(str));
-        return;
-    }
-    
-    // Simple hex string parsing, treating UUID as byte array
     int i = 0, j = 0;
     char buf[3] = {0};
-    
+
+    if (strlen(str) != 36)
+        return -1;
+
+    // Simple hex string parsing, treating UUID as byte array
     while (i < 36 && j < 16) {
         if (str[i] == '-') {
             i++;
@@ -1106,6 +5238,16 @@ static void str2uuid(const char *str, uint8_t *value, uint8_t type)
         buf[1] = str[i++];
         value[j++] = (uint8_t)strtoul(buf, NULL, 16);
     }
+
+    return 0;
+}
+
+static void str2uuid(const char *str, uint8_t *value, uint8_t type)
+{
+    if (uuid_parse(str, value) < 0) {
+        printf("[ERROR] Invalid UUID length: %zu, expected 36\n", strlen(str));
+        return;
+    }
     
     printf("[DEBUG] UUID string: %s\n", str);
     printf("[DEBUG] UUID bytes: ");
@@ -1130,13 +5272,18 @@ static void cccd_read_cb(struct gatt_db_attribute *attrib,
 				uint8_t opcode, struct bt_att *att,
 				void *user_data)
 {
-	struct server *server = user_data;
+	struct server *server = server_lookup(att);
 	uint8_t value[2] = {0, 0};
 
 	printf("[DEBUG] cccd_read_cb called\n");
 	
+	if (!server) {
+		gatt_db_attribute_read_result(attrib, id, BT_ATT_ERROR_UNLIKELY, NULL, 0);
+		return;
+	}
+
 	if (server->notifying) {
-		value[0] = 0x01; // Notifications enabled
+		value[0] = server->indicating ? 0x02 : 0x01; // Indications / notifications enabled
 	}
 
 	gatt_db_attribute_read_result(attrib, id, 0, value, 2);
@@ -1148,10 +5295,15 @@ static void cccd_write_cb(struct gatt_db_attribute *attrib,
 				uint8_t opcode, struct bt_att *att,
 				void *user_data)
 {
-	struct server *server = user_data;
+	struct server *server = server_lookup(att);
 
 	printf("[DEBUG] cccd_write_cb called, len: %zu\n", len);
 	
+	if (!server) {
+		gatt_db_attribute_write_result(attrib, id, BT_ATT_ERROR_UNLIKELY);
+		return;
+	}
+
 	if (len != 2) {
 		printf("[DEBUG] Invalid CCCD value length: %zu\n", len);
 		gatt_db_attribute_write_result(attrib, id, BT_ATT_ERROR_INVALID_ATTRIBUTE_VALUE_LEN);
@@ -1165,16 +5317,21 @@ static void cccd_write_cb(struct gatt_db_attribute *attrib,
 	
 	if (cccd_value & 0x01) {
 		printf("[DEBUG] Notifications enabled by client (0x01 bit set)\n");
+		session_mark(&server->session, SESSION_CCCD_ENABLE);
 		server->notifying = true;
 		server->notification_ready = true;
+		server->indicating = false;
 	} else if (cccd_value & 0x02) {
 		printf("[DEBUG] Indications enabled by client (0x02 bit set)\n");
-		server->notifying = true;  // We'll treat indications as notifications
+		session_mark(&server->session, SESSION_CCCD_ENABLE);
+		server->notifying = true;
 		server->notification_ready = true;
+		server->indicating = true;  // Each fragment waits for a confirmation
 	} else {
 		printf("[DEBUG] Notifications and indications disabled by client\n");
 		server->notifying = false;
 		server->notification_ready = false;
+		server->indicating = false;
 	}
 	
 	pthread_mutex_unlock(&server->notification_lock);
@@ -1184,15 +5341,241 @@ static void cccd_write_cb(struct gatt_db_attribute *attrib,
 	// If this is our WiFi service being enabled, send test notification
 	uint16_t handle = gatt_db_attribute_get_handle(attrib);
 	printf("[DEBUG] CCCD write on handle: 0x%04x, WiFi char handle: 0x%04x\n", 
-	       handle, server->chara_handle);
+	       handle, wifi_chara_handle);
 	
-	if (server->notifying && (handle == (server->chara_handle + 1))) {
+	if (server->notifying && (handle == (wifi_chara_handle + 1))) {
 		// CCCD is typically handle + 1 from characteristic
 		printf("[DEBUG] WiFi service notifications enabled! Sending test notification\n");
 		//send_notification(server, "{\"status\":\"ready\",\"message\":\"WiFi service notifications enabled\"}");
 	}
 }
 
+/*
+ * Scan-results characteristic.
+ *
+ * Each read returns one page and advances the connection's cursor:
+ *
+ *   header: generation(1) page(1) page_count(1) record_count(1)
+ *   record: bssid(6) rssi(1, dBm) security(1) freq(2, LE, MHz)
+ *           ssid_len(1) ssid(ssid_len)
+ *
+ * Pages are packed to fit one Read Response at the negotiated MTU, so with
+ * a large MTU the whole table arrives in a single round trip.  The cursor
+ * wraps to page 0 after the last page.  Writes: 0x00 <page> seeks, 0x01
+ * requests a fresh scan.  When a scan completes, subscribers are notified
+ * with generation(1) page_count(1) network_count(1) and the cursor rewinds.
+ */
+#define WIFI_SCAN_PAGE_HDR_LEN 4
+#define WIFI_SCAN_RECORD_LEN 11             // without the SSID bytes
+#define WIFI_SCAN_PAGE_MIN_LEN 64           // below this, rely on Read Blob
+#define WIFI_SCAN_OP_SEEK 0x00
+#define WIFI_SCAN_OP_RESCAN 0x01
+
+// Called with scan_cache.lock held
+static uint16_t wifi_scan_build_page(unsigned int page, size_t limit,
+                uint8_t *buf)
+{
+    size_t used = WIFI_SCAN_PAGE_HDR_LEN, len = WIFI_SCAN_PAGE_HDR_LEN;
+    unsigned int i, cur = 0;
+    uint8_t count = 0;
+
+    for (i = 0; i < scan_cache.count; i++) {
+        const struct wifi_scan_entry *entry = &scan_cache.entries[i];
+        size_t ssid_len = strlen(entry->ssid);
+        size_t rec = WIFI_SCAN_RECORD_LEN + ssid_len;
+
+        if (used + rec > limit) {
+            cur++;
+            used = WIFI_SCAN_PAGE_HDR_LEN;
+        }
+        used += rec;
+
+        if (cur != page)
+            continue;
+
+        memcpy(buf + len, entry->bssid, 6);
+        buf[len + 6] = (uint8_t) entry->rssi;
+        buf[len + 7] = entry->security;
+        put_le16(entry->freq, buf + len + 8);
+        buf[len + 10] = ssid_len;
+        memcpy(buf + len + WIFI_SCAN_RECORD_LEN, entry->ssid, ssid_len);
+        len += rec;
+        count++;
+    }
+
+    buf[0] = scan_cache.generation;
+    buf[1] = page;
+    buf[2] = cur + 1;
+    buf[3] = count;
+
+    return len;
+}
+
+static size_t wifi_scan_page_limit(struct server *server)
+{
+    size_t limit = server->mtu - 1;
+
+    if (limit < WIFI_SCAN_PAGE_MIN_LEN)
+        limit = WIFI_SCAN_PAGE_MIN_LEN;
+    if (limit > BT_ATT_MAX_VALUE_LEN)
+        limit = BT_ATT_MAX_VALUE_LEN;
+    return limit;
+}
+
+static void wifi_scan_read_cb(struct gatt_db_attribute *attrib,
+                unsigned int id, uint16_t offset,
+                uint8_t opcode, struct bt_att *att,
+                void *user_data)
+{
+    struct server *server = server_lookup(att);
+
+    if (!server) {
+        gatt_db_attribute_read_result(attrib, id, BT_ATT_ERROR_UNLIKELY, NULL, 0);
+        return;
+    }
+
+    if (offset == 0) {
+        conn_params_touch(server);
+        pthread_mutex_lock(&scan_cache.lock);
+        server->scan_page_len = wifi_scan_build_page(server->scan_page,
+                                    wifi_scan_page_limit(server),
+                                    server->scan_page_buf);
+        pthread_mutex_unlock(&scan_cache.lock);
+        // buf[2] holds the page count of this snapshot
+        server->scan_page = server->scan_page + 1 < server->scan_page_buf[2] ?
+                            server->scan_page + 1 : 0;
+        TRACE(TRACE_ATT, TRACE_DEBUG, "Scan page %u/%u: %u records, %u bytes",
+              server->scan_page_buf[1], server->scan_page_buf[2],
+              server->scan_page_buf[3], server->scan_page_len);
+    }
+
+    if (offset > server->scan_page_len) {
+        gatt_db_attribute_read_result(attrib, id, BT_ATT_ERROR_INVALID_OFFSET, NULL, 0);
+        return;
+    }
+
+    gatt_db_attribute_read_result(attrib, id, 0,
+                    server->scan_page_buf + offset,
+                    server->scan_page_len - offset);
+}
+
+static void wifi_scan_write_cb(struct gatt_db_attribute *attrib,
+                unsigned int id, uint16_t offset,
+                const uint8_t *value, size_t len,
+                uint8_t opcode, struct bt_att *att,
+                void *user_data)
+{
+    struct server *server = server_lookup(att);
+
+    if (!server) {
+        gatt_db_attribute_write_result(attrib, id, BT_ATT_ERROR_UNLIKELY);
+        return;
+    }
+
+    if (offset || len < 1) {
+        gatt_db_attribute_write_result(attrib, id,
+                        BT_ATT_ERROR_INVALID_ATTRIBUTE_VALUE_LEN);
+        return;
+    }
+
+    switch (value[0]) {
+    case WIFI_SCAN_OP_SEEK:
+        server->scan_page = len > 1 ? value[1] : 0;
+        break;
+    case WIFI_SCAN_OP_RESCAN:
+        server->scan_page = 0;
+        wifi_scan_request();
+        break;
+    default:
+        gatt_db_attribute_write_result(attrib, id,
+                        BT_ATT_ERROR_REQUEST_NOT_SUPPORTED);
+        return;
+    }
+
+    gatt_db_attribute_write_result(attrib, id, 0);
+}
+
+static void wifi_scan_cccd_read_cb(struct gatt_db_attribute *attrib,
+                unsigned int id, uint16_t offset,
+                uint8_t opcode, struct bt_att *att,
+                void *user_data)
+{
+    struct server *server = server_lookup(att);
+    uint8_t value[2] = { 0x00, 0x00 };
+
+    if (server && server->scan_notifying)
+        value[0] = 0x01;
+
+    gatt_db_attribute_read_result(attrib, id, 0, value, 2);
+}
+
+static void wifi_scan_cccd_write_cb(struct gatt_db_attribute *attrib,
+                unsigned int id, uint16_t offset,
+                const uint8_t *value, size_t len,
+                uint8_t opcode, struct bt_att *att,
+                void *user_data)
+{
+    struct server *server = server_lookup(att);
+
+    if (!server) {
+        gatt_db_attribute_write_result(attrib, id, BT_ATT_ERROR_UNLIKELY);
+        return;
+    }
+
+    if (len != 2) {
+        gatt_db_attribute_write_result(attrib, id,
+                        BT_ATT_ERROR_INVALID_ATTRIBUTE_VALUE_LEN);
+        return;
+    }
+
+    server->scan_notifying = value[0] & 0x01;
+    gatt_db_attribute_write_result(attrib, id, 0);
+}
+
+// Tell a subscriber how many pages to read back
+static void wifi_scan_notify_server(void *data, void *user_data)
+{
+    struct server *server = data;
+    uint8_t page[BT_ATT_MAX_VALUE_LEN];
+    uint8_t value[3];
+
+    if (!server->scan_notifying)
+        return;
+
+    pthread_mutex_lock(&scan_cache.lock);
+    wifi_scan_build_page(0, wifi_scan_page_limit(server), page);
+    value[0] = page[0];
+    value[1] = page[2];
+    value[2] = scan_cache.count;
+    pthread_mutex_unlock(&scan_cache.lock);
+
+    server->scan_page = 0;
+
+    bt_gatt_server_send_notification(server->gatt, scan_chara_handle,
+                                     value, sizeof(value), false);
+}
+
+// Highest TLV version understood, then the WIFI_PROTO_FLAG_* formats accepted
+static void proto_version_read_cb(struct gatt_db_attribute *attrib,
+                unsigned int id, uint16_t offset,
+                uint8_t opcode, struct bt_att *att,
+                void *user_data)
+{
+    const uint8_t value[2] = {
+        WIFI_TLV_VERSION,
+        WIFI_PROTO_FLAG_JSON | WIFI_PROTO_FLAG_TLV | WIFI_PROTO_FLAG_BATCH |
+                WIFI_PROTO_FLAG_PROGRESS,
+    };
+
+    if (offset > sizeof(value)) {
+        gatt_db_attribute_read_result(attrib, id, BT_ATT_ERROR_INVALID_OFFSET, NULL, 0);
+        return;
+    }
+
+    gatt_db_attribute_read_result(attrib, id, 0, value + offset,
+                                  sizeof(value) - offset);
+}
+
 static void descriptor_read_cb(struct gatt_db_attribute *attrib,
 				unsigned int id, uint16_t offset,
 				uint8_t opcode, struct bt_att *att,
@@ -1266,7 +5649,7 @@ static void gap_appearance_read_cb(struct gatt_db_attribute *attrib,
     gatt_db_attribute_read_result(attrib, id, 0, appearance + offset, 2 - offset);
 }
 
-static void populate_gap_service(struct server *server)
+static void populate_gap_service(struct gatt_db *db)
 {
     struct gatt_db_attribute *service;
     bt_uuid_t uuid;
@@ -1275,27 +5658,27 @@ static void populate_gap_service(struct server *server)
 
     // Add GAP service
     bt_uuid16_create(&uuid, 0x1800); // Generic Access Profile
-    service = gatt_db_add_service(server->db, &uuid, true, 6);
+    service = gatt_db_add_service(db, &uuid, true, 6);
 
     // Device Name characteristic
     bt_uuid16_create(&uuid, 0x2A00); // Device Name
     gatt_db_service_add_characteristic(service, &uuid,
             BT_ATT_PERM_READ,
             BT_GATT_CHRC_PROP_READ,
-            gap_device_name_read_cb, NULL, server);
+            gap_device_name_read_cb, NULL, NULL);
 
     // Appearance characteristic
     bt_uuid16_create(&uuid, 0x2A01); // Appearance
     gatt_db_service_add_characteristic(service, &uuid,
             BT_ATT_PERM_READ,
             BT_GATT_CHRC_PROP_READ,
-            gap_appearance_read_cb, NULL, server);
+            gap_appearance_read_cb, NULL, NULL);
 
     gatt_db_service_set_active(service, true);
     printf("[DEBUG] GAP service populated\n");
 }
 
-static void populate_gatt_service(struct server *server)
+static void populate_gatt_service(struct gatt_db *db)
 {
     struct gatt_db_attribute *service, *characteristic;
     bt_uuid_t uuid;
@@ -1304,20 +5687,20 @@ static void populate_gatt_service(struct server *server)
 
     // Add GATT service
     bt_uuid16_create(&uuid, 0x1801); // Generic Attribute Profile
-    service = gatt_db_add_service(server->db, &uuid, true, 6); // Increased size for CCCD
+    service = gatt_db_add_service(db, &uuid, true, 6); // Increased size for CCCD
 
     // Service Changed characteristic with proper CCCD
     bt_uuid16_create(&uuid, 0x2A05); // Service Changed
     characteristic = gatt_db_service_add_characteristic(service, &uuid,
             BT_ATT_PERM_READ,
             BT_GATT_CHRC_PROP_INDICATE,
-            NULL, NULL, server);
+            NULL, NULL, NULL);
 
     // Add Client Characteristic Configuration Descriptor for Service Changed
     bt_uuid16_create(&uuid, 0x2902); // CCCD
     gatt_db_service_add_descriptor(characteristic, &uuid,
             BT_ATT_PERM_READ | BT_ATT_PERM_WRITE,
-            cccd_read_cb, cccd_write_cb, server);
+            cccd_read_cb, cccd_write_cb, NULL);
 
     gatt_db_service_set_active(service, true);
     printf("[DEBUG] GATT service populated with CCCD\n");
@@ -1341,7 +5724,7 @@ static void debug_uuid_conversion(const char *uuid_str, const char *context)
     printf("\n");
 }
 
-static void populate_wifi_service(struct server *server)
+static void populate_wifi_service(struct gatt_db *db)
 {
     struct gatt_db_attribute *service, *characteristic;
     bt_uuid_t uuid;
@@ -1358,8 +5741,8 @@ static void populate_wifi_service(struct server *server)
     str2uuid(LINUXBOX_SERVICE_UUID_STR, (uint8_t *)&uuid_value, 16);
     bt_uuid128_create(&uuid, uuid_value);
     
-    printf("[DEBUG] Creating WiFi service with 4 attributes\n");
-    service = gatt_db_add_service(server->db, &uuid, true, 4);
+    printf("[DEBUG] Creating WiFi service with 9 attributes\n");
+    service = gatt_db_add_service(db, &uuid, true, 9);
     if (!service) {
         printf("[ERROR] Failed to create WiFi service!\n");
         return;
@@ -1370,11 +5753,12 @@ static void populate_wifi_service(struct server *server)
     str2uuid(WIFI_CONFIG_CHAR_UUID_STR, (uint8_t *)&uuid_value, 16);
     bt_uuid128_create(&uuid, uuid_value);
     
-    printf("[DEBUG] Adding WiFi characteristic with WRITE|WRITE_NO_RESPONSE|NOTIFY properties\n");
+    printf("[DEBUG] Adding WiFi characteristic with WRITE|WRITE_NO_RESPONSE|NOTIFY|INDICATE properties\n");
     characteristic = gatt_db_service_add_characteristic(service, &uuid,
             BT_ATT_PERM_WRITE,
-            BT_GATT_CHRC_PROP_WRITE | BT_GATT_CHRC_PROP_WRITE_WITHOUT_RESP | BT_GATT_CHRC_PROP_NOTIFY,
-            NULL, wifi_config_write_cb, server);
+            BT_GATT_CHRC_PROP_WRITE | BT_GATT_CHRC_PROP_WRITE_WITHOUT_RESP |
+            BT_GATT_CHRC_PROP_NOTIFY | BT_GATT_CHRC_PROP_INDICATE,
+            NULL, wifi_config_write_cb, NULL);
     
     if (!characteristic) {
         printf("[ERROR] Failed to create WiFi characteristic!\n");
@@ -1387,14 +5771,46 @@ static void populate_wifi_service(struct server *server)
     printf("[DEBUG] Adding CCCD descriptor\n");
     if (!gatt_db_service_add_descriptor(characteristic, &uuid,
             BT_ATT_PERM_READ | BT_ATT_PERM_WRITE,
-            cccd_read_cb, cccd_write_cb, server)) {
+            cccd_read_cb, cccd_write_cb, NULL)) {
         printf("[ERROR] Failed to add CCCD descriptor!\n");
         return;
     }
     printf("[DEBUG] CCCD descriptor added successfully\n");
 
-    server->chara_att = characteristic;
-    server->chara_handle = gatt_db_attribute_get_handle(characteristic);
+    wifi_chara_att = characteristic;
+    wifi_chara_handle = gatt_db_attribute_get_handle(characteristic);
+
+    // Scan results: paged reads, notified when a new scan completes
+    str2uuid(WIFI_SCAN_CHAR_UUID_STR, (uint8_t *)&uuid_value, 16);
+    bt_uuid128_create(&uuid, uuid_value);
+    characteristic = gatt_db_service_add_characteristic(service, &uuid,
+            BT_ATT_PERM_READ | BT_ATT_PERM_WRITE,
+            BT_GATT_CHRC_PROP_READ | BT_GATT_CHRC_PROP_WRITE |
+            BT_GATT_CHRC_PROP_NOTIFY,
+            wifi_scan_read_cb, wifi_scan_write_cb, NULL);
+    if (!characteristic) {
+        printf("[ERROR] Failed to create scan results characteristic!\n");
+        return;
+    }
+
+    bt_uuid16_create(&uuid, 0x2902);
+    if (!gatt_db_service_add_descriptor(characteristic, &uuid,
+            BT_ATT_PERM_READ | BT_ATT_PERM_WRITE,
+            wifi_scan_cccd_read_cb, wifi_scan_cccd_write_cb, NULL)) {
+        printf("[ERROR] Failed to add scan results CCCD!\n");
+        return;
+    }
+    scan_chara_handle = gatt_db_attribute_get_handle(characteristic);
+
+    // Protocol version, read by apps before choosing JSON or TLV framing
+    str2uuid(PROTO_VERSION_CHAR_UUID_STR, (uint8_t *)&uuid_value, 16);
+    bt_uuid128_create(&uuid, uuid_value);
+    if (!gatt_db_service_add_characteristic(service, &uuid,
+            BT_ATT_PERM_READ, BT_GATT_CHRC_PROP_READ,
+            proto_version_read_cb, NULL, NULL)) {
+        printf("[ERROR] Failed to create protocol version characteristic!\n");
+        return;
+    }
 
     printf("[DEBUG] Activating WiFi service\n");
     if (!gatt_db_service_set_active(service, true)) {
@@ -1404,16 +5820,56 @@ static void populate_wifi_service(struct server *server)
 
 #if 0
     printf("[DEBUG] WiFi service activated successfully\n");
-    printf("[DEBUG] WiFi characteristic handle: 0x%04x\n", server->chara_handle);
+    printf("[DEBUG] WiFi characteristic handle: 0x%04x\n", wifi_chara_handle);
     printf("[DEBUG] WiFi service UUID: %s\n", LINUXBOX_SERVICE_UUID_STR);
     printf("[DEBUG] WiFi characteristic UUID: %s\n", WIFI_CONFIG_CHAR_UUID_STR);
     printf("[DEBUG] ================= WIFI SERVICE COMPLETE =================\n");
 #endif
 }
 
+/*
+ * Build the attribute database once at startup.  Every connection gets its
+ * own bt_gatt_server on top of it; per-client state (CCCD, reassembly) lives
+ * in struct server, never in the database.
+ */
+static MAIN_ONLY int gatt_db_init(void)
+{
+    gatt_db = gatt_db_new();
+    if (!gatt_db) {
+        printf("[DEBUG] Failed to create GATT database\n");
+        return -1;
+    }
+
+    printf("[DEBUG] ================== BUILDING GATT DATABASE ==================\n");
+    
+    // Populate standard services first
+    populate_gap_service(gatt_db);
+    populate_gatt_service(gatt_db);
+    
+    // Then populate our custom WiFi service
+    populate_wifi_service(gatt_db);
+#if 0
+    printf("[DEBUG] ================== GATT DATABASE COMPLETE ==================\n");
+    printf("[DEBUG] Services built:\n");
+    printf("[DEBUG] 1. GAP Service (0x1800) - Device Name & Appearance\n");
+    printf("[DEBUG] 2. GATT Service (0x1801) - Service Changed with CCCD\n");
+    printf("[DEBUG] 3. WiFi Service (%s) - WiFi Configuration\n", LINUXBOX_SERVICE_UUID_STR);
+    printf("[DEBUG] ================================================================\n");
+#endif
+    if (!wifi_chara_att) {
+        gatt_db_unref(gatt_db);
+        gatt_db = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
 static struct server *server_create(int fd)
 {
 	struct server *server;
+	struct l2cap_conninfo ci;
+	socklen_t ci_len;
 
     printf("[DEBUG] Creating server with fd: %d\n", fd);
 
@@ -1425,6 +5881,7 @@ static struct server *server_create(int fd)
 
     memset(server, 0, sizeof(*server));
     server->fd = fd;
+    session_trace_init(&server->session);
 
 	server->att = bt_att_new(fd, false);
 	if (!server->att) {
@@ -1440,270 +5897,578 @@ static struct server *server_create(int fd)
         return NULL;
     }
 
-    bt_att_register_disconnect(server->att, att_disconnect_cb, server, NULL);
+    bt_att_register_disconnect(server->att, att_disconnect_cb, server, NULL);
+    bt_att_register_exchange(server->att, att_exchange_cb, server, NULL);
+    // Clients open with either Exchange MTU or primary service discovery
+    bt_att_register(server->att, BT_ATT_OP_MTU_REQ, att_first_pdu_cb,
+                    server, NULL);
+    bt_att_register(server->att, BT_ATT_OP_READ_BY_GRP_TYPE_REQ,
+                    att_first_pdu_cb, server, NULL);
+    // Count the write opcodes next to bt_gatt_server's own handlers
+    bt_att_register(server->att, BT_ATT_OP_PREP_WRITE_REQ, att_write_pdu_cb,
+                    server, NULL);
+    bt_att_register(server->att, BT_ATT_OP_EXEC_WRITE_REQ, att_write_pdu_cb,
+                    server, NULL);
+    bt_att_register(server->att, BT_ATT_OP_WRITE_REQ, att_write_pdu_cb,
+                    server, NULL);
+    bt_att_register(server->att, BT_ATT_OP_WRITE_CMD, att_write_pdu_cb,
+                    server, NULL);
+
+    server->mtu = BT_ATT_DEFAULT_LE_MTU;
+    ci_len = sizeof(ci);
+    if (getsockopt(fd, SOL_L2CAP, L2CAP_CONNINFO, &ci, &ci_len) == 0) {
+        server->conn_handle = ci.hci_handle;
+        request_phy(server);
+    } else {
+        perror("[MTU] Failed to get L2CAP connection info");
+    }
+
+    if (verbose) {
+        bt_att_set_debug(server->att, BT_ATT_DEBUG_VERBOSE, att_debug_cb, "att: ", NULL);
+    }
+
+
+    // Accept the client's Exchange MTU up to GATT_SERVER_MAX_MTU
+	server->gatt = bt_gatt_server_new(gatt_db, server->att,
+						GATT_SERVER_MAX_MTU, 0);
+	if (!server->gatt) {
+        printf("[DEBUG] Failed to create GATT server\n");
+        bt_att_unref(server->att);
+        free(server);
+        return NULL;
+	}
+
+	if (verbose) {
+        bt_gatt_server_set_debug(server->gatt, gatt_debug_cb, "server: ", NULL);
+    }
+
+    // Initialize notification state
+    server->notifying = false;
+    server->notification_ready = false;
+    pthread_mutex_init(&server->notification_lock, NULL);
+
+    // Created disarmed; notify_queue_arm() re-arms it without allocating
+    server->notify_timer_id = mainloop_add_timeout(0, notify_timer_cb,
+                            server, NULL);
+    if (server->notify_timer_id < 0) {
+        printf("[DEBUG] Failed to create notification timer\n");
+        bt_gatt_server_unref(server->gatt);
+        bt_att_unref(server->att);
+        free(server);
+        return NULL;
+    }
+
+    // Created disarmed like the notification timer
+    server->conn_timer_id = mainloop_add_timeout(0, conn_timer_cb, server, NULL);
+    if (server->conn_timer_id < 0) {
+        printf("[DEBUG] Failed to create connection parameter timer\n");
+        mainloop_remove_timeout(server->notify_timer_id);
+        bt_gatt_server_unref(server->gatt);
+        bt_att_unref(server->att);
+        free(server);
+        return NULL;
+    }
+
+    server->exec_timer_id = mainloop_add_timeout(0, exec_timer_cb, server, NULL);
+    if (server->exec_timer_id < 0) {
+        printf("[DEBUG] Failed to create Execute Write timer\n");
+        mainloop_remove_timeout(server->conn_timer_id);
+        mainloop_remove_timeout(server->notify_timer_id);
+        bt_gatt_server_unref(server->gatt);
+        bt_att_unref(server->att);
+        free(server);
+        return NULL;
+    }
+
+    server->connected = true;
+
+    printf("[DEBUG] Server created successfully, max MTU=%d\n", GATT_SERVER_MAX_MTU);
+    return server;
+}
+
+static void server_destroy(struct server *server)
+{
+	mainloop_remove_timeout(server->notify_timer_id);
+	mainloop_remove_timeout(server->conn_timer_id);
+	mainloop_remove_timeout(server->exec_timer_id);
+	write_arena_release(&server->arena);
+	bt_gatt_server_unref(server->gatt);
+	bt_att_unref(server->att);
+	pthread_mutex_destroy(&server->notification_lock);
+	free(server);
+}
+
+
+
+static int l2cap_le_att_listen(bdaddr_t *src, int sec, uint8_t src_type)
+{
+	int sk;
+	struct sockaddr_l2 srcaddr;
+	struct bt_security btsec;
+
+	sk = socket(PF_BLUETOOTH, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC,
+								BTPROTO_L2CAP);
+	if (sk < 0) {
+		perror("Failed to create L2CAP socket");
+		return -1;
+	}
+
+	/* Set up source address */
+	memset(&srcaddr, 0, sizeof(srcaddr));
+	srcaddr.l2_family = AF_BLUETOOTH;
+	srcaddr.l2_cid = htobs(ATT_CID);
+	srcaddr.l2_bdaddr_type = src_type;
+	bacpy(&srcaddr.l2_bdaddr, src);
+	printf("\n");
+	if (bind(sk, (struct sockaddr *) &srcaddr, sizeof(srcaddr)) < 0) {
+		perror("Failed to bind L2CAP socket");
+		goto fail;
+	}
+
+	/* Set the security level */
+	memset(&btsec, 0, sizeof(btsec));
+	btsec.level = sec;
+	if (setsockopt(sk, SOL_BLUETOOTH, BT_SECURITY, &btsec,
+				sizeof(btsec)) != 0) {
+		fprintf(stderr, "Failed to set L2CAP security level\n");
+		goto fail;
+	}
+
+	if (listen(sk, 10) < 0) {
+		perror("Listening on socket failed");
+		goto fail;
+	}
+
+	printf("Started listening on ATT channel. Waiting for connections\n");
+
+	return sk;
+
+fail:
+	close(sk);
+	return -1;
+}
+
+/*
+ * Connection cycle.  The mainloop runs once for the whole process since
+ * hci_dev is registered with it.  The listening socket is created once and
+ * stays registered; connectable advertising is kept up while fewer than
+ * MAX_CONNECTIONS clients are attached, so further clients can join.
+ */
+static int listen_fd = -1;
+static struct queue *stale_servers;	// disconnected, awaiting teardown
+static int release_timeout_id;
+static int exit_status = EXIT_SUCCESS;
+
+static void listen_fail(const char *msg)
+{
+	fprintf(stderr, "%s\n", msg);
+	send_socket_command(LED_SYS_EVENT_OFF);
+	exit_status = EXIT_FAILURE;
+	should_exit = true;
+	mainloop_quit();
+}
+
+static void release_stale_server(void)
+{
+	if (release_timeout_id > 0) {
+		mainloop_remove_timeout(release_timeout_id);
+		release_timeout_id = 0;
+	}
+
+	queue_remove_all(stale_servers, NULL, NULL,
+				(queue_destroy_func_t) server_destroy);
+}
+
+static void release_timeout_cb(int timeout_id, void *user_data)
+{
+	release_stale_server();
+}
+
+static void listen_accept_cb(int fd, uint32_t events, void *user_data)
+{
+	struct server *server;
+	struct sockaddr_l2 addr;
+	socklen_t optlen;
+	char ba[18];
+	int nsk;
+
+	memset(&addr, 0, sizeof(addr));
+	optlen = sizeof(addr);
+	nsk = accept(fd, (struct sockaddr *) &addr, &optlen);
+	if (nsk < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return;
+		perror("Accept failed");
+		listen_fail("Failed to accept L2CAP ATT connection");
+		return;
+	}
+
+	ba2str(&addr.l2_bdaddr, ba);
+	printf("Connect from %s\n", ba);
+
+	if (metrics_disconnect_ms) {
+		metrics_observe(METRICS_RECONNECT_MS,
+					now_ms() - metrics_disconnect_ms);
+		metrics_disconnect_ms = 0;
+	}
+
+	// The controller stops connectable advertising once a link is up
+	advertising = false;
+
+	if (queue_length(servers) >= MAX_CONNECTIONS) {
+		printf("[MAIN] %d clients already connected, rejecting %s\n",
+						MAX_CONNECTIONS, ba);
+		close(nsk);
+		return;
+	}
+
+	release_stale_server();
+
+	printf("[MAIN] Client connected! Creating GATT server...\n");
+
+	printf("[MAIN]Create GATT server...\n");
+	server = server_create(nsk);
+	if (!server) {
+		// Drop this link only; other clients stay connected
+		fprintf(stderr, "Failed to create GATT server for %s\n", ba);
+		close(nsk);
+		start_advertising();
+		return;
+	}
+
+	queue_push_tail(servers, server);
+	reset_no_client_timeout();
+	// Discovery, MTU exchange and CCCD writes follow right away
+	conn_params_touch(server);
+	wifi_scan_set_active(true);
+
+	// Stay discoverable for the next client until the limit is reached
+	if (queue_length(servers) < MAX_CONNECTIONS)
+		start_advertising();
+	else
+		printf("[ADV] Connection limit (%d) reached, advertising paused\n",
+							MAX_CONNECTIONS);
+
+	printf("[ADV] === GATT Server Ready - Waiting for Android App ===\n");
+	printf("[ADV] Device name: %s\n", get_device_name());
+	printf("[ADV] Ready to receive WiFi configuration from Android app\n");
+	printf("[ADV] ============================================= ===\n");
+}
+
+static int listen_start(void)
+{
+	bdaddr_t src_addr;
+
+	printf("[MAIN] Create GATT server l2cap_le_att_listen ...\n");
+	// Pinned to one controller (-i), e.g. next to a virtual central
+	if (hci_index >= 0)
+		bacpy(&src_addr, &hdi.bdaddr);
+	else
+		bacpy(&src_addr, BDADDR_ANY);
+	listen_fd = l2cap_le_att_listen(&src_addr, BT_SECURITY_LOW,
+							BDADDR_LE_PUBLIC);
+	if (listen_fd < 0) {
+		fprintf(stderr, "Failed to listen on L2CAP ATT channel\n");
+		return -1;
+	}
+
+	if (mainloop_add_fd(listen_fd, EPOLLIN, listen_accept_cb,
+							NULL, NULL) < 0) {
+		fprintf(stderr, "Failed to watch L2CAP ATT channel\n");
+		close(listen_fd);
+		listen_fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+// Make the hub connectable again
+static void listen_for_client(void)
+{
+	// Start advertising before listening
+	printf("[MAIN] Starting advertising, waiting for connections...\n");
+	start_advertising();
+
+	// Start no-client timeout timer
+	reset_no_client_timeout();
+}
+
+/*
+ * Called from the disconnect path of @server.  Advertising resumes right
+ * away if it was paused at the limit; the old server is torn down from a
+ * timer rather than from inside its own bt_att callback.
+ */
+static void schedule_restart_listen(struct server *server)
+{
+	if (queue_remove(servers, server)) {
+		queue_push_tail(stale_servers, server);
+
+		if (release_timeout_id <= 0) {
+			release_timeout_id = mainloop_add_timeout(1,
+						release_timeout_cb, NULL, NULL);
+			if (release_timeout_id < 0)
+				release_timeout_id = 0;
+		}
+	}
+
+	// Disarmed: the remaining links are being dropped, stay quiet
+	if (!armed) {
+		if (queue_isempty(servers))
+			wifi_scan_set_active(false);
+		return;
+	}
+
+	// Other clients keep the service alive
+	if (!queue_isempty(servers)) {
+		start_advertising();
+		return;
+	}
+
+	wifi_scan_set_active(false);
+
+	// Check WiFi success count, if >= 1 and client disconnected automatically, exit service
+	if (wifi_success_count >= TEST_MAX_WIFI_SUCCESS_COUNT) {
+		printf("[MAIN] WiFi success count >= 1 (%d), client disconnected automatically - exiting service\n", wifi_success_count);
+		provisioning_finish();
+		return;
+	}
+
+	listen_for_client();
+}
+
+static void listen_stop(void)
+{
+	if (listen_fd < 0)
+		return;
+
+	mainloop_remove_fd(listen_fd);
+	close(listen_fd);
+	listen_fd = -1;
+}
+
+/*
+ * Resident mode (-d).
+ *
+ * The process stays up between provisioning sessions with the GATT db
+ * built, the device name resolved, the scan cache warm and the advertising
+ * payloads already on the controller.  It starts disarmed: no listen
+ * socket, no advertising.  The supervisor sends one command per connection
+ * on CONTROL_SOCKET_PATH (SOCK_SEQPACKET, root only) and gets a JSON
+ * status line back:
+ *
+ *   arm [timeout_seconds]   listen and advertise (one LE Set Advertising
+ *                           Enable), optionally overriding -t
+ *   disarm                  stop advertising and drop connected clients
+ *   status                  report only
+ *   metrics                 cumulative counters and histograms instead of
+ *                           the status line, see metrics_encode()
+ *
+ * Where a one-shot run would exit (success, no-client timeout) a resident
+ * one disarms itself and sends SETTING_WIFI_NOTIFY as the exit path does.
+ */
+#define CONTROL_SOCKET_PATH SESSION_TRACE_DIR "/control.sock"
+#define CONTROL_CMD_MAX 64
+#define CONTROL_REPLY_MAX 2048
+
+static int control_fd = -1;
+
+static void server_disconnect(void *data, void *user_data)
+{
+	struct server *server = data;
+
+	// The ATT disconnect callback releases the server as usual
+	shutdown(server->fd, SHUT_RDWR);
+}
+
+static int provisioning_arm(int timeout_seconds)
+{
+	if (armed)
+		return 0;
+
+	if (listen_start() < 0)
+		return -EIO;
+
+	printf("[CONTROL] Armed\n");
+	armed = true;
+	wifi_success_count = 0;
+	if (timeout_seconds > 0)
+		user_timeout_seconds = timeout_seconds;
+
+	send_socket_command(LED_SYS_WIFI_CONFIG_PENDING);
+	listen_for_client();
+	return 0;
+}
+
+// @notify: tell the supervisor the session is over, as exiting would
+static void provisioning_disarm(bool notify)
+{
+	if (!armed)
+		return;
 
-    if (verbose) {
-        bt_att_set_debug(server->att, BT_ATT_DEBUG_VERBOSE, att_debug_cb, "att: ", NULL);
-    }
+	printf("[CONTROL] Disarmed, %u client(s) to drop\n",
+						queue_length(servers));
+	armed = false;
 
-	server->db = gatt_db_new();
-	if (!server->db) {
-        printf("[DEBUG] Failed to create GATT DB\n");
-        bt_att_unref(server->att);
-        free(server);
-        return NULL;
+	if (no_client_timeout_id > 0) {
+		mainloop_remove_timeout(no_client_timeout_id);
+		no_client_timeout_id = 0;
 	}
 
-    // Use MTU (23) - fixed MTU value
-	server->gatt = bt_gatt_server_new(server->db, server->att, 23, 0);
-	if (!server->gatt) {
-        printf("[DEBUG] Failed to create GATT server\n");
-        gatt_db_unref(server->db);
-        bt_att_unref(server->att);
-        free(server);
-        return NULL;
-	}
+	stop_advertising();
+	listen_stop();
+	queue_foreach(servers, server_disconnect, NULL);
+	if (queue_isempty(servers))
+		wifi_scan_set_active(false);
 
-	if (verbose) {
-        bt_gatt_server_set_debug(server->gatt, gatt_debug_cb, "server: ", NULL);
-    }
+	if (notify)
+		send_socket_command(SETTING_WIFI_NOTIFY);
+}
 
-    // Initialize notification state
-    server->notifying = false;
-    server->notification_ready = false;
-    pthread_mutex_init(&server->notification_lock, NULL);
+// The session has ended on its own: exit, or go back to standby
+static void provisioning_finish(void)
+{
+	if (resident) {
+		provisioning_disarm(true);
+		return;
+	}
 
-    printf("[DEBUG] ================== BUILDING GATT DATABASE ==================\n");
-    
-    // Populate standard services first
-    populate_gap_service(server);
-    populate_gatt_service(server);
-    
-    // Then populate our custom WiFi service
-    populate_wifi_service(server);
-#if 0
-    printf("[DEBUG] ================== GATT DATABASE COMPLETE ==================\n");
-    printf("[DEBUG] Services built:\n");
-    printf("[DEBUG] 1. GAP Service (0x1800) - Device Name & Appearance\n");
-    printf("[DEBUG] 2. GATT Service (0x1801) - Service Changed with CCCD\n");
-    printf("[DEBUG] 3. WiFi Service (%s) - WiFi Configuration\n", LINUXBOX_SERVICE_UUID_STR);
-    printf("[DEBUG] ================================================================\n");
-#endif
-    printf("[DEBUG] Server created successfully with fixed MTU=23\n");
-    return server;
+	should_exit = true;
+	mainloop_quit();
 }
 
-static void server_destroy(struct server *server)
+static int control_status(char *buf, size_t size, const char *error)
 {
-	bt_gatt_server_unref(server->gatt);
-	gatt_db_unref(server->db);
+	int len;
+
+	len = snprintf(buf, size,
+		"{\"armed\":%s,\"advertising\":%s,\"clients\":%u,"
+		"\"busy\":%s,\"successes\":%d,\"timeout\":%d%s%s%s}\n",
+		armed ? "true" : "false", advertising ? "true" : "false",
+		queue_length(servers),
+		__sync_fetch_and_add(&wifi_job_workers, 0) > 0 ? "true" : "false",
+		wifi_success_count, user_timeout_seconds,
+		error ? ",\"error\":\"" : "", error ? error : "",
+		error ? "\"" : "");
+
+	return len < (int) size ? len : (int) size - 1;
 }
 
+static int control_handle(char *cmd, char *reply, size_t size)
+{
+	char *arg = strchr(cmd, ' ');
+
+	if (arg)
+		*arg++ = '\0';
+
+	printf("[CONTROL] Command: %s%s%s\n", cmd, arg ? " " : "",
+							arg ? arg : "");
+
+	if (!strcmp(cmd, "arm")) {
+		if (provisioning_arm(arg ? atoi(arg) : 0) < 0)
+			return control_status(reply, size, "listen failed");
+	} else if (!strcmp(cmd, "disarm")) {
+		provisioning_disarm(false);
+	} else if (!strcmp(cmd, "metrics")) {
+		int len = metrics_encode(reply, size);
+
+		return len < 0 ? control_status(reply, size, "reply too long") :
+									len;
+	} else if (strcmp(cmd, "status")) {
+		return control_status(reply, size, "unknown command");
+	}
 
+	return control_status(reply, size, NULL);
+}
 
-static int l2cap_le_att_listen_and_accept(bdaddr_t *src, int sec,
-		uint8_t src_type)
+static void control_client_cb(int fd, uint32_t events, void *user_data)
 {
-	int sk, nsk, i;
-	struct sockaddr_l2 srcaddr, addr;
-	socklen_t optlen;
-	struct bt_security btsec;
-	char ba[18];
+	char cmd[CONTROL_CMD_MAX], reply[CONTROL_REPLY_MAX];
+	ssize_t n;
+	int len;
 
-	sk = socket(PF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP);
-	if (sk < 0) {
-		perror("Failed to create L2CAP socket");
-		return -1;
-	}
+	n = recv(fd, cmd, sizeof(cmd) - 1, 0);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
 
-	/* Set up source address */
-	memset(&srcaddr, 0, sizeof(srcaddr));
-	srcaddr.l2_family = AF_BLUETOOTH;
-	srcaddr.l2_cid = htobs(ATT_CID);
-	srcaddr.l2_bdaddr_type = src_type;
-	bacpy(&srcaddr.l2_bdaddr, src);
-	printf("\n");
-	if (bind(sk, (struct sockaddr *) &srcaddr, sizeof(srcaddr)) < 0) {
-		perror("Failed to bind L2CAP socket");
-		goto fail;
+	if (n > 0) {
+		cmd[n] = '\0';
+		cmd[strcspn(cmd, "\r\n")] = '\0';
+		len = control_handle(cmd, reply, sizeof(reply));
+		if (send(fd, reply, len, MSG_NOSIGNAL) < 0)
+			printf("[CONTROL] Failed to reply: %s\n", strerror(errno));
 	}
 
-	/* Set the security level */
-	memset(&btsec, 0, sizeof(btsec));
-	btsec.level = sec;
-	if (setsockopt(sk, SOL_BLUETOOTH, BT_SECURITY, &btsec,
-				sizeof(btsec)) != 0) {
-		fprintf(stderr, "Failed to set L2CAP security level\n");
-		goto fail;
-	}
+	// One command per connection
+	mainloop_remove_fd(fd);
+	close(fd);
+}
 
-	if (listen(sk, 10) < 0) {
-		perror("Listening on socket failed");
-		goto fail;
+static void control_accept_cb(int fd, uint32_t events, void *user_data)
+{
+	int nsk;
+
+	nsk = accept(fd, NULL, NULL);
+	if (nsk < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+			printf("[CONTROL] Accept failed: %s\n", strerror(errno));
+		return;
 	}
 
-	printf("Started listening on ATT channel. Waiting for connections\n");
+	if (fcntl(nsk, F_SETFL, O_NONBLOCK) < 0 ||
+			fcntl(nsk, F_SETFD, FD_CLOEXEC) < 0 ||
+			mainloop_add_fd(nsk, EPOLLIN, control_client_cb,
+							NULL, NULL) < 0)
+		close(nsk);
+}
 
-	// Use select to make accept interruptible by signals
-	fd_set readfds;
-	int max_fd = sk;
-	int select_count = 0;
-	time_t start_time = time(NULL);
-	
-	printf("[SELECT] Entering select loop, should_exit = %d\n", should_exit);
-	printf("[SELECT] Starting %d-second timeout for no client connection\n", user_timeout_seconds);
-	
-	// Setup signal mask for pselect
-	sigset_t empty_mask, blocked_mask;
-	sigemptyset(&empty_mask);
-	sigemptyset(&blocked_mask);
-	sigaddset(&blocked_mask, SIGINT);
-	sigaddset(&blocked_mask, SIGTERM);
-	
-	while (!should_exit) {
-		// Check should_exit at the very beginning of each loop iteration
-		if (should_exit) {
-			printf("[SELECT] should_exit = true detected at loop start, breaking\n");
-			break;
-		}
-		
-		FD_ZERO(&readfds);
-		FD_SET(sk, &readfds);
-		
-		// Use pselect with a timeout to periodically check should_exit
-		struct timespec timeout;
-		timeout.tv_sec = 1;  // 1 second timeout
-		timeout.tv_nsec = 0;
-		
-		// Temporarily unblock signals during pselect
-		int ret = pselect(max_fd + 1, &readfds, NULL, NULL, &timeout, &empty_mask);
-		select_count++;
-		
-		// Check if we've exceeded the no-client timeout
-		time_t current_time = time(NULL);
-		if (current_time - start_time >= user_timeout_seconds) {
-			printf("[SELECT] No client connected for %d seconds, exiting...\n", user_timeout_seconds);
-			send_socket_command(LED_SYS_EVENT_OFF);
-			should_exit = true;
-			goto fail;
-		}
-		
-		if (ret < 0) {
-			if (errno == EINTR) {
-				// Interrupted by signal, check should_exit
-				printf("[SELECT] Interrupted by signal (count: %d), should_exit = %d\n", select_count, should_exit);
-				continue;
-			}
-			perror("Select failed");
-			goto fail;
-		} else if (ret == 0) {
-			// Timeout, continue to check should_exit
-			if (select_count % 10 == 0) { // Print every 10 seconds
-				printf("[SELECT] Timeout (count: %d), should_exit = %d, elapsed = %ld/%d seconds\n", 
-				       select_count, should_exit, current_time - start_time, user_timeout_seconds);
-				printf("[SELECT] Press Ctrl+C to exit immediately\n");
-			}
-			// Explicitly check should_exit after each timeout
-			if (should_exit) {
-				printf("[SELECT] should_exit detected during timeout, breaking\n");
-				break;
-			}
-			continue;
-		} else if (FD_ISSET(sk, &readfds)) {
-			// Socket is ready for accept
-			printf("[SELECT] Socket ready for accept (count: %d)\n", select_count);
-			break;
-		}
-	}
-	
-	// Check if we should exit before accepting
-	if (should_exit) {
-		printf("Exiting before accepting connection\n");
-		goto fail;
-	}
+static MAIN_ONLY int control_start(void)
+{
+	struct sockaddr_un addr;
 
-	memset(&addr, 0, sizeof(addr));
-	optlen = sizeof(addr);
-	nsk = accept(sk, (struct sockaddr *) &addr, &optlen);
-	if (nsk < 0) {
-		perror("Accept failed");
-		goto fail;
-	}
+	if (mkdir(SESSION_TRACE_DIR, 0755) < 0 && errno != EEXIST)
+		return -errno;
 
-	ba2str(&addr.l2_bdaddr, ba);
-	printf("Connect from %s\n", ba);
-	close(sk);
+	control_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK |
+						SOCK_CLOEXEC, 0);
+	if (control_fd < 0)
+		return -errno;
 
-	return nsk;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, CONTROL_SOCKET_PATH, sizeof(addr.sun_path) - 1);
+	unlink(CONTROL_SOCKET_PATH);
+
+	if (bind(control_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+			chmod(CONTROL_SOCKET_PATH, 0600) < 0 ||
+			listen(control_fd, 4) < 0 ||
+			mainloop_add_fd(control_fd, EPOLLIN, control_accept_cb,
+							NULL, NULL) < 0) {
+		int err = errno ? -errno : -EIO;
+
+		close(control_fd);
+		control_fd = -1;
+		unlink(CONTROL_SOCKET_PATH);
+		return err;
+	}
 
-fail:
-	close(sk);
-	return -1;
+	printf("[CONTROL] Listening on %s\n", CONTROL_SOCKET_PATH);
+	return 0;
 }
 
-
-// Standard signal handler function
-static void signal_handler(int signum)
+static MAIN_ONLY void control_stop(void)
 {
-    // Use write() instead of printf() as it's signal-safe
-    const char msg[] = "\n[SIGNAL] Signal received, setting should_exit = true\n";
-    write(STDOUT_FILENO, msg, sizeof(msg) - 1);
-    
-    switch (signum) {
-    case SIGINT:
-        {
-            const char sigint_msg[] = "[SIGNAL] SIGINT (Ctrl+C) received!\n";
-            write(STDOUT_FILENO, sigint_msg, sizeof(sigint_msg) - 1);
-            should_exit = true;
-            mainloop_quit();
-            break;
-        }
-    case SIGTERM:
-        {
-            const char sigterm_msg[] = "[SIGNAL] SIGTERM received!\n";
-            write(STDOUT_FILENO, sigterm_msg, sizeof(sigterm_msg) - 1);
-            
-            // Immediately stop advertising when SIGTERM is received
-            if (advertising) {
-                const char adv_msg[] = "[SIGNAL] Stopping advertising due to SIGTERM\n";
-                write(STDOUT_FILENO, adv_msg, sizeof(adv_msg) - 1);
-                
-                // Use direct HCI commands to stop advertising (signal-safe)
-                struct bt_hci_cmd_le_set_adv_enable param;
-                param.enable = 0;
-                
-                // Note: This is a simplified approach - in production, you might want
-                // to use a more robust method like writing to a pipe or using atexit()
-                int hdev = hci_get_route(NULL);
-                if (hdev >= 0) {
-                    int dd = hci_open_dev(hdev);
-                    if (dd >= 0) {
-                        struct hci_request rq;
-                        uint8_t status;
-                        memset(&rq, 0, sizeof(rq));
-                        rq.ogf = OGF_LE_CTL;
-                        rq.ocf = BT_HCI_CMD_LE_SET_ADV_ENABLE;
-                        rq.cparam = &param;
-                        rq.clen = sizeof(param);
-                        rq.rparam = &status;
-                        rq.rlen = 1;
-                        hci_send_req(dd, &rq, 1000);
-                        hci_close_dev(dd);
-                    }
-                }
-                advertising = false;
-            }
-            
-            should_exit = true;
-            mainloop_quit();
-            break;
-        }
-    default:
-        break;
-    }
+	if (control_fd < 0)
+		return;
+
+	mainloop_remove_fd(control_fd);
+	close(control_fd);
+	control_fd = -1;
+	unlink(CONTROL_SOCKET_PATH);
 }
 
-static void signal_cb(int signum, void *user_data)
+// Delivered from the mainloop's signalfd, so any call is safe here
+static MAIN_ONLY void signal_cb(int signum, void *user_data)
 {
     switch (signum) {
     case SIGINT:
@@ -1718,308 +6483,675 @@ static void signal_cb(int signum, void *user_data)
     }
 }
 
-static void send_cmd(int cmd, void *params, int params_len)
+/*
+ * All LE commands go through one raw HCI channel that stays open for the
+ * lifetime of the process.  bt_hci queues them and only releases the next
+ * one when the controller's Command Complete frees a slot, so a sequence of
+ * send_cmd() calls is pipelined in order without sleeping in between.
+ * A user channel is not used since it would detach the controller from the
+ * kernel, which still owns the L2CAP ATT socket.
+ */
+static void hci_cmd_complete_cb(const void *data, uint8_t size,
+							void *user_data)
+{
+	uint16_t opcode = PTR_TO_UINT(user_data);
+	uint8_t status = size ? ((const uint8_t *) data)[0] : 0xff;
+
+	if (status)
+		TRACE(TRACE_HCI, TRACE_ERROR, "LE cmd 0x%04x on hci%d returned status %d",
+					opcode, hdi.dev_id, status);
+	else
+		TRACE(TRACE_HCI, TRACE_DEBUG, "LE cmd 0x%04x complete", opcode);
+}
+
+// Time each command from queueing to completion, queueing included
+struct hci_cmd_timing {
+	uint16_t opcode;
+	uint64_t queued_ms;
+	bt_hci_callback_func_t cb;
+};
+
+static void hci_cmd_timed_cb(const void *data, uint8_t size, void *user_data)
 {
-	struct hci_request rq;
-	uint8_t status;
-	int dd, ret, hdev;
+	struct hci_cmd_timing *timing = user_data;
 
-	hdev = hci_get_route(NULL);
-	if (hdev < 0) {
-		perror("Could not get HCI device");
-		exit(1);
+	metrics_observe(METRICS_HCI_MS, now_ms() - timing->queued_ms);
+	timing->cb(data, size, UINT_TO_PTR(timing->opcode));
+}
+
+static bool send_cmd_cb(uint16_t opcode, const void *params,
+				uint8_t params_len, bt_hci_callback_func_t cb)
+{
+	struct hci_cmd_timing *timing;
+
+	if (!hci_dev) {
+		fprintf(stderr, "No HCI channel, dropping cmd 0x%04x\n",
+								opcode);
+		return false;
 	}
 
-	dd = hci_open_dev(hdev);
-	if (dd < 0) {
-		perror("Could not open device");
-		exit(1);
+	timing = malloc(sizeof(*timing));
+	if (!timing)
+		return false;
+	timing->opcode = opcode;
+	timing->queued_ms = now_ms();
+	timing->cb = cb;
+
+	if (!bt_hci_send(hci_dev, opcode, params, params_len,
+				hci_cmd_timed_cb, timing, free)) {
+		fprintf(stderr, "Can't queue cmd 0x%04x to hci%d\n", opcode,
+								hdi.dev_id);
+		free(timing);
+		return false;
+	}
+
+	return true;
+}
+
+static bool send_cmd(uint16_t opcode, const void *params, uint8_t params_len)
+{
+	return send_cmd_cb(opcode, params, params_len, hci_cmd_complete_cb);
+}
+
+// Record the PHY a link ended up on, whoever started the update
+static void hci_le_meta_cb(const void *data, uint8_t size, void *user_data)
+{
+	const struct bt_hci_evt_le_phy_update_complete *evt;
+	struct server *server;
+
+	if (size < 1 + sizeof(*evt) ||
+			((const uint8_t *) data)[0] != BT_HCI_EVT_LE_PHY_UPDATE_COMPLETE)
+		return;
+
+	evt = (const void *) ((const uint8_t *) data + 1);
+	server = queue_find(servers, server_match_handle,
+				UINT_TO_PTR(le16_to_cpu(evt->handle)));
+	if (!server)
+		return;
+
+	if (evt->status) {
+		TRACE(TRACE_HCI, TRACE_ERROR, "PHY update on handle 0x%04x failed: status %d",
+					server->conn_handle, evt->status);
+		return;
 	}
 
+	printf("[PHY] Handle 0x%04x now on TX %u / RX %u (1 = 1M, 2 = 2M)\n",
+			server->conn_handle, evt->tx_phy, evt->rx_phy);
+	server->session.tx_phy = evt->tx_phy;
+	server->session.rx_phy = evt->rx_phy;
+	session_mark(&server->session, SESSION_PHY_UPDATE);
+}
+
+/*
+ * Preferences for PHY updates the central starts: 2M allowed, or only 1M
+ * with -p 1m.  Links get their own LE Set PHY in request_phy().
+ */
+static void set_default_phy(void)
+{
+	struct bt_hci_cmd_le_set_default_phy cmd;
+	uint8_t phys = le_2m_phy ? LE_PHYS_1M | LE_PHYS_2M : LE_PHYS_1M;
+
+	cmd.all_phys = 0;
+	cmd.tx_phys = phys;
+	cmd.rx_phys = phys;
+	send_cmd(BT_HCI_CMD_LE_SET_DEFAULT_PHY, &cmd, sizeof(cmd));
+}
+
+/*
+ * Blocking advertising disable for the signal and atexit paths, where the
+ * mainloop that drives hci_dev is no longer running.
+ */
+static void hci_adv_disable_sync(void)
+{
+	struct bt_hci_cmd_le_set_adv_enable param;
+	struct hci_request rq;
+	uint8_t status;
+	int dd;
+
+	param.enable = 0;
+
+	dd = hci_open_dev(hdi.dev_id);
+	if (dd < 0)
+		return;
+
 	memset(&rq, 0, sizeof(rq));
 	rq.ogf = OGF_LE_CTL;
-	rq.ocf = cmd;
-	rq.cparam = params;
-	rq.clen = params_len;
+	rq.ocf = BT_HCI_CMD_LE_SET_ADV_ENABLE;
+	rq.cparam = &param;
+	rq.clen = sizeof(param);
 	rq.rparam = &status;
 	rq.rlen = 1;
+	hci_send_req(dd, &rq, 1000);
+	hci_close_dev(dd);
+}
 
-	ret = hci_send_req(dd, &rq, 1000);
+/*
+ * Device name generation, kept in step with the supervisor
+ * (SystemInfoUpdater._generate_device_name_with_retry): the board prefix
+ * from /etc/armbian-release, then the last 8 hex digits of the wlan0 MAC,
+ * else of /etc/machine-id, else "EMB".
+ *
+ * The MAC is read from sysfs (SIOCGIFHWADDR as a fallback) instead of an
+ * "ip link" pipeline.  A MAC-derived name is cached in DEVICE_NAME_CACHE so
+ * later boots can advertise before wlan0 shows up; without a cache a
+ * missing wlan0 is waited for on rtnetlink for up to WIFI_MAC_WAIT_MS.
+ */
+#define DEVICE_NAME_CACHE_DIR "/var/lib/thirdreality"
+#define DEVICE_NAME_CACHE DEVICE_NAME_CACHE_DIR "/ble_device_name"
+#define ARMBIAN_RELEASE_FILE "/etc/armbian-release"
+#define WIFI_MAC_WAIT_MS 2000
 
-done:
-	hci_close_dev(dd);
+static char device_name_cache[32] = {0};
+static bool device_name_initialized = false;
 
-	if (ret < 0) {
-		fprintf(stderr, "Can't send cmd 0x%x to hci%d: %s (%d)\n", cmd,
-				hdev, strerror(errno), errno);
-		exit(1);
-	}
+static const char *get_device_name_prefix(void)
+{
+    const char *prefix = "3RHUB-";
+    char line[128];
+    FILE *f;
 
-	if (status) {
-		fprintf(stderr,
-				"LE cmd 0x%x on hci%d returned status %d\n", cmd,
-				hdev, status);
-		exit(1);
-	}
+    f = fopen(ARMBIAN_RELEASE_FILE, "r");
+    if (!f)
+        return prefix;
+
+    while (fgets(line, sizeof(line), f)) {
+        char *value;
+
+        if (strncmp(line, "BOARD=", 6))
+            continue;
+        value = line + 6;
+        value[strcspn(value, "\r\n")] = '\0';
+        if (*value == '"' || *value == '\'') {
+            value++;
+            value[strcspn(value, "\"'")] = '\0';
+        }
+        if (!strcmp(value, "trhubv3b"))
+            prefix = "3RCARE-";
+        break;
+    }
+
+    fclose(f);
+    return prefix;
 }
 
+// Only for a real wlan0; test mode uses a fixed MAC
+#if !TEST_MAC_ADDRESS
+// Wait for wlan0 to be registered, for at most @timeout_ms
+static bool wait_for_wifi_link(int timeout_ms)
+{
+    struct sockaddr_nl addr;
+    uint64_t deadline = now_ms() + timeout_ms;
+    char buf[4096];
+    bool found = false;
+    int fd;
+
+    fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (fd < 0)
+        return if_nametoindex(WIFI_IFNAME) != 0;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = RTMGRP_LINK;
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return if_nametoindex(WIFI_IFNAME) != 0;
+    }
+
+    // Subscribed first, so a link registered from here on is not missed
+    found = if_nametoindex(WIFI_IFNAME) != 0;
+    while (!found) {
+        uint64_t now = now_ms();
+        struct timeval tv;
+        struct nlmsghdr *nh;
+        fd_set fds;
+        ssize_t len;
 
-// Device name generation - unified approach
-static char device_name_cache[32] = {0};
-static bool device_name_initialized = false;
+        if (now >= deadline)
+            break;
+        tv.tv_sec = (deadline - now) / 1000;
+        tv.tv_usec = ((deadline - now) % 1000) * 1000;
+        FD_ZERO(&fds);
+        FD_SET(fd, &fds);
+        if (select(fd + 1, &fds, NULL, NULL, &tv) <= 0)
+            break;
+
+        len = recv(fd, buf, sizeof(buf), 0);
+        if (len <= 0)
+            break;
+
+        for (nh = (struct nlmsghdr *) buf; NLMSG_OK(nh, len);
+                nh = NLMSG_NEXT(nh, len)) {
+            struct ifinfomsg *ifi = NLMSG_DATA(nh);
+            struct rtattr *rta = IFLA_RTA(ifi);
+            int rta_len = IFLA_PAYLOAD(nh);
+
+            if (nh->nlmsg_type != RTM_NEWLINK)
+                continue;
+            for (; RTA_OK(rta, rta_len); rta = RTA_NEXT(rta, rta_len)) {
+                if (rta->rta_type == IFLA_IFNAME &&
+                        !strcmp(RTA_DATA(rta), WIFI_IFNAME))
+                    found = true;
+            }
+        }
+    }
+
+    close(fd);
+    return found;
+}
+
+// Read the wlan0 MAC as 12 hex digits from sysfs, or with SIOCGIFHWADDR
+static int read_wifi_mac(char *mac_buf)
+{
+    unsigned int b[6];
+    struct ifreq ifr;
+    char line[32];
+    FILE *f;
+    int fd, i;
+
+    f = fopen("/sys/class/net/" WIFI_IFNAME "/address", "r");
+    if (f) {
+        bool ok = fgets(line, sizeof(line), f) &&
+                  sscanf(line, "%2x:%2x:%2x:%2x:%2x:%2x", &b[0], &b[1],
+                         &b[2], &b[3], &b[4], &b[5]) == 6;
+
+        fclose(f);
+        if (ok)
+            goto found;
+    }
+
+    fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -errno;
+
+    memset(&ifr, 0, sizeof(ifr));
+    snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", WIFI_IFNAME);
+    if (ioctl(fd, SIOCGIFHWADDR, &ifr) < 0) {
+        int err = -errno;
+
+        close(fd);
+        return err;
+    }
+    close(fd);
+
+    for (i = 0; i < 6; i++)
+        b[i] = (uint8_t) ifr.ifr_hwaddr.sa_data[i];
+
+found:
+    if (!(b[0] | b[1] | b[2] | b[3] | b[4] | b[5]))
+        return -ENODATA;
+
+    snprintf(mac_buf, 13, "%02X%02X%02X%02X%02X%02X",
+             b[0], b[1], b[2], b[3], b[4], b[5]);
+    return 0;
+}
+#endif
+
+static bool read_device_name_cache(char *name, size_t len)
+{
+    FILE *f = fopen(DEVICE_NAME_CACHE, "r");
+    bool ok;
+
+    if (!f)
+        return false;
+
+    ok = fgets(name, len, f) != NULL;
+    fclose(f);
+    if (!ok)
+        return false;
+
+    name[strcspn(name, "\r\n")] = '\0';
+    return name[0] != '\0';
+}
+
+static void write_device_name_cache(const char *name)
+{
+    const char *tmp = DEVICE_NAME_CACHE ".tmp";
+    FILE *f;
+
+    // Nothing else creates the directory on a device with the LED enabled
+    if (mkdir(DEVICE_NAME_CACHE_DIR, 0755) < 0 && errno != EEXIST) {
+        printf("[DEVICE_NAME] Failed to create %s: %s\n", DEVICE_NAME_CACHE_DIR,
+               strerror(errno));
+        return;
+    }
+
+    f = fopen(tmp, "w");
+    if (!f) {
+        printf("[DEVICE_NAME] Failed to cache device name: %s\n", strerror(errno));
+        return;
+    }
+
+    // On disk before the rename, so a power cut leaves the old name or the new
+    fprintf(f, "%s\n", name);
+    if (fflush(f) != 0 || fsync(fileno(f)) < 0) {
+        printf("[DEVICE_NAME] Failed to cache device name: %s\n", strerror(errno));
+        fclose(f);
+        unlink(tmp);
+        return;
+    }
+    if (fclose(f) != 0 || rename(tmp, DEVICE_NAME_CACHE) < 0) {
+        printf("[DEVICE_NAME] Failed to cache device name: %s\n", strerror(errno));
+        unlink(tmp);
+    }
+}
 
 static const char* get_device_name(void)
 {
+    const char *prefix;
+    char cached[sizeof(device_name_cache)];
+    char mac_str[13];
+    bool have_cache;
+
     if (device_name_initialized) {
         return device_name_cache;
     }
-    
-    char mac_str[18];
-    bool mac_obtained = false;
-    
+
     printf("[DEVICE_NAME] Generating device name...\n");
-    
-    // Try to get MAC address with retry logic
-    if (get_wifi_mac(mac_str) == 0 && strlen(mac_str) > 0) {
-        // Convert MAC address to uppercase
-        for (int i = 0; mac_str[i]; i++) {
-            mac_str[i] = toupper(mac_str[i]);
-        }
-        
+
+    prefix = get_device_name_prefix();
+    have_cache = read_device_name_cache(cached, sizeof(cached));
+
+    // From the cache, only probe a wlan0 that is already there
+    if (get_wifi_mac(mac_str, have_cache ? 0 : WIFI_MAC_WAIT_MS) == 0) {
         // Use only last 8 characters of MAC address, consistent with Python logic
-        size_t mac_len = strlen(mac_str);
-        if (mac_len >= 8) {
-            snprintf(device_name_cache, sizeof(device_name_cache), 
-                    "3RHUB-%s", mac_str + mac_len - 8);
-        } else {
-            snprintf(device_name_cache, sizeof(device_name_cache), 
-                    "3RHUB-%s", mac_str);
-        }
-        mac_obtained = true;
+        snprintf(device_name_cache, sizeof(device_name_cache), "%s%s",
+                 prefix, mac_str + 4);
         printf("[DEVICE_NAME] Generated from MAC: %s\n", device_name_cache);
+        if (!have_cache || strcmp(cached, device_name_cache))
+            write_device_name_cache(device_name_cache);
+    } else if (have_cache) {
+        snprintf(device_name_cache, sizeof(device_name_cache), "%s", cached);
+        printf("[DEVICE_NAME] wlan0 not up yet, using cached name: %s\n", device_name_cache);
     } else {
         // Fallback strategies
         printf("[DEVICE_NAME] MAC address not available, using fallback methods...\n");
-        
-        // Option 1: Try to get last 6 characters of machine-id
+
+        // Last 8 characters of machine-id, upper-cased
         FILE *f = fopen("/etc/machine-id", "r");
+        char machine_id[64] = {0};
+
         if (f != NULL) {
-            char machine_id[64] = {0};
-            if (fgets(machine_id, sizeof(machine_id), f) != NULL) {
-                size_t len = strlen(machine_id);
-                if (len >= 6) {
-                    // Remove newline and take last 6 characters
-                    if (machine_id[len-1] == '\n') {
-                        machine_id[len-1] = '\0';
-                        len--;
-                    }
-                    if (len >= 6) {
-                        snprintf(device_name_cache, sizeof(device_name_cache), 
-                                "3RHUB-%s", machine_id + len - 6);
-                        mac_obtained = true;
-                        printf("[DEVICE_NAME] Generated from machine-id: %s\n", device_name_cache);
-                    }
-                }
-            }
+            if (fgets(machine_id, sizeof(machine_id), f) == NULL)
+                machine_id[0] = '\0';
             fclose(f);
         }
-        
-        // Option 2: Use timestamp-based suffix if machine-id failed
-        if (!mac_obtained) {
-            time_t now = time(NULL);
-            snprintf(device_name_cache, sizeof(device_name_cache), 
-                    "3RHUB-%04lX", (unsigned long)(now & 0xFFFF));
-            printf("[DEVICE_NAME] Generated from timestamp: %s\n", device_name_cache);
+        machine_id[strcspn(machine_id, "\r\n")] = '\0';
+
+        if (strlen(machine_id) >= 8) {
+            char *suffix = machine_id + strlen(machine_id) - 8;
+
+            for (int i = 0; suffix[i]; i++)
+                suffix[i] = toupper(suffix[i]);
+            snprintf(device_name_cache, sizeof(device_name_cache), "%s%s",
+                     prefix, suffix);
+            printf("[DEVICE_NAME] Generated from machine-id: %s\n", device_name_cache);
+        } else {
+            snprintf(device_name_cache, sizeof(device_name_cache), "%sEMB", prefix);
+            printf("[DEVICE_NAME] Emergency fallback: %s\n", device_name_cache);
         }
     }
 
-    // Final validation and fallback
-    if (strlen(device_name_cache) == 0) {
-        strcpy(device_name_cache, "3RHUB-DEFAULT");
-        printf("[DEVICE_NAME] Emergency fallback: %s\n", device_name_cache);
-    }
-    
     device_name_initialized = true;
     printf("[DEVICE_NAME] Final device name: %s\n", device_name_cache);
     return device_name_cache;
 }
 
-static int get_wifi_mac(char* mac_buf)
+// Waits up to @wait_ms for wlan0 to appear; 0 only reads one already there
+static int get_wifi_mac(char* mac_buf, int wait_ms)
 {
-    int result = -1;
-    int retry_count = 0;
-    const int max_retries = 3;
-    const int retry_delay_ms = 500; // 500ms delay between retries
-
 #if TEST_MAC_ADDRESS
     // Test mode: return fixed MAC address without colons
     strcpy(mac_buf, "8C1D96B9FEEC");
     return 0;
 #else
-    
-    while (retry_count < max_retries && result != 0) {
-        if (retry_count > 0) {
-            printf("[MAC] Retry attempt %d/%d after %dms delay\n", 
-                   retry_count + 1, max_retries, retry_delay_ms);
-            usleep(retry_delay_ms * 1000); // Convert to microseconds
-        }
-        
-        FILE* f = popen("ip link show wlan0 | grep -o -E '([0-9a-fA-F]{2}:){5}[0-9a-fA-F]{2}' | tr -d ':'", "r");
-        if (f == NULL) {
-            fprintf(stderr, "[MAC] Failed to execute command (attempt %d/%d)\n", 
-                    retry_count + 1, max_retries);
-            retry_count++;
-            continue;
-        }
+    int err;
 
-        char temp_buf[20] = {0}; // Temporary buffer for validation
-        if (fgets(temp_buf, sizeof(temp_buf), f) != NULL) {
-            size_t len = strlen(temp_buf);
-            if (len > 0 && temp_buf[len - 1] == '\n') {
-                temp_buf[len - 1] = '\0';
-                len--;
-            }
-            
-            // Validate MAC address: should be exactly 12 hex characters
-            if (len == 12) {
-                bool valid = true;
-                for (int i = 0; i < 12; i++) {
-                    if (!isxdigit(temp_buf[i])) {
-                        valid = false;
-                        break;
-                    }
-                }
-                
-                if (valid) {
-                    strcpy(mac_buf, temp_buf);
-                    result = 0;
-                    printf("[MAC] Successfully obtained MAC address: %s (attempt %d/%d)\n", 
-                           mac_buf, retry_count + 1, max_retries);
-                } else {
-                    printf("[MAC] Invalid MAC format received: '%s' (attempt %d/%d)\n", 
-                           temp_buf, retry_count + 1, max_retries);
-                }
-            } else {
-                printf("[MAC] Invalid MAC length %zu, expected 12 (attempt %d/%d)\n", 
-                       len, retry_count + 1, max_retries);
-            }
-        } else {
-            printf("[MAC] No output from command (attempt %d/%d)\n", 
-                   retry_count + 1, max_retries);
-        }
+    if (wait_ms && !wait_for_wifi_link(wait_ms))
+        printf("[MAC] %s did not appear within %d ms\n", WIFI_IFNAME,
+               wait_ms);
 
-        pclose(f);
-        retry_count++;
-    }
-    
-    if (result != 0) {
-        fprintf(stderr, "[MAC] Failed to get wlan0 MAC address after %d attempts\n", max_retries);
+    err = read_wifi_mac(mac_buf);
+    if (err < 0) {
+        fprintf(stderr, "[MAC] Failed to get %s MAC address: %s\n",
+                WIFI_IFNAME, strerror(-err));
+        return -1;
     }
-    
-    return result;
+
+    printf("[MAC] Successfully obtained MAC address: %s\n", mac_buf);
+    return 0;
 #endif
 }
 
-static void set_adv_parameters(void)
-{
-	struct bt_hci_cmd_le_set_adv_parameters param;
+/*
+ * Advertising payloads.  Parameters, advertising data and scan response are
+ * built once into immutable blobs and only uploaded to the controller when
+ * they differ from what it already holds, so restarting advertising after
+ * a disconnect is a single LE Set Advertising Enable.
+ */
+static struct bt_hci_cmd_le_set_adv_parameters adv_params;
+static struct bt_hci_cmd_le_set_adv_data adv_data;
+static struct bt_hci_cmd_le_set_scan_rsp_data adv_scan_rsp;
+static bool adv_params_dirty = true;
+static bool adv_data_dirty = true;
+static bool adv_scan_rsp_dirty = true;
+static bool adv_payloads_built;
 
-    param.own_addr_type = 0x00;    /* Use public address */
-    // Use much longer intervals for maximum stability against timeouts
-	param.min_interval = cpu_to_le16(0x0100);  // 160ms for maximum stability
-	param.max_interval = cpu_to_le16(0x0200);  // 320ms for very slow but stable advertising
-    param.type = 0x00;        /* connectable no-direct advertising */
-	param.direct_addr_type = 0x00;
-	memset(param.direct_addr, 0, 6);
-	param.channel_map = 0x07;
-	param.filter_policy = 0x00;
+/*
+ * Two-stage schedule: every start_advertising() advertises at the fast
+ * interval for adv_fast_seconds (-a), then adv_stage_timer_cb() drops to
+ * the slow interval.  Only the parameters are re-sent for the switch; the
+ * controller keeps the advertising data and scan response.
+ */
+#define ADV_FAST_MIN_INTERVAL 0x0020    // 20 ms, in 0.625 ms units
+#define ADV_FAST_MAX_INTERVAL 0x0030    // 30 ms
+#define ADV_SLOW_MIN_INTERVAL 0x0100    // 160 ms
+#define ADV_SLOW_MAX_INTERVAL 0x0200    // 320 ms
+#define ADV_FAST_SECONDS 30
 
-    printf("[DEBUG] Setting advertising parameters with longer intervals for stability\n");
-	send_cmd(BT_HCI_CMD_LE_SET_ADV_PARAMETERS, (void *)&param, sizeof(param));
+static int adv_fast_seconds = ADV_FAST_SECONDS;
+static bool adv_fast_stage;
+static int adv_stage_timer_id;
+
+static void adv_build_params(void)
+{
+    memset(&adv_params, 0, sizeof(adv_params));
+    adv_params.own_addr_type = 0x00;    /* Use public address */
+    // Use much longer intervals for maximum stability against timeouts
+    adv_params.min_interval = cpu_to_le16(ADV_SLOW_MIN_INTERVAL);  // 160ms for maximum stability
+    adv_params.max_interval = cpu_to_le16(ADV_SLOW_MAX_INTERVAL);  // 320ms for very slow but stable advertising
+    adv_params.type = 0x00;        /* connectable no-direct advertising */
+    adv_params.direct_addr_type = 0x00;
+    adv_params.channel_map = 0x07;
+    adv_params.filter_policy = 0x00;
 }
 
-static void set_adv_enable(int enable)
+// Flags, the 128-bit service @uuid (as parsed by uuid_parse()) and TX power
+static void adv_encode_data(const uint8_t *uuid,
+                struct bt_hci_cmd_le_set_adv_data *adv)
 {
-    struct bt_hci_cmd_le_set_adv_enable param;
-    if (enable !=0 && enable != 1) {
-        printf("%s: invalid arg: \n", __func__, enable);
-        return;
+    memset(adv, 0, sizeof(*adv));
+
+    // Add flags
+    adv->data[adv->len++] = 2;
+    adv->data[adv->len++] = 0x01;
+    adv->data[adv->len++] = 0x04;  // LE General Discoverable Mode
+
+    // Add 128-bit service UUID
+    adv->data[adv->len++] = 17;  // Length: 1 byte type + 16 bytes UUID
+    adv->data[adv->len++] = 0x07;  // Complete List of 128-bit Service UUIDs
+    // 修正：BLE 广播包要求 UUID 用 little-endian 顺序
+    for (int i = 0; i < 16; i++) {
+        adv->data[adv->len + i] = uuid[15 - i];
     }
-    param.enable = enable;
-    send_cmd(BT_HCI_CMD_LE_SET_ADV_ENABLE, (void *)&param, sizeof(param));
+    adv->len += 16;
+
+    // Add TX power
+    adv->data[adv->len++] = 2;
+    adv->data[adv->len++] = 0x0A;
+    adv->data[adv->len++] = 0x00;
 }
 
-static void set_adv_response(void)
+/*
+ * Complete Local Name, cut to the 29 bytes a scan response has room for.
+ * Returns the number of name bytes used.
+ */
+static size_t adv_encode_scan_rsp(const char *name,
+                struct bt_hci_cmd_le_set_scan_rsp_data *rsp)
 {
-    struct bt_hci_cmd_le_set_scan_rsp_data param;
-    const char *device_name = get_device_name();
-    
-    printf("[ADV] Using unified device name: %s\n", device_name);
+    size_t name_len = strlen(name);
 
-    memset(&param, 0, sizeof(param));
-    param.len = 0;
+    memset(rsp, 0, sizeof(*rsp));
 
-    // Validate device name length for BLE advertising
-    size_t name_len = strlen(device_name);
-    if (name_len > 29) { // BLE scan response has ~31 byte limit, need 2 bytes for length+type
+    // BLE scan response has ~31 byte limit, need 2 bytes for length+type
+    if (name_len > 29)
         name_len = 29;
-        printf("[ADV] Device name truncated to %zu characters\n", name_len);
-    }
 
     // Add local name
-    param.data[param.len++] = name_len + 1;  // Length including type
-    param.data[param.len++] = 0x09;          // Complete Local Name
-    memcpy(&param.data[param.len], device_name, name_len);
-    param.len += name_len;
+    rsp->data[rsp->len++] = name_len + 1;  // Length including type
+    rsp->data[rsp->len++] = 0x09;          // Complete Local Name
+    memcpy(&rsp->data[rsp->len], name, name_len);
+    rsp->len += name_len;
+
+    return name_len;
+}
+
+static void adv_build_data(void)
+{
+    uint128_t uuid_value;
+    char hex[3 * sizeof(adv_data.data) + 1];
+
+    str2uuid(LINUXBOX_SERVICE_UUID_STR, (uint8_t *)&uuid_value, 16);
+    adv_encode_data((const uint8_t *)&uuid_value, &adv_data);
+
+    TRACE(TRACE_ADV, TRACE_DEBUG, "Advertising data (%d bytes): %s", adv_data.len,
+          trace_hex(hex, sizeof(hex), adv_data.data, adv_data.len));
+    TRACE(TRACE_ADV, TRACE_INFO, "Service UUID: %s", LINUXBOX_SERVICE_UUID_STR);
+}
+
+// Rebuild the scan response from the device name; marks it dirty on change
+static void adv_refresh_scan_rsp(void)
+{
+    struct bt_hci_cmd_le_set_scan_rsp_data param;
+    const char *device_name = get_device_name();
+    char hex[3 * sizeof(param.data) + 1];
+    size_t name_len;
+
+    name_len = adv_encode_scan_rsp(device_name, &param);
+    if (name_len < strlen(device_name))
+        printf("[ADV] Device name truncated to %zu characters\n", name_len);
+
+    if (!memcmp(&param, &adv_scan_rsp, sizeof(param)))
+        return;
+
+    adv_scan_rsp = param;
+    adv_scan_rsp_dirty = true;
+
+    TRACE(TRACE_ADV, TRACE_DEBUG, "Scan response data (%d bytes): %s", param.len,
+          trace_hex(hex, sizeof(hex), param.data, param.len));
+    TRACE(TRACE_ADV, TRACE_INFO, "Device name: %.*s (length: %zu)", (int)name_len, device_name, name_len);
+}
+
+static void adv_payloads_init(void)
+{
+    if (adv_payloads_built)
+        return;
+
+    adv_build_params();
+    adv_build_data();
+    adv_refresh_scan_rsp();
+    adv_payloads_built = true;
+}
+
+// A rejected upload is retried on the next start
+static void adv_upload_complete_cb(const void *data, uint8_t size,
+                                   void *user_data)
+{
+    uint16_t opcode = PTR_TO_UINT(user_data);
+    uint8_t status = size ? ((const uint8_t *) data)[0] : 0xff;
+
+    if (!status)
+        return;
+
+    TRACE(TRACE_ADV, TRACE_ERROR, "Advertising upload 0x%04x failed (status %d)",
+          opcode, status);
 
-    printf("[ADV] Scan response data length: %d bytes\n", param.len);
-    printf("[ADV] Scan response data: ");
-    for (int i = 0; i < param.len; i++) {
-        printf("%02X ", param.data[i]);
+    switch (opcode) {
+    case BT_HCI_CMD_LE_SET_ADV_PARAMETERS:
+        adv_params_dirty = true;
+        break;
+    case BT_HCI_CMD_LE_SET_ADV_DATA:
+        adv_data_dirty = true;
+        break;
+    case BT_HCI_CMD_LE_SET_SCAN_RSP_DATA:
+        adv_scan_rsp_dirty = true;
+        break;
     }
-    printf("\n");
-    printf("[ADV] Final device name: %.*s (length: %zu)\n", (int)name_len, device_name, name_len);
+}
+
+// Select the advertising interval; marks the parameters dirty on change
+static void adv_set_interval(bool fast)
+{
+    uint16_t min = cpu_to_le16(fast ? ADV_FAST_MIN_INTERVAL : ADV_SLOW_MIN_INTERVAL);
+    uint16_t max = cpu_to_le16(fast ? ADV_FAST_MAX_INTERVAL : ADV_SLOW_MAX_INTERVAL);
+
+    if (adv_params.min_interval == min && adv_params.max_interval == max)
+        return;
 
-    send_cmd(BT_HCI_CMD_LE_SET_SCAN_RSP_DATA, &param, sizeof(param));
+    adv_params.min_interval = min;
+    adv_params.max_interval = max;
+    adv_params_dirty = true;
 }
 
-static void set_adv_data(void)
+static void set_adv_parameters(void)
 {
-    struct bt_hci_cmd_le_set_adv_data param;
-    uint128_t uuid_value;
-    
-    memset(&param, 0, sizeof(param));
-    param.len = 0;
+    adv_payloads_init();
+    printf("[DEBUG] Setting advertising parameters with longer intervals for stability\n");
+    if (send_cmd_cb(BT_HCI_CMD_LE_SET_ADV_PARAMETERS, &adv_params,
+                    sizeof(adv_params), adv_upload_complete_cb))
+        adv_params_dirty = false;
+}
 
-    // Add flags
-    param.data[param.len++] = 2;
-    param.data[param.len++] = 0x01;
-    param.data[param.len++] = 0x04;  // LE General Discoverable Mode
+static void adv_enable_complete_cb(const void *data, uint8_t size,
+                                   void *user_data)
+{
+    uint8_t status = size ? ((const uint8_t *) data)[0] : 0xff;
 
-    // Add 128-bit service UUID
-    str2uuid(LINUXBOX_SERVICE_UUID_STR, (uint8_t *)&uuid_value, 16);
-    param.data[param.len++] = 17;  // Length: 1 byte type + 16 bytes UUID
-    param.data[param.len++] = 0x07;  // Complete List of 128-bit Service UUIDs
-    // 修正：BLE 广播包要求 UUID 用 little-endian 顺序
-    for (int i = 0; i < 16; i++) {
-        param.data[param.len + i] = ((uint8_t *)&uuid_value)[15 - i];
+    if (status) {
+        TRACE(TRACE_ADV, TRACE_ERROR, "Controller rejected advertising enable (status %d)",
+              status);
+        advertising = false;
+        return;
     }
-    param.len += 16;
 
-    // Add TX power
-    param.data[param.len++] = 2;
-    param.data[param.len++] = 0x0A;
-    param.data[param.len++] = 0x00;
+    TRACE(TRACE_ADV, TRACE_INFO, "Advertising enabled by controller");
+}
 
-    printf("Advertising data length: %d bytes\n", param.len);
-    printf("Advertising data: ");
-    for (int i = 0; i < param.len; i++) {
-        printf("%02X ", param.data[i]);
+static void set_adv_enable(int enable)
+{
+    struct bt_hci_cmd_le_set_adv_enable param;
+    if (enable !=0 && enable != 1) {
+        printf("%s: invalid arg: \n", __func__, enable);
+        return;
     }
-    printf("\n");
-    printf("Service UUID: %s\n", LINUXBOX_SERVICE_UUID_STR);
+    param.enable = enable;
+    send_cmd_cb(BT_HCI_CMD_LE_SET_ADV_ENABLE, &param, sizeof(param),
+                enable ? adv_enable_complete_cb : hci_cmd_complete_cb);
+}
+
+static void set_adv_response(void)
+{
+    adv_payloads_init();
+    if (send_cmd_cb(BT_HCI_CMD_LE_SET_SCAN_RSP_DATA, &adv_scan_rsp,
+                    sizeof(adv_scan_rsp), adv_upload_complete_cb))
+        adv_scan_rsp_dirty = false;
+}
 
-    send_cmd(BT_HCI_CMD_LE_SET_ADV_DATA, &param, sizeof(param));
+static void set_adv_data(void)
+{
+    adv_payloads_init();
+    if (send_cmd_cb(BT_HCI_CMD_LE_SET_ADV_DATA, &adv_data,
+                    sizeof(adv_data), adv_upload_complete_cb))
+        adv_data_dirty = false;
 }
 
 void ble_init(void)
@@ -2044,96 +7176,125 @@ void ble_init(void)
 
 
 
-void hci_dev_init(void)
+int hci_dev_init(void)
 {
+	int hdev;
+
 	printf("GATT server, initialize devices.\n");
 	/* Open HCI socket	*/
 	if ((ctl = socket(AF_BLUETOOTH, SOCK_RAW, BTPROTO_HCI)) < 0) {
 		perror("Can't open HCI socket.");
-		exit(1);
+		return -1;
 	}
 
-	hdi.dev_id = 0;
+	hdev = hci_index >= 0 ? hci_index : hci_get_route(NULL);
+	hdi.dev_id = hdev < 0 ? 0 : hdev;
 
 	if (ioctl(ctl, HCIGETDEVINFO, (void *) &hdi)) {
 		perror("Can't get device info");
-		exit(1);
+		return -1;
+	}
+
+	hci_dev = bt_hci_new_raw_device(hdi.dev_id);
+	if (!hci_dev) {
+		fprintf(stderr, "Can't open HCI channel on hci%d\n",
+								hdi.dev_id);
+		return -1;
 	}
 
+	bt_hci_register(hci_dev, BT_HCI_EVT_LE_META_EVENT, hci_le_meta_cb,
+								NULL, NULL);
+	set_default_phy();
+
+	return 0;
 }
 
 
+// Fast stage over: slow down without re-uploading the payloads
+static void adv_stage_timer_cb(int timeout_id, void *user_data)
+{
+    if (!advertising || !adv_fast_stage)
+        return;
+
+    adv_fast_stage = false;
+    adv_set_interval(false);
+
+    TRACE(TRACE_ADV, TRACE_INFO, "Fast advertising stage over after %d s, slowing down",
+          adv_fast_seconds);
+    set_adv_enable(0);
+    set_adv_parameters();
+    set_adv_enable(1);
+}
+
 // Advertising control functions
 static void start_advertising(void)
 {
     if (!advertising) {
         printf("[ADV] Starting advertising...\n");
-        fflush(stdout);
-        
-        // First ensure advertising is disabled
-        printf("[ADV] Disabling advertising first...\n");
-        fflush(stdout);
-        set_adv_enable(0);
-        usleep(100000); // Wait 100ms
-        
-        // Reset advertising parameters
-        printf("[ADV] Setting advertising parameters...\n");
-        fflush(stdout);
-        set_adv_parameters();
-        
-        printf("[ADV] Setting advertising data...\n");
-        fflush(stdout);
-        set_adv_data();
-        
-        printf("[ADV] Setting scan response data...\n");
-        fflush(stdout);
-        set_adv_response();
-        
-        // Enable advertising
-        printf("[ADV] Enabling advertising...\n");
-        fflush(stdout);
+
+        adv_payloads_init();
+        adv_refresh_scan_rsp();
+        adv_fast_stage = adv_fast_seconds > 0;
+        adv_set_interval(adv_fast_stage);
+
+        // Commands are queued on hci_dev and sent one after another as
+        // each Command Complete arrives; only changed payloads are
+        // uploaded, parameters can only change while advertising is off
+        if (adv_params_dirty) {
+            set_adv_enable(0);
+            set_adv_parameters();
+        }
+        if (adv_data_dirty)
+            set_adv_data();
+        if (adv_scan_rsp_dirty)
+            set_adv_response();
+
         set_adv_enable(1);
-        
-        // Wait a moment for advertising to start
-        usleep(50000); // 50ms
-        
+
         advertising = true;
-        printf("[ADV] Advertising restarted successfully\n");
+        // Re-arming restarts the fast stage of an earlier start
+        if (adv_fast_stage) {
+            if (adv_stage_timer_id <= 0)
+                adv_stage_timer_id = mainloop_add_timeout(0, adv_stage_timer_cb,
+                                                          NULL, NULL);
+            if (adv_stage_timer_id > 0)
+                mainloop_modify_timeout(adv_stage_timer_id,
+                                        adv_fast_seconds * 1000);
+        }
+        printf("[ADV] Advertising restart queued\n");
         printf("[ADV] Device should now be visible as: %s\n", get_device_name());
-        fflush(stdout);
     } else {
         printf("[ADV] Advertising already running\n");
-        fflush(stdout);
     }
 }
 
+/*
+ * Resident mode: upload parameters, data and scan response while disarmed
+ * so that arming only has to send the enable.
+ */
+static MAIN_ONLY void adv_preload(void)
+{
+    adv_payloads_init();
+    adv_refresh_scan_rsp();
+    adv_set_interval(adv_fast_seconds > 0);
+
+    set_adv_enable(0);
+    set_adv_parameters();
+    set_adv_data();
+    set_adv_response();
+}
+
+// The payloads stay on the controller for the next start
 static void stop_advertising(void)
 {
     if (advertising) {
         printf("[ADV] Stopping advertising...\n");
-        fflush(stdout);
         set_adv_enable(0);
-        usleep(50000); // 50ms
-        set_adv_enable(0); // double check
-
-        // Clear advertising data
-        struct bt_hci_cmd_le_set_adv_data adv_clear;
-        memset(&adv_clear, 0, sizeof(adv_clear));
-        adv_clear.len = 0;
-        send_cmd(BT_HCI_CMD_LE_SET_ADV_DATA, &adv_clear, sizeof(adv_clear));
-
-        // Clear scan response data
-        struct bt_hci_cmd_le_set_scan_rsp_data scan_clear;
-        memset(&scan_clear, 0, sizeof(scan_clear));
-        scan_clear.len = 0;
-        send_cmd(BT_HCI_CMD_LE_SET_SCAN_RSP_DATA, &scan_clear, sizeof(scan_clear));
 
         advertising = false;
-        printf("[ADV] Advertising stopped and data cleared\n");
-        fflush(stdout);
+        printf("[ADV] Advertising stopped\n");
     } else {
         printf("[ADV] Advertising already stopped\n");
-        fflush(stdout);
     }
 }
 
@@ -2146,8 +7307,7 @@ static void no_client_timeout_cb(int timeout_id, void *user_data)
     // Send LED off command
     send_socket_command(LED_SYS_EVENT_OFF);
     
-    should_exit = true;
-    mainloop_quit();
+    provisioning_finish();
 }
 
 // Reset timeout timer
@@ -2159,7 +7319,7 @@ static void reset_no_client_timeout(void)
     }
     
     // Only start timeout when no client connected
-    if (!client_connected) {
+    if (queue_isempty(servers)) {
         no_client_timeout_id = mainloop_add_timeout(user_timeout_seconds * 1000,
                                                    no_client_timeout_cb, NULL, NULL);
         printf("[TIMEOUT] Started %d second timeout for no client connection\n", 
@@ -2168,69 +7328,42 @@ static void reset_no_client_timeout(void)
 }
 
 // Global cleanup function for atexit
-static void cleanup_on_exit(void)
+static MAIN_ONLY void cleanup_on_exit(void)
 {
+    trace_flush();
+
     if (advertising) {
         printf("[CLEANUP] Cleaning up advertising on exit\n");
         fflush(stdout);
         
-        // Force stop advertising
-        struct bt_hci_cmd_le_set_adv_enable param;
-        param.enable = 0;
-        
-        int hdev = hci_get_route(NULL);
-        if (hdev >= 0) {
-            int dd = hci_open_dev(hdev);
-            if (dd >= 0) {
-                struct hci_request rq;
-                uint8_t status;
-                memset(&rq, 0, sizeof(rq));
-                rq.ogf = OGF_LE_CTL;
-                rq.ocf = BT_HCI_CMD_LE_SET_ADV_ENABLE;
-                rq.cparam = &param;
-                rq.clen = sizeof(param);
-                rq.rparam = &status;
-                rq.rlen = 1;
-                hci_send_req(dd, &rq, 1000);
-                hci_close_dev(dd);
-            }
-        }
+        hci_adv_disable_sync();
         advertising = false;
     }
 }
 
-// WiFi异步扫描线程
-void *wifi_rescan_thread(void *arg) {
-    printf("[WIFI] (thread) Initial WiFi rescan at startup...\n");
-    system("nmcli device wifi rescan");
-
-    sleep(5); //claude suggest 3~5 seconds
-
-    printf("[WIFI] (thread) Initial WiFi list after rescan:\n");
-    system("nmcli device wifi list ifname wlan0 > /dev/null 2>&1");
-    
-    printf("[WIFI] (thread) Initial WiFi list finished.\n");
-    return NULL;
-}
-
+/*
+ * Build with -DBTGATT_NO_MAIN to leave main() out, so a benchmark or test
+ * harness can #include this file and drive the wire-format helpers
+ * directly: notify_frames_push()/peek()/pop(), write_stream_frame_len(),
+ * write_arena_store()/consume(), uuid_parse()/uuid2str(), adv_encode_data() and
+ * adv_encode_scan_rsp(), and the wifi_tlv_ and wifi_json_ codecs.  None of
+ * them touch a server, the mainloop or HCI.
+ */
+#ifndef BTGATT_NO_MAIN
 int main(int argc, char *argv[])
 {
 
-	bdaddr_t src_addr;
-	int fd;
-	int sec = BT_SECURITY_LOW;
-	uint8_t src_type = BDADDR_LE_PUBLIC;
 	int opt;
 
 	// Register cleanup function for all exit paths
 	atexit(cleanup_on_exit);
 
-	// Set stdout to unbuffered for immediate log output
-	setvbuf(stdout, NULL, _IONBF, 0);
+	// Line-buffered stdout; hot-path records are batched by the trace ring
+	setvbuf(stdout, NULL, _IOLBF, 0);
 	setvbuf(stderr, NULL, _IONBF, 0);
 
 	// Parse command line arguments
-	while ((opt = getopt(argc, argv, "t:v")) != -1) {
+	while ((opt = getopt(argc, argv, "t:w:a:i:p:dv")) != -1) {
 		switch (opt) {
 		case 't':
 			user_timeout_seconds = atoi(optarg);
@@ -2239,13 +7372,57 @@ int main(int argc, char *argv[])
 				return EXIT_FAILURE;
 			}
 			break;
+		case 'w':
+			ip_wait_seconds = atoi(optarg);
+			if (ip_wait_seconds <= 0) {
+				fprintf(stderr, "Invalid IP wait value: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'a':
+			adv_fast_seconds = atoi(optarg);
+			if (adv_fast_seconds < 0) {
+				fprintf(stderr, "Invalid fast advertising value: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'i':
+			hci_index = atoi(strncmp(optarg, "hci", 3) ? optarg : optarg + 3);
+			if (hci_index < 0) {
+				fprintf(stderr, "Invalid controller: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'p':
+			if (!strcasecmp(optarg, "1m")) {
+				le_2m_phy = false;
+			} else if (strcasecmp(optarg, "2m")) {
+				fprintf(stderr, "Invalid PHY: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'd':
+			resident = true;
+			armed = false;
+			break;
 		case 'v':
 			verbose = true;
+			trace_level = TRACE_DEBUG;
 			break;
 		default:
-			fprintf(stderr, "Usage: %s [-t timeout_seconds] [-v]\n", argv[0]);
+			fprintf(stderr, "Usage: %s [-t timeout_seconds] [-w ip_wait_seconds] [-a fast_adv_seconds] [-i hciN] [-p 1m|2m] [-d] [-v]\n", argv[0]);
 			fprintf(stderr, "  -t timeout_seconds: Set timeout for no client connection (default: 300)\n");
-			fprintf(stderr, "  -v: Enable verbose mode\n");
+			fprintf(stderr, "  -w ip_wait_seconds: Set how long to wait for DHCP after connecting (default: %d)\n",
+					IP_WAIT_TIMEOUT_SECONDS);
+			fprintf(stderr, "  -a fast_adv_seconds: Advertise at %d-%d ms for this long after each start, then at %d-%d ms (default: %d, 0 = always slow)\n",
+					ADV_FAST_MIN_INTERVAL * 5 / 8, ADV_FAST_MAX_INTERVAL * 5 / 8,
+					ADV_SLOW_MIN_INTERVAL * 5 / 8, ADV_SLOW_MAX_INTERVAL * 5 / 8,
+					ADV_FAST_SECONDS);
+			fprintf(stderr, "  -i hciN: Use this controller (default: first one that is up)\n");
+			fprintf(stderr, "  -p 1m|2m: LE PHY to move connections to (default: 2m; 1m for controllers with bad 2M)\n");
+			fprintf(stderr, "  -d: Stay resident, armed and disarmed over %s\n",
+					CONTROL_SOCKET_PATH);
+			fprintf(stderr, "  -v: Enable verbose mode (debug tracing and ATT/GATT debug)\n");
 			return EXIT_FAILURE;
 		}
 	}
@@ -2255,33 +7432,15 @@ int main(int argc, char *argv[])
 	printf("[MAIN] Service UUID: %s\n", LINUXBOX_SERVICE_UUID_STR);
 	printf("[MAIN] Characteristic UUID: %s\n", WIFI_CONFIG_CHAR_UUID_STR);
 	printf("[MAIN] Timeout: %d seconds\n", user_timeout_seconds);
+	printf("[MAIN] IP wait: %d seconds\n", ip_wait_seconds);
+	printf("[MAIN] Fast advertising: %d seconds\n", adv_fast_seconds);
+	printf("[MAIN] LE PHY: %s\n", le_2m_phy ? "2M" : "1M");
+	printf("[MAIN] Resident: %s\n", resident ? "yes" : "no");
 	printf("[MAIN] ======================================== ===\n");
 
-	// Set signal handlers using sigaction to ensure proper interruption
-	struct sigaction sa;
-	memset(&sa, 0, sizeof(sa));
-	sa.sa_handler = signal_handler;
-	sigemptyset(&sa.sa_mask);
-	sa.sa_flags = 0;  // Do not set SA_RESTART to ensure select() is interrupted
-	
-	if (sigaction(SIGINT, &sa, NULL) == -1) {
-		perror("sigaction SIGINT");
-		return EXIT_FAILURE;
-	}
-	
-	if (sigaction(SIGTERM, &sa, NULL) == -1) {
-		perror("sigaction SIGTERM");
-		return EXIT_FAILURE;
-	}
-	
-	// Test signal handling immediately
-	printf("[SIGNAL] Signal handlers installed for SIGINT and SIGTERM\n");
-	printf("[SIGNAL] Testing signal handling - should_exit = %d\n", should_exit);
-	
-	// Test signal handling by printing current should_exit status
-	printf("[DEBUG] Initial should_exit = %d\n", should_exit);
-	
-	// Block signals except during pselect calls
+	// SIGINT/SIGTERM arrive only through the mainloop's signalfd (see
+	// signal_cb()).  Block them before any worker thread is created, since
+	// threads inherit the mask and would otherwise take the default action.
 	sigset_t blocked_signals;
 	sigemptyset(&blocked_signals);
 	sigaddset(&blocked_signals, SIGINT);
@@ -2290,124 +7449,80 @@ int main(int argc, char *argv[])
 		perror("sigprocmask");
 		return EXIT_FAILURE;
 	}
-	printf("[SIGNAL] Signals blocked except during pselect calls\n");
 
-	// Send LED command on startup
-	send_socket_command(LED_SYS_WIFI_CONFIG_PENDING);
+	// Send LED command on startup; a resident server waits for "arm"
+	if (!resident)
+		send_socket_command(LED_SYS_WIFI_CONFIG_PENDING);
 
-	// Enable verbose mode for better debugging
-	verbose = true;
 
-	// 启动时异步热点扫描
-	pthread_t rescan_tid;
-	pthread_create(&rescan_tid, NULL, wifi_rescan_thread, NULL);
+	printf("[MAIN] Create GATT server main loop ...\n");
+	mainloop_init();
+	trace_init();
 
-	hci_dev_init();
+	servers = queue_new();
+	stale_servers = queue_new();
 
-	// Main loop: continuously listen for connections
-	while (!should_exit) {
-		// Re-confirm signal handlers are still active (in case mainloop overrode them)
-		if (sigaction(SIGINT, &sa, NULL) == -1) {
-			perror("sigaction SIGINT re-install");
-		}
-		if (sigaction(SIGTERM, &sa, NULL) == -1) {
-			perror("sigaction SIGTERM re-install");
-		}
-		printf("[SIGNAL] Signal handlers re-confirmed before restart\n");
-		printf("[DEBUG] Current should_exit = %d\n", should_exit);
-		
-		// Start advertising before listening
-		printf("[MAIN] Starting advertising before listening for connections...\n");
-		fflush(stdout);
-		start_advertising();
+	// 启动时异步热点扫描, then keep the scan cache fresh
+	if (wifi_scan_init() < 0)
+		printf("[SCAN] Failed to start background scanner\n");
 
-		printf("[MAIN] Create GATT server l2cap_le_att_listen_and_accept ...\n");
-		fflush(stdout);
+	if (gatt_db_init() < 0) {
+		fprintf(stderr, "Failed to build GATT database\n");
+		send_socket_command(LED_SYS_EVENT_OFF);
+		send_socket_command(SETTING_WIFI_NOTIFY);
+		usleep(500000);
+		return EXIT_FAILURE;
+	}
 
-		bacpy(&src_addr, BDADDR_ANY);
-		fd = l2cap_le_att_listen_and_accept(&src_addr, sec, src_type);
-		if (fd < 0) {
-			fprintf(stderr, "Failed to accept L2CAP ATT connection\n");
-			send_socket_command(LED_SYS_EVENT_OFF);
+	if (hci_dev_init() < 0) {
+		fprintf(stderr, "Failed to open HCI device\n");
+		send_socket_command(LED_SYS_EVENT_OFF);
+		send_socket_command(SETTING_WIFI_NOTIFY);
+		usleep(500000);
+		return EXIT_FAILURE;
+	}
 
-            printf("[DEBUG] SETTING_WIFI_NOTIFY[1]...\n");
-			send_socket_command(SETTING_WIFI_NOTIFY);
-			usleep(500000);
+	if (resident) {
+		if (control_start() < 0) {
+			fprintf(stderr, "Failed to open control socket %s\n",
+							CONTROL_SOCKET_PATH);
 			return EXIT_FAILURE;
 		}
-
-		printf("[MAIN] Client connected! Creating GATT server...\n");
-		
-		// After client connects, stop advertising
-		stop_advertising();
-		client_connected = true;
-
-		printf("[MAIN] Create GATT server main loop ...\n");
-		mainloop_init();
-
-		printf("[MAIN]Create GATT server...\n");
-		server = server_create(fd);
-		if (!server) {
-			close(fd);
+		adv_preload();
+	} else {
+		if (listen_start() < 0) {
 			send_socket_command(LED_SYS_EVENT_OFF);
-            printf("[DEBUG] SETTING_WIFI_NOTIFY[2]...\n");
 			send_socket_command(SETTING_WIFI_NOTIFY);
 			usleep(500000);
 			return EXIT_FAILURE;
 		}
 
-		// Start no-client timeout timer (since no client is connected yet)
-		reset_no_client_timeout();
-
-		printf("[ADV] === GATT Server Ready - Waiting for Android App ===\n");
-		printf("[ADV] Device name: %s\n", get_device_name());
-		printf("[ADV] Ready to receive WiFi configuration from Android app\n");
-		printf("[ADV] No client timeout: %d seconds\n", user_timeout_seconds);
-		printf("[ADV] ============================================= ===\n");
-
-		mainloop_run_with_signal(signal_cb, NULL);
-		
-		printf("\n[MAIN] Mainloop exited, checking if should restart...\n");
-		
-		// If exiting due to signal, really exit
-		if (should_exit) {
-			printf("[MAIN] Exiting due to termination signal\n");
-			break;
-		}
-		
-		// Otherwise prepare to restart listening
-		printf("[MAIN] Preparing to restart listening for new connections...\n");
-		
-		// Check WiFi success count, if >= 1 and client disconnected automatically, exit service
-		if (wifi_success_count >= TEST_MAX_WIFI_SUCCESS_COUNT) {
-			printf("[MAIN] WiFi success count >= 1 (%d), client disconnected automatically - exiting service\n", wifi_success_count);
-			should_exit = true;
-			break;
-		}
-		
-		// Clean up current connection state
-		client_connected = false;
-		advertising = false;
-		
-		// Clean up timeout timer
-		if (no_client_timeout_id > 0) {
-			mainloop_remove_timeout(no_client_timeout_id);
-			no_client_timeout_id = 0;
-		}
-		
-		// Wait a moment before restarting
-		sleep(1);
+		listen_for_client();
 	}
 
+	printf("[ADV] No client timeout: %d seconds\n", user_timeout_seconds);
+	mainloop_run_with_signal(signal_cb, NULL);
+
 	printf("\n\n[MAIN] Shutting down...\n");
+	wifi_job_drain();
+	control_stop();
+	trace_flush();
 
-	// Clean up resources
-	if (no_client_timeout_id > 0) {
-		mainloop_remove_timeout(no_client_timeout_id);
+	// The mainloop has released hci_dev's watch, so disable synchronously
+	if (advertising) {
+		hci_adv_disable_sync();
+		advertising = false;
 	}
-	
-	stop_advertising();
-	server_destroy(server);
+
+	release_stale_server();
+	queue_destroy(stale_servers, NULL);
+	queue_destroy(servers, (queue_destroy_func_t) server_destroy);
+	servers = NULL;
+	gatt_db_unref(gatt_db);
+	gatt_db = NULL;
+	listen_stop();
+	bt_hci_unref(hci_dev);
+	hci_dev = NULL;
 	
 	// Send LED off command on exit
 	if (!should_exit) {  // Avoid duplicate sending
@@ -2417,5 +7532,6 @@ int main(int argc, char *argv[])
     printf("[DEBUG] SETTING_WIFI_NOTIFY[3]...\n");
 	send_socket_command(SETTING_WIFI_NOTIFY);
 	usleep(800000);
-	return EXIT_SUCCESS;
+	return exit_status;
 }
+#endif /* BTGATT_NO_MAIN */
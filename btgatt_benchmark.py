@@ -0,0 +1,550 @@
+#!/usr/bin/env python3.11
+"""
+btgatt-config-server Provisioning Benchmark
+
+Runs btgatt-config-server against a virtual controller pair and drives it
+with a scripted LE central, so provisioning latency can be measured without
+a phone.  Build the server with the mock WiFi backend first:
+
+    gcc ... -DWIFI_BACKEND_MOCK=1 -o btgatt-config-server-mock btgatt-server.c
+
+and create two linked virtual controllers (BlueZ emulator):
+
+    btvirt -l2          # hci0 = server, hci1 = central (or use --btvirt)
+
+Each iteration starts the server, then:
+
+    1. scans from the central until the server advertises (time-to-advertise)
+    2. connects, exchanges MTU, discovers the WiFi characteristic and
+       enables notifications (time-to-connect-ready), then disconnects
+    3. scans until the server advertises again (reconnect gap)
+    4. reconnects and writes a provisioning request, using Prepare/Execute
+       Write, Write Command or Write Request, and waits for the result
+       notification (write-to-result)
+
+The mock backend's connect and DHCP delays are set with --connect-ms and
+--dhcp-ms.  The server exits after a successful provisioning, so the next
+iteration measures a cold start again.  Requires root.
+"""
+
+import argparse
+import ctypes
+import fcntl
+import json
+import math
+import os
+import select
+import socket
+import struct
+import subprocess
+import sys
+import time
+import uuid
+
+
+SERVICE_UUID = "6e400000-0000-4e98-8024-bc5b71e0893e"
+WIFI_CONFIG_CHAR_UUID = "6e400001-0000-4e98-8024-bc5b71e0893e"
+
+# Kernel interfaces not exposed by the socket module
+BTPROTO_L2CAP = 0
+BDADDR_LE_PUBLIC = 0x01
+ATT_CID = 4
+SOL_L2CAP = 6
+L2CAP_CONNINFO = 0x02
+HCIDEVUP = 0x400448c9
+HCIGETDEVINFO = 0x800448d3
+
+# HCI
+HCI_COMMAND_PKT = 0x01
+HCI_EVENT_PKT = 0x04
+EVT_CMD_COMPLETE = 0x0e
+EVT_LE_META = 0x3e
+EVT_LE_ADVERTISING_REPORT = 0x02
+OCF_LE_SET_SCAN_PARAMETERS = 0x200b
+OCF_LE_SET_SCAN_ENABLE = 0x200c
+OCF_DISCONNECT = 0x0406
+
+# ATT
+ATT_OP_ERROR_RSP = 0x01
+ATT_OP_MTU_REQ = 0x02
+ATT_OP_MTU_RSP = 0x03
+ATT_OP_FIND_INFO_REQ = 0x04
+ATT_OP_FIND_INFO_RSP = 0x05
+ATT_OP_READ_BY_TYPE_REQ = 0x08
+ATT_OP_READ_BY_TYPE_RSP = 0x09
+ATT_OP_READ_BY_GRP_TYPE_REQ = 0x10
+ATT_OP_READ_BY_GRP_TYPE_RSP = 0x11
+ATT_OP_WRITE_REQ = 0x12
+ATT_OP_WRITE_RSP = 0x13
+ATT_OP_PREP_WRITE_REQ = 0x16
+ATT_OP_PREP_WRITE_RSP = 0x17
+ATT_OP_EXEC_WRITE_REQ = 0x18
+ATT_OP_EXEC_WRITE_RSP = 0x19
+ATT_OP_NOTIFY = 0x1b
+ATT_OP_INDICATE = 0x1d
+ATT_OP_CONFIRM = 0x1e
+ATT_OP_WRITE_CMD = 0x52
+
+GATT_PRIMARY_SERVICE = 0x2800
+GATT_CHARACTERISTIC = 0x2803
+GATT_CCCD = 0x2902
+
+# Provisioning TLV framing (see the codec in btgatt-server.c)
+WIFI_TLV_VERSION = 0x01
+WIFI_TLV_MSG_CONNECT = 0x01
+WIFI_TLV_TAG_SSID = 0x01
+WIFI_TLV_TAG_PSK = 0x02
+
+WRITE_VARIANTS = ("prepare", "cmd", "req")
+
+libc = ctypes.CDLL(None, use_errno=True)
+
+
+def format_bdaddr(raw):
+    """Format a little-endian bdaddr_t as AA:BB:CC:DD:EE:FF"""
+    return ":".join(f"{b:02X}" for b in reversed(raw))
+
+
+def crc16_ccitt(data):
+    crc = 0xffff
+    for byte in data:
+        crc ^= byte << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else (crc << 1)
+            crc &= 0xffff
+    return crc
+
+
+def build_request(proto, ssid, password, seq):
+    """Encode one provisioning request; JSON is '\\n' terminated"""
+    if proto == "json":
+        return (json.dumps({"ssid": ssid, "pw": password}) + "\n").encode()
+
+    items = b""
+    for tag, value in ((WIFI_TLV_TAG_SSID, ssid), (WIFI_TLV_TAG_PSK, password)):
+        value = value.encode()
+        items += bytes([tag, len(value)]) + value
+    frame = struct.pack("<BBBH", WIFI_TLV_VERSION, WIFI_TLV_MSG_CONNECT, seq, len(items)) + items
+    return frame + struct.pack("<H", crc16_ccitt(frame))
+
+
+def result_complete(proto, data):
+    """True once the notified bytes hold a whole result"""
+    if proto == "tlv":
+        return len(data) >= 5 and len(data) >= 5 + struct.unpack_from("<H", data, 3)[0] + 2
+    # Short results come in one notification, longer ones end with '\n'
+    if data.endswith(b"\n"):
+        return True
+    try:
+        json.loads(data.decode())
+        return True
+    except ValueError:
+        return False
+
+
+class HciDevice:
+    """Raw HCI socket on the central controller: scanning and disconnects"""
+
+    def __init__(self, dev_id):
+        self.dev_id = dev_id
+        self.sock = socket.socket(socket.AF_BLUETOOTH, socket.SOCK_RAW, socket.BTPROTO_HCI)
+        self.sock.bind((dev_id,))
+        # Event packets only: Command Complete and LE Meta
+        event_mask = (1 << EVT_CMD_COMPLETE) | (1 << EVT_LE_META)
+        hci_filter = struct.pack("<IIIH", 1 << HCI_EVENT_PKT,
+                                 event_mask & 0xffffffff, event_mask >> 32, 0)
+        self.sock.setsockopt(socket.SOL_HCI, socket.HCI_FILTER, hci_filter)
+
+    def close(self):
+        self.sock.close()
+
+    def power_on(self):
+        try:
+            fcntl.ioctl(self.sock.fileno(), HCIDEVUP, self.dev_id)
+        except OSError as e:
+            if e.errno != 114:  # EALREADY
+                raise
+
+    def address(self):
+        buf = bytearray(128)
+        struct.pack_into("<H", buf, 0, self.dev_id)
+        fcntl.ioctl(self.sock.fileno(), HCIGETDEVINFO, buf)
+        return bytes(buf[10:16])
+
+    def send_cmd(self, opcode, params=b""):
+        self.sock.send(struct.pack("<BHB", HCI_COMMAND_PKT, opcode, len(params)) + params)
+        deadline = time.monotonic() + 2
+        while time.monotonic() < deadline:
+            pkt = self._recv(deadline)
+            if pkt and pkt[1] == EVT_CMD_COMPLETE and struct.unpack_from("<H", pkt, 4)[0] == opcode:
+                return pkt[6] if len(pkt) > 6 else 0
+        raise TimeoutError(f"HCI command 0x{opcode:04x} timed out")
+
+    def _recv(self, deadline):
+        timeout = max(0, deadline - time.monotonic())
+        if not select.select([self.sock], [], [], timeout)[0]:
+            return None
+        return self.sock.recv(260)
+
+    def wait_for_advertising(self, bdaddr, timeout):
+        """Passive scan until @bdaddr advertises; returns the monotonic time seen"""
+        self.send_cmd(OCF_LE_SET_SCAN_ENABLE, bytes([0x00, 0x00]))
+        self.send_cmd(OCF_LE_SET_SCAN_PARAMETERS, struct.pack("<BHHBB", 0x00, 0x0010, 0x0010, 0x00, 0x00))
+        self.send_cmd(OCF_LE_SET_SCAN_ENABLE, bytes([0x01, 0x00]))
+        try:
+            deadline = time.monotonic() + timeout
+            while time.monotonic() < deadline:
+                pkt = self._recv(deadline)
+                if not pkt or pkt[1] != EVT_LE_META or pkt[3] != EVT_LE_ADVERTISING_REPORT:
+                    continue
+                # num_reports, then event_type, addr_type, addr[6], ...
+                if pkt[4] >= 1 and pkt[7:13] == bdaddr:
+                    return time.monotonic()
+            raise TimeoutError("server did not advertise")
+        finally:
+            self.send_cmd(OCF_LE_SET_SCAN_ENABLE, bytes([0x00, 0x00]))
+
+    def disconnect(self, handle):
+        # Disconnect Complete is not awaited, the scan that follows covers it
+        self.sock.send(struct.pack("<BHBHB", HCI_COMMAND_PKT, OCF_DISCONNECT, 3, handle, 0x13))
+
+
+class AttClient:
+    """Minimal ATT client over an LE L2CAP socket on the fixed ATT channel"""
+
+    def __init__(self, src, dst, timeout=10):
+        self.timeout = timeout
+        self.mtu = 23
+        self.notifications = []
+        self.fd = libc.socket(socket.AF_BLUETOOTH, socket.SOCK_SEQPACKET, BTPROTO_L2CAP)
+        if self.fd < 0:
+            raise OSError(ctypes.get_errno(), "socket")
+        try:
+            self._sockaddr_call(libc.bind, src)
+            self._sockaddr_call(libc.connect, dst)
+        except OSError:
+            os.close(self.fd)
+            raise
+
+    def _sockaddr_call(self, func, bdaddr):
+        addr = struct.pack("<HH6sHBx", socket.AF_BLUETOOTH, 0, bdaddr, ATT_CID, BDADDR_LE_PUBLIC)
+        if func(self.fd, ctypes.c_char_p(addr), len(addr)) < 0:
+            err = ctypes.get_errno()
+            raise OSError(err, os.strerror(err))
+
+    def conn_handle(self):
+        buf = ctypes.create_string_buffer(8)
+        size = ctypes.c_uint32(len(buf))
+        if libc.getsockopt(self.fd, SOL_L2CAP, L2CAP_CONNINFO, buf, ctypes.byref(size)) < 0:
+            return None
+        return struct.unpack_from("<H", buf.raw)[0]
+
+    def close(self):
+        if self.fd >= 0:
+            os.close(self.fd)
+            self.fd = -1
+
+    def send(self, pdu):
+        os.write(self.fd, pdu)
+
+    def recv(self, deadline):
+        """Next PDU that is not a notification/indication, queuing those"""
+        while True:
+            timeout = deadline - time.monotonic()
+            if timeout <= 0 or not select.select([self.fd], [], [], timeout)[0]:
+                raise TimeoutError("ATT response timed out")
+            pdu = os.read(self.fd, 1024)
+            if not pdu:
+                raise ConnectionError("ATT channel closed")
+            if pdu[0] in (ATT_OP_NOTIFY, ATT_OP_INDICATE):
+                if pdu[0] == ATT_OP_INDICATE:
+                    self.send(bytes([ATT_OP_CONFIRM]))
+                self.notifications.append((struct.unpack_from("<H", pdu, 1)[0], pdu[3:]))
+                return None
+            return pdu
+
+    def request(self, pdu, rsp_opcode):
+        self.send(pdu)
+        deadline = time.monotonic() + self.timeout
+        while True:
+            rsp = self.recv(deadline)
+            if rsp is None:
+                continue
+            if rsp[0] == rsp_opcode:
+                return rsp
+            if rsp[0] == ATT_OP_ERROR_RSP:
+                return None
+            raise ConnectionError(f"unexpected ATT opcode 0x{rsp[0]:02x}")
+
+    def exchange_mtu(self, mtu):
+        rsp = self.request(struct.pack("<BH", ATT_OP_MTU_REQ, mtu), ATT_OP_MTU_RSP)
+        if rsp:
+            self.mtu = min(mtu, struct.unpack_from("<H", rsp, 1)[0])
+        return self.mtu
+
+    def find_service(self, service_uuid):
+        target = uuid.UUID(service_uuid).bytes[::-1]
+        start = 1
+        while start <= 0xffff:
+            rsp = self.request(struct.pack("<BHHH", ATT_OP_READ_BY_GRP_TYPE_REQ, start, 0xffff,
+                                           GATT_PRIMARY_SERVICE), ATT_OP_READ_BY_GRP_TYPE_RSP)
+            if not rsp:
+                break
+            item_len = rsp[1]
+            for off in range(2, len(rsp) - item_len + 1, item_len):
+                handle, end = struct.unpack_from("<HH", rsp, off)
+                if rsp[off + 4:off + item_len] == target:
+                    return handle, end
+                start = end + 1
+        raise LookupError(f"service {service_uuid} not found")
+
+    def find_characteristic(self, service_range, char_uuid):
+        """Returns (value_handle, cccd_handle) of @char_uuid"""
+        target = uuid.UUID(char_uuid).bytes[::-1]
+        start, end = service_range
+        chars = []
+        while start <= end:
+            rsp = self.request(struct.pack("<BHHH", ATT_OP_READ_BY_TYPE_REQ, start, end,
+                                           GATT_CHARACTERISTIC), ATT_OP_READ_BY_TYPE_RSP)
+            if not rsp:
+                break
+            item_len = rsp[1]
+            for off in range(2, len(rsp) - item_len + 1, item_len):
+                decl = struct.unpack_from("<H", rsp, off)[0]
+                value = struct.unpack_from("<H", rsp, off + 3)[0]
+                chars.append((decl, value, rsp[off + 5:off + item_len]))
+                start = decl + 1
+
+        for i, (decl, value, char) in enumerate(chars):
+            if char != target:
+                continue
+            last = chars[i + 1][0] - 1 if i + 1 < len(chars) else end
+            rsp = self.request(struct.pack("<BHH", ATT_OP_FIND_INFO_REQ, value + 1, last),
+                               ATT_OP_FIND_INFO_RSP)
+            if rsp and rsp[1] == 0x01:
+                for off in range(2, len(rsp) - 3, 4):
+                    handle, desc = struct.unpack_from("<HH", rsp, off)
+                    if desc == GATT_CCCD:
+                        return value, handle
+            raise LookupError(f"{char_uuid} has no CCCD")
+        raise LookupError(f"characteristic {char_uuid} not found")
+
+    def write(self, handle, data):
+        return self.request(struct.pack("<BH", ATT_OP_WRITE_REQ, handle) + data, ATT_OP_WRITE_RSP) is not None
+
+    def write_long(self, variant, handle, data):
+        """Send @data using one of WRITE_VARIANTS"""
+        if variant == "req":
+            if len(data) > self.mtu - 3:
+                raise ValueError(f"request of {len(data)} bytes does not fit MTU {self.mtu}")
+            return self.write(handle, data)
+
+        if variant == "cmd":
+            chunk = self.mtu - 3
+            for off in range(0, len(data), chunk):
+                self.send(struct.pack("<BH", ATT_OP_WRITE_CMD, handle) + data[off:off + chunk])
+            return True
+
+        chunk = self.mtu - 5
+        for off in range(0, len(data), chunk):
+            if not self.request(struct.pack("<BHH", ATT_OP_PREP_WRITE_REQ, handle, off) + data[off:off + chunk],
+                                ATT_OP_PREP_WRITE_RSP):
+                return False
+        return self.request(bytes([ATT_OP_EXEC_WRITE_REQ, 0x01]), ATT_OP_EXEC_WRITE_RSP) is not None
+
+    def wait_result(self, handle, proto, timeout):
+        data = b""
+        deadline = time.monotonic() + timeout
+        while True:
+            while self.notifications:
+                notified_handle, value = self.notifications.pop(0)
+                if notified_handle == handle:
+                    data += value
+            if data and result_complete(proto, data):
+                return data
+            try:
+                pdu = self.recv(deadline)
+            except TimeoutError:
+                raise TimeoutError("no provisioning result notified")
+            if pdu is not None:
+                raise ConnectionError(f"unexpected ATT opcode 0x{pdu[0]:02x}")
+
+
+def percentile(values, pct):
+    """Nearest-rank percentile"""
+    ordered = sorted(values)
+    rank = max(1, math.ceil(pct / 100.0 * len(ordered)))
+    return ordered[rank - 1]
+
+
+def connect_ready(central, central_addr, server_addr, mtu):
+    """Connect, exchange MTU, find the WiFi characteristic and enable notifications"""
+    client = AttClient(central_addr, server_addr)
+    try:
+        client.exchange_mtu(mtu)
+        service = client.find_service(SERVICE_UUID)
+        value_handle, cccd_handle = client.find_characteristic(service, WIFI_CONFIG_CHAR_UUID)
+        if not client.write(cccd_handle, struct.pack("<H", 0x0001)):
+            raise ConnectionError("CCCD write rejected")
+    except Exception:
+        client.close()
+        raise
+    return client, value_handle
+
+
+def disconnect(central, client):
+    handle = client.conn_handle()
+    client.close()
+    if handle is not None:
+        central.disconnect(handle)
+    return time.monotonic()
+
+
+def run_iteration(args, central, central_addr, server_addr, variant, seq, log):
+    env = dict(os.environ,
+               BTGATT_MOCK_CONNECT_MS=str(args.connect_ms),
+               BTGATT_MOCK_DHCP_MS=str(args.dhcp_ms))
+    started = time.monotonic()
+    server = subprocess.Popen([args.server, "-i", args.server_hci, "-t", "600"],
+                              stdout=log, stderr=subprocess.STDOUT, env=env)
+    sample = {}
+    try:
+        seen = central.wait_for_advertising(server_addr, args.timeout)
+        sample["time_to_advertise"] = seen - started
+
+        t0 = time.monotonic()
+        client, _ = connect_ready(central, central_addr, server_addr, args.mtu)
+        sample["time_to_connect_ready"] = time.monotonic() - t0
+        dropped = disconnect(central, client)
+
+        seen = central.wait_for_advertising(server_addr, args.timeout)
+        sample["reconnect_gap"] = seen - dropped
+
+        client, value_handle = connect_ready(central, central_addr, server_addr, args.mtu)
+        try:
+            request = build_request(args.proto, args.ssid, args.password, seq & 0xff)
+            t0 = time.monotonic()
+            if not client.write_long(variant, value_handle, request):
+                raise ConnectionError(f"{variant} write rejected")
+            result = client.wait_result(value_handle, args.proto, args.timeout + args.dhcp_ms / 1000.0)
+            sample["write_to_result"] = time.monotonic() - t0
+            sample["result"] = result.hex() if args.proto == "tlv" else result.decode(errors="replace").strip()
+        finally:
+            disconnect(central, client)
+
+        server.wait(timeout=args.timeout)
+    finally:
+        if server.poll() is None:
+            server.terminate()
+            try:
+                server.wait(timeout=5)
+            except subprocess.TimeoutExpired:
+                server.kill()
+                server.wait()
+    return sample
+
+
+def parse_hci(name):
+    return int(name[3:] if name.startswith("hci") else name)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Benchmark btgatt-config-server on virtual controllers")
+    parser.add_argument("--server", default="./btgatt-config-server-mock",
+                        help="server binary built with -DWIFI_BACKEND_MOCK=1")
+    parser.add_argument("--server-hci", default="hci0", help="controller the server runs on")
+    parser.add_argument("--central-hci", default="hci1", help="controller the scripted central uses")
+    parser.add_argument("--btvirt", action="store_true", help="start 'btvirt -l2' for the run")
+    parser.add_argument("-n", "--iterations", type=int, default=20)
+    parser.add_argument("--variant", choices=WRITE_VARIANTS + ("all",), default="all",
+                        help="write procedure; 'all' rotates through them")
+    parser.add_argument("--proto", choices=("json", "tlv"), default="json")
+    parser.add_argument("--mtu", type=int, default=247, help="ATT MTU the central requests")
+    parser.add_argument("--connect-ms", type=int, default=1000, help="mock backend connect delay")
+    parser.add_argument("--dhcp-ms", type=int, default=2000, help="mock backend DHCP delay")
+    parser.add_argument("--ssid", default="bench-ap")
+    parser.add_argument("--password", default="benchmark")
+    parser.add_argument("--timeout", type=float, default=20.0, help="per-step timeout in seconds")
+    parser.add_argument("--log", default="btgatt_benchmark.log", help="server output")
+    parser.add_argument("--json", action="store_true", help="print the report as JSON")
+    args = parser.parse_args()
+
+    if os.geteuid() != 0:
+        print("This benchmark must be run as root")
+        sys.exit(1)
+
+    btvirt = None
+    if args.btvirt:
+        btvirt = subprocess.Popen(["btvirt", "-l2"], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        time.sleep(1)
+
+    central = None
+    samples = []
+    failures = 0
+    try:
+        server_dev = HciDevice(parse_hci(args.server_hci))
+        server_dev.power_on()
+        server_addr = server_dev.address()
+        server_dev.close()
+
+        central = HciDevice(parse_hci(args.central_hci))
+        central.power_on()
+        central_addr = central.address()
+        print(f"Server {args.server_hci} {format_bdaddr(server_addr)}, "
+              f"central {args.central_hci} {format_bdaddr(central_addr)}")
+
+        variants = WRITE_VARIANTS if args.variant == "all" else (args.variant,)
+        with open(args.log, "a") as log:
+            for i in range(args.iterations):
+                variant = variants[i % len(variants)]
+                try:
+                    sample = run_iteration(args, central, central_addr, server_addr, variant, i, log)
+                except (OSError, TimeoutError, subprocess.TimeoutExpired, ConnectionError,
+                        LookupError, ValueError) as e:
+                    failures += 1
+                    print(f"[{i + 1}/{args.iterations}] {variant}: FAILED: {e}")
+                    continue
+                sample["variant"] = variant
+                samples.append(sample)
+                print(f"[{i + 1}/{args.iterations}] {variant}: "
+                      f"advertise {sample['time_to_advertise'] * 1000:.0f} ms, "
+                      f"ready {sample['time_to_connect_ready'] * 1000:.0f} ms, "
+                      f"gap {sample['reconnect_gap'] * 1000:.0f} ms, "
+                      f"result {sample['write_to_result'] * 1000:.0f} ms ({sample['result']})")
+    finally:
+        if central:
+            central.close()
+        if btvirt:
+            btvirt.terminate()
+            btvirt.wait()
+
+    metrics = ("time_to_advertise", "time_to_connect_ready", "write_to_result", "reconnect_gap")
+    report = {"iterations": args.iterations, "failures": failures,
+              "connect_ms": args.connect_ms, "dhcp_ms": args.dhcp_ms, "proto": args.proto, "metrics": {}}
+    groups = [("all", samples)]
+    if args.variant == "all":
+        groups += [(v, [s for s in samples if s["variant"] == v]) for v in WRITE_VARIANTS]
+    for name, group in groups:
+        if not group:
+            continue
+        for metric in metrics:
+            values = [s[metric] * 1000 for s in group]
+            report["metrics"].setdefault(name, {})[metric] = {
+                "p50": percentile(values, 50), "p90": percentile(values, 90),
+                "p99": percentile(values, 99), "max": max(values), "count": len(values)}
+
+    if args.json:
+        print(json.dumps(report, indent=2))
+        return
+
+    print(f"\n{len(samples)} of {args.iterations} iterations succeeded "
+          f"(mock connect {args.connect_ms} ms, DHCP {args.dhcp_ms} ms, {args.proto})")
+    for name, group in report["metrics"].items():
+        print(f"\n[{name}]  {'p50':>8} {'p90':>8} {'p99':>8} {'max':>8}  (ms)")
+        for metric in metrics:
+            m = group[metric]
+            print(f"{metric:<22} {m['p50']:8.1f} {m['p90']:8.1f} {m['p99']:8.1f} {m['max']:8.1f}")
+
+
+if __name__ == "__main__":
+    main()
@@ -5,6 +5,8 @@ Unified management of internal and external GATT servers
 """
 
 import os
+import json
+import socket
 import subprocess
 import threading
 import time
@@ -14,6 +16,8 @@ from ..const import (
     BLE_GATT_SERVER_MODE, 
     EXTERNAL_GATT_SERVICE_NAME, 
     EXTERNAL_GATT_BINARY_PATH,
+    EXTERNAL_GATT_CONTROL_SOCKET,
+    EXTERNAL_GATT_CONTROL_REPLY_MAX,
     GATT_SERVER_TIMEOUT_SECONDS
 )
 from .gatt_server import SupervisorGattServer
@@ -35,6 +39,11 @@ class GattServerManager:
         
         self.logger.info(f"[GATT Manager] Initialized with mode: {self.mode}")
 
+        # Load the resident external server now so that the first
+        # provisioning request only has to arm it
+        if self.mode == "external":
+            threading.Thread(target=self._warm_external_service, daemon=True).start()
+
     def _determine_mode(self):
         """Determine which GATT server mode to use"""
         if BLE_GATT_SERVER_MODE == "external":
@@ -194,6 +203,59 @@ class GattServerManager:
         self._bluetooth_was_enabled = None
         return True
 
+    def _external_control(self, command, timeout=3.0):
+        """Send one command to the resident external server, return its status dict or None"""
+        try:
+            with socket.socket(socket.AF_UNIX, socket.SOCK_SEQPACKET) as sock:
+                sock.settimeout(timeout)
+                sock.connect(EXTERNAL_GATT_CONTROL_SOCKET)
+                sock.send(command.encode())
+                status = json.loads(sock.recv(EXTERNAL_GATT_CONTROL_REPLY_MAX).decode())
+        except (OSError, ValueError) as e:
+            self.logger.debug(f"External GATT control '{command}' failed: {e}")
+            return None
+        if status.get("error"):
+            self.logger.warning(f"External GATT control '{command}': {status['error']}")
+        return status
+
+    def _wait_external_control(self, timeout=5.0):
+        """Wait for a freshly started external server to open its control socket"""
+        deadline = time.monotonic() + timeout
+        while time.monotonic() < deadline:
+            status = self._external_control("status")
+            if status is not None:
+                return status
+            time.sleep(0.1)
+        return None
+
+    def _warm_external_service(self):
+        """Start the external service disarmed, without touching bluetooth.service"""
+        try:
+            if self._external_control("status") is not None:
+                return
+            result = subprocess.run(
+                ['/bin/systemctl', 'start', EXTERNAL_GATT_SERVICE_NAME],
+                capture_output=True, text=True, timeout=10
+            )
+            if result.returncode != 0:
+                self.logger.warning(f"Failed to pre-start external service: {result.stderr}")
+                return
+            if self._wait_external_control() is not None:
+                self.logger.info("External GATT service resident and disarmed")
+            else:
+                self.logger.info("External GATT service has no control socket, using one-shot mode")
+        except Exception as e:
+            self.logger.warning(f"Error pre-starting external service: {e}")
+
+    def _arm_external_service(self):
+        """Arm the resident external server, True once it is advertising"""
+        status = self._external_control("arm")
+        if status is None or not status.get("armed"):
+            return False
+        self.logger.info("External GATT service armed")
+        self._start_timeout_timer()
+        return True
+
     def _start_external_service(self):
         """Start external GATT service"""
         try:
@@ -201,6 +263,10 @@ class GattServerManager:
             if hasattr(self.supervisor, 'set_led_state'):
                 self.supervisor.set_led_state(LedState.SYS_WIFI_CONFIG_PENDING)
                 self.logger.info("Set LED to provisioning mode")
+
+            # Warm standby: a single advertising enable, no restarts
+            if self._arm_external_service():
+                return True
             
             # Need to restart bluetooth service before starting external service (tentative)
             self.logger.info("Restarting bluetooth service before starting external GATT service...")
@@ -232,6 +298,14 @@ class GattServerManager:
                 return False
                 
             self.logger.info("External GATT service started successfully")
+            # A resident server starts disarmed; a one-shot one is already advertising
+            if self._wait_external_control() is not None:
+                if self._arm_external_service():
+                    return True
+                self.logger.error("External GATT service did not arm")
+                if hasattr(self.supervisor, 'set_led_state'):
+                    self.supervisor.set_led_state(LedState.SYS_WIFI_CONFIG_STOPPED)
+                return False
             self._start_timeout_timer()
             return True
         except Exception as e:
@@ -246,6 +320,12 @@ class GattServerManager:
 
     def _stop_external_service(self):
         """Stop external GATT service"""
+        # A resident server goes back to standby instead of exiting
+        status = self._external_control("disarm")
+        if status is not None and not status.get("armed"):
+            self.logger.info("External GATT service disarmed")
+            return
+
         try:
             # Try normal stop first
             result = subprocess.run(
@@ -373,6 +453,12 @@ class GattServerManager:
             # stop_thread = threading.Thread(target=delayed_stop, daemon=True)
             # stop_thread.start()
 
+    def get_metrics(self):
+        """Cumulative counters and histograms of the resident external server, or None"""
+        if self.mode != "external":
+            return None
+        return self._external_control("metrics", timeout=1.0)
+
     def startAdv(self):
         """Start BLE advertisement"""
         if self.mode == "internal" and self.gatt_server:
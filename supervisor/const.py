@@ -38,6 +38,12 @@ BLE_GATT_SERVER_MODE = "auto"
 # External GATT server configuration
 EXTERNAL_GATT_SERVICE_NAME = "btgatt-config.service"
 EXTERNAL_GATT_BINARY_PATH = "/usr/local/bin/btgatt-config-server"
+# Per-connection latency traces appended by btgatt-config-server (JSON lines)
+EXTERNAL_GATT_SESSION_TRACE_FILE = "/run/btgatt-server/sessions.log"
+# Control socket of the resident (-d) btgatt-config-server: arm/disarm/status/metrics
+EXTERNAL_GATT_CONTROL_SOCKET = "/run/btgatt-server/control.sock"
+# Largest control reply (CONTROL_REPLY_MAX in btgatt-server.c)
+EXTERNAL_GATT_CONTROL_REPLY_MAX = 2048
 
 # GATT server timeout configuration (minutes)
 GATT_SERVER_TIMEOUT_SECONDS = 300
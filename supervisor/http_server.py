@@ -26,7 +26,7 @@ from .utils import util
 from .hardware import LedState
 from . import const
 
-from .sysinfo import get_package_version
+from .sysinfo import get_package_version, get_ble_session_traces
 
 # Static files directory
 STATIC_DIR = os.path.join(os.path.dirname(__file__), 'static')
@@ -188,6 +188,10 @@ class SupervisorHTTPServer:
                         self._handle_file_download(query_params)
                     elif path == "/api/setting/info":
                         self._handle_setting_info()
+                    elif path == "/api/ble/sessions":
+                        self._handle_ble_sessions(query_params)
+                    elif path == "/api/ble/metrics":
+                        self._handle_ble_metrics()
                     elif path == "/api/health" or path == "/health":
                         # Handle health check request
                         self._handle_health_check()
@@ -709,6 +713,31 @@ class SupervisorHTTPServer:
                     self.end_headers()
                     self.wfile.write(json.dumps({"error": str(e)}).encode())
             
+            def _handle_ble_sessions(self, query_params):
+                """Handle GET /api/ble/sessions?limit=N - BLE provisioning latency traces"""
+                try:
+                    limit = int(query_params.get('limit', ['50'])[0])
+                except ValueError:
+                    self._set_headers(status_code=400)
+                    self.wfile.write(json.dumps({"success": False, "error": "Invalid 'limit' query parameter."}).encode())
+                    return
+
+                result = get_ble_session_traces(limit)
+                self._set_headers()
+                self.wfile.write(json.dumps({"success": True, "data": result}).encode())
+
+            def _handle_ble_metrics(self):
+                """Handle GET /api/ble/metrics - cumulative BLE provisioning counters and histograms"""
+                gatt_manager = getattr(self._supervisor, 'gatt_manager', None)
+                metrics = gatt_manager.get_metrics() if gatt_manager else None
+                if metrics is None:
+                    self._set_headers(status_code=503)
+                    self.wfile.write(json.dumps({"success": False, "error": "External GATT server not running."}).encode())
+                    return
+
+                self._set_headers()
+                self.wfile.write(json.dumps({"success": True, "data": metrics}).encode())
+
             def _handle_health_check(self):
                 """Handle health check request, return server status info"""
                 # Calculate server uptime
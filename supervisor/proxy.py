@@ -143,6 +143,8 @@ class SupervisorProxy:
                                 response = self.handle_request_data(payload)
                                 # For new protocol, send JSON response
                                 self._send_json(conn, {'response': response})
+                                # Framed clients (e.g. btgatt-server) may keep the connection open
+                                self._serve_framed(conn)
                                 return
                 except:
                     pass
@@ -166,6 +168,19 @@ class SupervisorProxy:
         except Exception as e:
             self.logger.error(f"Error handling connection: {e}")
 
+    def _serve_framed(self, conn):
+        """Keep answering length-prefixed requests until the client closes"""
+        conn.settimeout(None)
+        while not self.stop_event.is_set():
+            payload = self._recv_json(conn)
+            if payload is None:
+                return
+            if self._is_streaming_command(payload):
+                self.handle_streaming_request(conn, payload)
+                return
+            response = self.handle_request_data(payload)
+            self._send_json(conn, {'response': response})
+
     def _is_streaming_command(self, payload):
         """Check if the command requires streaming response"""
         streaming_commands = ['cmd-ptest']
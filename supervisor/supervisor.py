@@ -778,6 +778,11 @@ class Supervisor:
             "Storage": storage_str,
             "cpu": cpu_load_15min,
         }
+
+        # Cumulative BLE provisioning metrics, while the resident server answers
+        ble_metrics = self.gatt_manager.get_metrics() if self.gatt_manager else None
+        if ble_metrics:
+            payload["BLE Metrics"] = ble_metrics
         return payload
 
     def _post_status(self, host):
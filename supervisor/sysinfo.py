@@ -6,7 +6,8 @@ import threading
 import subprocess
 import time
 import re
-from .const import DEVICE_MODEL_NAME, DEVICE_BUILD_NUMBER
+import json
+from .const import DEVICE_MODEL_NAME, DEVICE_BUILD_NUMBER, EXTERNAL_GATT_SESSION_TRACE_FILE
 from .hardware import LedState
 
 T3R_RELEASE_FILE = "/etc/t3r-release"
@@ -173,6 +174,44 @@ def get_memory_size():
         logging.error(f"Error getting memory size: {e}")
         return ""
 
+def get_ble_session_traces(limit=50):
+    """Read the most recent BLE provisioning session traces written by btgatt-config-server.
+
+    Returns a dict with the newest ``limit`` records (oldest first) and, per
+    phase, the median offset in ms since accept across those records.
+    """
+    sessions = []
+    for path in (EXTERNAL_GATT_SESSION_TRACE_FILE + ".1", EXTERNAL_GATT_SESSION_TRACE_FILE):
+        try:
+            with open(path, 'r') as f:
+                for line in f:
+                    line = line.strip()
+                    if not line:
+                        continue
+                    try:
+                        sessions.append(json.loads(line))
+                    except ValueError:
+                        logging.debug(f"Skipping malformed session trace in {path}")
+        except FileNotFoundError:
+            continue
+        except Exception as e:
+            logging.error(f"Error reading session traces from {path}: {e}")
+
+    if limit > 0:
+        sessions = sessions[-limit:]
+
+    offsets = {}
+    for session in sessions:
+        for phase, offset in session.get("phases", {}).items():
+            offsets.setdefault(phase, []).append(offset)
+
+    median_ms = {}
+    for phase, values in offsets.items():
+        values.sort()
+        median_ms[phase] = values[len(values) // 2]
+
+    return {"count": len(sessions), "median_ms": median_ms, "sessions": sessions}
+
 def get_storage_space():
     """Get storage space size, returns total space (GB) and available space (GB)"""
     try: